@@ -2,13 +2,43 @@
 # Source listing
 #-------------------------------------------------------------------------------
 
-SET(hexapic_SOURCE
-	src/Hexapic.cpp
+SET(hexapic_CORE_SOURCE
 	src/HexaMosaic.cpp
 	src/HexaCrawler.cpp
   src/pca/PCA.cpp
+  src/index/CascadeFilter.cpp
+  src/index/FeatureStore.cpp
+  src/index/IvfPqIndex.cpp
+  src/index/Match.hpp
+  src/assign/TileAssigner.cpp
   src/utils/Verbose.cpp
+  src/utils/FileList.cpp
+  src/utils/ImageDecoder.cpp
+  src/utils/MemoryBudget.cpp
+  src/utils/Channel.cpp
+  src/utils/Channel.hpp
+  src/utils/StageCache.cpp
+  src/utils/StageCache.hpp
+  src/utils/Prefetcher.cpp
+  src/utils/Prefetcher.hpp
+  src/utils/TiffWriter.cpp
+  src/utils/TiffWriter.hpp
   src/utils/Timer.cpp
+  src/utils/Trace.cpp
+  src/utils/Metrics.cpp
+  src/utils/Json.cpp
   src/utils/Types.hpp
+  src/utils/Hash.hpp
+  src/utils/LruCache.hpp
   src/utils/Debugger.hpp
 )
+
+SET(hexapic_SOURCE
+	src/Hexapic.cpp
+)
+
+SET(hexapic_bench_SOURCE
+  src/bench/Bench.cpp
+  src/bench/Synthetic.cpp
+  src/bench/Synthetic.hpp
+)
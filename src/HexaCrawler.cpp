@@ -2,10 +2,20 @@
 #include "HexaMosaic.hpp"
 
 #include "utils/Debugger.hpp"
+#include "utils/FileList.hpp"
+#include "utils/ImageDecoder.hpp"
+#include "utils/Metrics.hpp"
+#include "utils/Timer.hpp"
 #include "utils/Verbose.hpp"
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <limits>
 #include <sstream>
+#include <vector>
+
+#define MIP_MIN_SIZE 32
 
 void HexaCrawler::Crawl(rcString inSrcDir, rcString inDstDir, cInt inTileSize)
 {
@@ -27,7 +37,17 @@ void HexaCrawler::Crawl(rcString inSrcDir, rcString inDstDir, cInt inTileSize)
     boost::filesystem::create_directory(inDstDir);
   }
 
-  Crawl(inSrcDir);
+  vInt mips;
+  MipChain(mTileSize, mips);
+
+  for (int i = 0, n = mips.size(); i < n; i++)
+    boost::filesystem::create_directories(MipFile(mDstDir, mips[i], ""));
+
+  {
+    Metrics::Phase phase("crawl");
+    Crawl(inSrcDir);
+    phase.SetItems(mImgCount);
+  }
   NoticeLine("");
   NoticeLine("Failed    " << mFailedCount << " images");
   NoticeLine("Existing  " << mExistCount << " images");
@@ -37,76 +57,148 @@ void HexaCrawler::Crawl(rcString inSrcDir, rcString inDstDir, cInt inTileSize)
 
 void HexaCrawler::Crawl(const boost::filesystem::path &inPath)
 {
-  static boost::match_results<std::string::const_iterator> what;
-  static boost::regex img_ext(".*(bmp|BMP|jpg|JPG|jpeg|JPEG|png|PNG|tiff|TIFF)");
+  vString files;
+  FileList::Enumerate(inPath.string(), files);
 
-  boost::filesystem::directory_iterator n;
-
-  for (boost::filesystem::directory_iterator i(inPath); i != n; ++i)
+  // Images are decoded and resized independently, only storing the tiles
+  // is serialized
+  #pragma omp parallel for schedule(dynamic, 4)
+  for (int i = 0; i < int(files.size()); i++)
   {
     try
     {
-      if (boost::filesystem::is_directory(i->status()))
-      {
-        Crawl(i->path());
-      }
-      else
-      {
-        if (boost::filesystem::is_regular_file(i->status()) &&
-            boost::regex_match(i->path().string(), what, img_ext, boost::match_default))
-        {
-          Process(i->path().string());
-        }
-      }
+      Process(files[i]);
     }
     catch (const std::exception &ex)
     {
-      ErrorLine(i->path() << " " << ex.what());
+      ErrorLine(files[i] << " " << ex.what());
+    }
+  }
+}
+
+/// @brief Means of inFactor x inFactor blocks of inSrc, from (inX, inY) on.
+/// Column sums of a block row are a contiguous widening add the compiler
+/// vectorizes, Sum must hold inFactor times 255.
+template<typename Sum>
+static void AreaAverage(const cv::Mat &inSrc, cInt inX, cInt inY, cInt inFactor, cv::Mat &out)
+{
+  cInt channels = inSrc.channels();
+  cInt row_size = out.cols * inFactor * channels;
+  cInt area = inFactor * inFactor;
+  std::vector<Sum> columns(row_size);
+  std::vector<Uint32> sums(channels);
+
+  for (int ty = 0; ty < out.rows; ty++)
+  {
+    std::fill(columns.begin(), columns.end(), 0);
+
+    for (int y = inY + ty * inFactor, end = y + inFactor; y < end; y++)
+    {
+      const Uint8 *row = inSrc.ptr<Uint8>(y) + inX * channels;
+      Sum *column = &columns[0];
+
+      for (int i = 0; i < row_size; i++)
+        column[i] += row[i];
+    }
+
+    Uint8 *dst = out.ptr<Uint8>(ty);
+
+    for (int tx = 0; tx < out.cols; tx++)
+    {
+      const Sum *block = &columns[tx * inFactor * channels];
+      std::fill(sums.begin(), sums.end(), 0);
+
+      for (int i = 0; i < inFactor * channels; i += channels)
+        for (int c = 0; c < channels; c++)
+          sums[c] += block[i + c];
+
+      for (int c = 0; c < channels; c++)
+        dst[tx * channels + c] = (sums[c] + area / 2) / area;
     }
   }
 }
 
 void HexaCrawler::Resize(cv::Mat &outImg)
 {
-  int min = std::min<int>(outImg.rows, outImg.cols);
-  int width  = min - (min % mTileSize);
-  int height = min - (min % mTileSize);
-  cv::Mat img_sub;
-  cv::Size size(width, height);
-  cv::Point2f center(outImg.cols / 2, outImg.rows / 2);
-  cv::getRectSubPix(outImg, size, center, img_sub);
-  cv::Mat img_sub_blur;
-  cv::blur(img_sub, img_sub_blur, cv::Size(3, 3));
-  cv::resize(img_sub_blur, outImg, cv::Size(mTileSize, mTileSize));
+  PROFILE("resize");
+  ASSERT(outImg.depth() == CV_8U);
+
+  // The tile covers the whole centered square, every tile pixel is the
+  // mean of the source pixels under it, which also keeps the tile free of
+  // aliasing. Blocks of whole pixels take the fast path, other sides weight
+  // the pixels on the block borders by their covered area.
+  cInt side = std::min<int>(outImg.rows, outImg.cols);
+  cInt factor = side / mTileSize;
+  cInt x0 = (outImg.cols - side) / 2;
+  cInt y0 = (outImg.rows - side) / 2;
+  cv::Mat tile(mTileSize, mTileSize, outImg.type());
+
+  if (side % mTileSize != 0)
+    cv::resize(outImg(cv::Rect(x0, y0, side, side)), tile, tile.size(), 0, 0, cv::INTER_AREA);
+  else if (factor * 255 <= std::numeric_limits<Uint16>::max())
+    AreaAverage<Uint16>(outImg, x0, y0, factor, tile);
+  else
+    AreaAverage<Uint32>(outImg, x0, y0, factor, tile);
+
+  outImg = tile;
 }
 
 void HexaCrawler::Process(rcString inImgName)
 {
+  PROFILE("process-image");
   Notice("Processing `" << inImgName << "'");
 
-  size_t s_pos = inImgName.find_last_of('/') + 1;
-  size_t e_pos = inImgName.find_last_of('.') - s_pos;
-  std::string img_dst = mDstDir + inImgName.substr(s_pos, e_pos) + ".tiff";
-
-  cv::Mat img_color = cv::imread(inImgName);
+  // Let the jpeg decoder downscale while keeping at least twice the tile
+  // size, so Resize() still averages a few pixels into each one of the tile
+  cv::Mat img_color;
+  {
+    PROFILE("decode");
+    img_color = ImageDecoder::Read(inImgName, 2 * mTileSize);
+  }
 
   if (img_color.data == NULL || img_color.rows < mTileSize || img_color.cols < mTileSize)
   {
     ErrorLine(" [failed]");
+    #pragma omp atomic
     mFailedCount++;
     return;
   }
 
   Resize(img_color);
 
+  // Every mip averages 2 x 2 pixels of the one before
+  vInt sizes;
+  MipChain(mTileSize, sizes);
+  std::vector<cv::Mat> mips(sizes.size());
+
+  for (int i = 0, n = sizes.size(); i < n; i++)
+  {
+    const cv::Mat &larger = i == 0 ? img_color : mips[i - 1];
+    mips[i].create(sizes[i], sizes[i], img_color.type());
+    AreaAverage<Uint16>(larger, 0, 0, 2, mips[i]);
+  }
+
+  // Images of different directories may share their names
+  #pragma omp critical (crawler_store)
+  Store(inImgName, img_color, mips);
+}
+
+void HexaCrawler::Store(rcString inImgName, const cv::Mat &inTile, const std::vector<cv::Mat> &inMips)
+{
+  size_t s_pos = inImgName.find_last_of('/') + 1;
+  size_t e_pos = inImgName.find_last_of('.') - s_pos;
+  std::string img_dst = mDstDir + inImgName.substr(s_pos, e_pos) + ".tiff";
+
   int clash_count = 0;
   while (boost::filesystem::exists(img_dst))
   {
     cv::Mat img_existing = cv::imread(img_dst);
-    cv::Mat equal = (img_existing == img_color);
+    cv::Mat equal = (img_existing == inTile);
     int sum = cv::sum(equal)[0];
-    if (sum == img_color.rows*img_color.cols*255)
+    if (sum == inTile.rows*inTile.cols*255)
     {
+      // Tiles of an earlier crawl get their mips now
+      StoreMips(img_dst.substr(mDstDir.size()), inMips, false);
       WarningLine(" [exists]");
       mExistCount++;
       return;
@@ -122,7 +214,63 @@ void HexaCrawler::Process(rcString inImgName)
     }
   }
 
-  cv::imwrite(img_dst, img_color);
+  {
+    PROFILE("imwrite");
+    cv::imwrite(img_dst, inTile);
+    METRIC_ADD("bytes-written", ImageDecoder::FileSize(img_dst));
+  }
+  StoreMips(img_dst.substr(mDstDir.size()), inMips, true);
   mImgCount++;
   NoticeLine(" -> " << img_dst << " [done]");
 }
+
+void HexaCrawler::StoreMips(rcString inRelativeName, const std::vector<cv::Mat> &inMips, cBool inReplace)
+{
+  PROFILE("imwrite-mips");
+
+  for (int i = 0, n = inMips.size(); i < n; i++)
+  {
+    cString mip_dst = MipFile(mDstDir, inMips[i].rows, inRelativeName);
+
+    if (!inReplace && boost::filesystem::exists(mip_dst))
+      continue;
+
+    cv::imwrite(mip_dst, inMips[i]);
+    METRIC_ADD("bytes-written", ImageDecoder::FileSize(mip_dst));
+  }
+}
+
+void HexaCrawler::MipChain(cInt inTileSize, rvInt outSizes)
+{
+  outSizes.clear();
+
+  for (int size = inTileSize / 2; size >= MIP_MIN_SIZE; size /= 2)
+    outSizes.push_back(size);
+}
+
+void HexaCrawler::ListMips(rcString inDatabaseDir, rvInt outSizes)
+{
+  outSizes.clear();
+  boost::system::error_code error;
+  boost::filesystem::directory_iterator it(inDatabaseDir + MIP_DIR, error), end;
+
+  // Directories named by their size, anything else is ignored
+  for (; !error && it != end; it.increment(error))
+  {
+    cString name = it->path().filename().string();
+
+    if (!name.empty() && name.size() < 6 &&
+        name.find_first_not_of("0123456789") == String::npos &&
+        boost::filesystem::is_directory(it->path()))
+      outSizes.push_back(atoi(name.c_str()));
+  }
+
+  std::sort(outSizes.begin(), outSizes.end());
+}
+
+String HexaCrawler::MipFile(rcString inDatabaseDir, cInt inSize, rcString inRelativeName)
+{
+  std::stringstream s;
+  s << inDatabaseDir << MIP_DIR << inSize << "/" << inRelativeName;
+  return s.str();
+}
@@ -3,10 +3,13 @@
 
 #include "utils/Types.hpp"
 #include <boost/filesystem.hpp>
-#include <boost/regex.hpp>
 #include <opencv/cv.h>
 #include <opencv/highgui.h>
 
+// Smaller copies of every tile are kept in <database>/.mip/<size>/, hidden
+// so they aren't part of the database listing
+#define MIP_DIR ".mip/"
+
 DECLARE_CLASS(HexaCrawler)
 
 class HexaCrawler
@@ -20,8 +23,21 @@ public:
   ~HexaCrawler() {}
 
   void Crawl(rcString inSrcDir, rcString inDstDir, cInt inTileSize);
+
+  /// @brief Crops the centered square and area averages it to the tile size
+  /// in a single pass over the crop
   void Resize(cv::Mat &outImg);
 
+  /// @brief Sizes of the mip chain of inTileSize, halving down to 32
+  static void MipChain(cInt inTileSize, rvInt outSizes);
+
+  /// @brief Mip sizes stored below inDatabaseDir, ascending. Directories
+  /// passed to the mip functions end with a slash.
+  static void ListMips(rcString inDatabaseDir, rvInt outSizes);
+
+  /// @brief Mip of size inSize of inRelativeName, a tile below inDatabaseDir
+  static String MipFile(rcString inDatabaseDir, cInt inSize, rcString inRelativeName);
+
 private:
   int mImgCount;
   int mExistCount;
@@ -32,6 +48,8 @@ private:
 
   void Crawl(const boost::filesystem::path &inPath);
   void Process(rcString inImgName);
+  void Store(rcString inImgName, const cv::Mat &inTile, const std::vector<cv::Mat> &inMips);
+  void StoreMips(rcString inRelativeName, const std::vector<cv::Mat> &inMips, cBool inReplace);
 };
 
 #endif // HEXACRAWLER_HDR
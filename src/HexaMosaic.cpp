@@ -1,57 +1,198 @@
 #include "HexaMosaic.hpp"
+#include "HexaCrawler.hpp"
 
+#include "assign/TileAssigner.hpp"
 #include "pca/PCA.hpp"
 #include "utils/Debugger.hpp"
+#include "utils/FileList.hpp"
+#include "utils/Hash.hpp"
+#include "utils/Metrics.hpp"
+#include "utils/ImageDecoder.hpp"
+#include "utils/Prefetcher.hpp"
+#include "utils/TiffWriter.hpp"
+#include "utils/Timer.hpp"
 #include "utils/Verbose.hpp"
 
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
-#include <queue>
 #include <algorithm>
+#include <atomic>
 #include <sstream>
 #include <iostream>
 #include <limits>
 #include <opencv/highgui.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif // _OPENMP
 
 // Unit hexagon (i.e. edge length = 1) with its corners facing north and south
 #define HALF_HEXAGON_WIDTH sinf(M_PI / 3.0f)
 #define HEXAGON_WIDTH      (2.0f * HALF_HEXAGON_WIDTH)
 #define HEXAGON_HEIGHT     2.0f
 
-#define COUNTER_START_VAL 10
-#define INIT_COUNTER(c) int c = COUNTER_START_VAL
+// Hidden, so it isn't part of the database listing itself
+#define CACHE_DIR ".hexapic/"
 
-#define COUNT_DOWN(i, c, v)                       \
-  do {                                            \
-    if (i % (v/COUNTER_START_VAL) == 0 && c >= 0) \
-    {                                             \
-      Notice(c << " ");                           \
-      c--;                                        \
-    }                                             \
-  } while(0)                                      \
+// Every n-th tile also runs the exhaustive search to measure cascade recall
+#define CASCADE_RECALL_SAMPLE 64
+#define CASCADE_RECALL_AT     10
 
-HexaMosaic::HexaMosaic(
-  rcString inSourceImage,
-  rcString inDatabase,
-  cInt inWidth,
-  cInt inHeight,
-  cInt inDimensions,
-  cInt inMinRadius,
-  cFloat inCBRatio
-):
-  mSourceImage(inSourceImage),
-  mWidth(inWidth),
-  mHeight(inHeight),
-  mDimensions(inDimensions),
-  mMinRadius(inMinRadius),
-  mCBRatio(inCBRatio),
-  mNumImages(0)
+// Smallest hexagon a level may subdivide into
+#define MIN_HEX_HEIGHT 8
+
+// A frame keeps the previous image of a changed tile within this distance ratio
+#define SEQUENCE_HYSTERESIS 1.1f
+
+// Upper bound of decoded tiles kept for repainting
+#define TILE_CACHE_SIZE 4096
+
+// Upper bound of tiles decoded ahead of the one being painted, and the
+// loader threads that keep it filled
+#define PREFETCH_WINDOW  64
+#define PREFETCH_THREADS (PREFETCH_WINDOW / 8)
+
+// Tiles per request to the shards, and their candidates if none are given
+#define SHARD_BATCH      256
+#define SHARD_CANDIDATES 64
+
+// Distinguishes the hexagon geometries of all engines, see Scratch
+static std::atomic<Uint64> sGenerations(0);
+
+/// @brief Everything a level keeps between its stages, and a sequence
+/// between its frames
+struct HexaMosaic::Level
+{
+  Level():
+    pca(NULL), store(NULL), index(NULL), cascade(NULL), extracted(false), cacheFeatures(false),
+    sourceKey(0), basisKey(0), projectionKey(0), databaseKey(0) {}
+  ~Level() { ResetBasis(); }
+
+  /// @brief A worker process serving a slice of the database
+  struct Shard
+  {
+    pid_t pid;
+    Channel channel;
+  };
+
+  /// @brief Drops the basis and everything projected with it
+  void ResetBasis()
+  {
+    StopShards();
+    delete pca;
+    delete store;
+    delete index;
+    delete cascade;
+    pca = NULL;
+    store = NULL;
+    index = NULL;
+    cascade = NULL;
+    search.store = NULL;
+    search.index = NULL;
+    search.cascade = NULL;
+    search.dbPixels.release();
+    projected.release();
+    assignment.clear();
+    variants.clear();
+    basisKey = projectionKey = databaseKey = 0;
+  }
+
+  /// @brief Asks the workers to quit and waits for them
+  void StopShards()
+  {
+    for (int s = 0, n = shards.size(); s < n; s++)
+    {
+      const Uint32 quit[2] = {0, 0};
+      shards[s].channel.Send(quit, sizeof(quit));
+      shards[s].channel.Close();
+      waitpid(shards[s].pid, NULL, 0);
+    }
+
+    shards.clear();
+  }
+
+  /// @brief Whether candidates can be looked up, in process or from shards
+  bool HasDatabase() const { return store != NULL || !shards.empty(); }
+
+  PCA *pca;
+  FeatureStore *store;
+  IvfPqIndex *index;
+  CascadeFilter *cascade;
+  Search search;
+  std::vector<Shard> shards; ///< Replace store, index and cascade if not empty
+  bool extracted;
+  bool cacheFeatures;
+  cv::Mat features; ///< Hex rows of the source tiles, empty if not cached
+  cv::Mat projected; ///< Source tiles in pca space, each followed by its variants
+  vInt assignment; ///< Database id per tile
+  vInt variants; ///< Variant of the image of every tile
+
+  // Stage cache keys of the results above, see StageCache
+  Uint64 sourceKey; ///< Source pixels and hexagon geometry
+  Uint64 basisKey;
+  Uint64 projectionKey;
+  Uint64 databaseKey;
+};
+
+HexaMosaic::HexaMosaic(rcString inDatabase, const Options &inOptions):
+  mWidth(inOptions.width),
+  mHeight(inOptions.height),
+  mUseGrayscale(inOptions.grayscale),
+  mChannels(inOptions.grayscale ? 1 : 3),
+  mDimensions(std::min(std::max(inOptions.dimensions, 1), MAX_QUERY_DIMS)),
+  mMinRadius(std::max(inOptions.minRadius, 0)),
+  mCBRatio(inOptions.cbRatio),
+  mQuantization(inOptions.quantization),
+  mRerank(inOptions.rerank),
+  mIndex(inOptions.index),
+  mCandidates(inOptions.candidates),
+  mIvfLists(inOptions.ivfLists),
+  mIvfProbe(inOptions.ivfProbe),
+  mPqSubspaces(inOptions.pqSubspaces),
+  mAssignment(inOptions.assignment),
+  mAssignRounds(inOptions.assignRounds),
+  mAssignPenalty(inOptions.assignPenalty),
+  mCascadeKeep(inOptions.cascadeKeep),
+  mCascadeDims(inOptions.cascadeDims),
+  mRerankPixels(inOptions.rerankPixels),
+  mKeepDatabase(inOptions.keepDatabase),
+  mLevels(std::max(inOptions.levels, 1)),
+  mDetail(inOptions.detail),
+  mChangeThreshold(inOptions.changeThreshold),
+  mShards(std::max(inOptions.shards, 1)),
+  mCompression(std::min(std::max(inOptions.compression, 0), 9)),
+  mVariants(std::min(std::max(inOptions.variants, 1), 4)),
+  mShard(-1),
+  mBudget(inOptions.memoryLimit),
+  mSourceKey(0),
+  mNumImages(0),
+  mBaseWidth(inOptions.width),
+  mBaseHeight(0),
+  mLevel(0),
+  mPrefetcher(NULL),
+  mState(new Level()),
+  mGeneration(0)
 {
   ASSERT(mCBRatio >= 0.0f && mCBRatio <= 1.0f);
 
   mDatabaseDir = inDatabase.at(inDatabase.size() - 1) == '/' ? inDatabase : inDatabase + '/';
-  Crawl(mDatabaseDir);
+  {
+    // The list is cached next to the index, in a directory the listing skips
+    Metrics::Phase phase("crawl-database");
+    boost::system::error_code error;
+    boost::filesystem::create_directories(mDatabaseDir + CACHE_DIR, error);
+    FileList::Cached(mDatabaseDir, mDatabaseDir + CACHE_DIR + "files", mImages);
+    mNumImages = mImages.size();
+    phase.SetItems(mNumImages);
+  }
+
+  if (inOptions.stageCache)
+    mStages.SetDirectory(mDatabaseDir + CACHE_DIR + "stages");
 
   ASSERT_MSG(!mImages.empty(), "Database `%s' doesn't contain images",
              mDatabaseDir.c_str());
@@ -59,13 +200,74 @@ HexaMosaic::HexaMosaic(
   ASSERT_MSG(first.data != NULL && first.rows == first.cols && first.rows > 0,
              "First image `%s' is not valid", mImages.front().c_str());
 
-  mHexHeight = first.rows;
-  mHexRadius = mHexHeight / 2.0f;
-  mHexWidth  = roundf(mHexRadius * HEXAGON_WIDTH);
+  mTileSize = first.rows;
+  HexaCrawler::ListMips(mDatabaseDir, mMipSizes);
+
+  if (inOptions.tileSize > 0)
+  {
+    if (inOptions.tileSize > mTileSize)
+      WarningLine("Tile size " << inOptions.tileSize << " exceeds the database's "
+                  << mTileSize << ", tiles are upscaled");
+
+    mTileSize = inOptions.tileSize;
+  }
+
+  // A shard without images would build an empty store and answer nothing
+  if (mShards > mNumImages)
+  {
+    WarningLine("The database has " << mNumImages << " images, they are split in "
+                << mNumImages << " shards instead of " << mShards);
+    mShards = mNumImages;
+  }
+
+  // Shards answer with their best candidates only, and don't see the pixels
+  // of the coordinator's source
+  if (mShards > 1)
+  {
+    if (mCandidates <= 0)
+      mCandidates = SHARD_CANDIDATES;
+
+    if (mRerankPixels > 0)
+    {
+      WarningLine("Pixel re-ranking is disabled with shards");
+      mRerankPixels = 0;
+    }
+  }
+}
+
+HexaMosaic::HexaMosaic(
+  rcString inSourceImage,
+  rcString inDatabase,
+  const Options &inOptions
+):
+  HexaMosaic(inDatabase, inOptions)
+{
+  cv::Mat source;
+  {
+    Metrics::Phase phase("read-source");
+    source = cv::imread(inSourceImage, 1);
+    METRIC_ADD("bytes-read", ImageDecoder::FileSize(inSourceImage));
+  }
+  SetSource(source, inSourceImage);
+}
 
-  mSrcImg = cv::imread(mSourceImage, 1);
-  ASSERT_MSG(mSrcImg.data != NULL && mSrcImg.rows > 0 && mSrcImg.cols > 0, "Invalid input image");
+HexaMosaic::~HexaMosaic()
+{
+  delete mPrefetcher;
+  delete mState;
+}
 
+void HexaMosaic::SetSource(const cv::Mat &inImage, rcString inName)
+{
+  ASSERT_MSG(inImage.data != NULL && inImage.rows > 0 && inImage.cols > 0 &&
+             inImage.type() == CV_8UC3, "Invalid input image");
+  mSourceImage = inName;
+  mSrcImg = inImage;
+  mSourceKey = mStages.IsEnabled() ? StageCache::Hash(mSrcImg, FNV_OFFSET_BASIS) : 0;
+  mWidth = mBaseWidth;
+  mHexHeight = mTileSize;
+  mHexRadius = mHexHeight / 2.0f;
+  mHexWidth  = roundf(mHexRadius * HEXAGON_WIDTH);
 
   // Find mHeight such that the ratio is closest to original
   float orig_ratio = mSrcImg.cols / float(mSrcImg.rows);
@@ -94,7 +296,45 @@ HexaMosaic::HexaMosaic(
             << ") Tiles(" << mWidth << "x" << mHeight << ") Final("
             << mDstWidth << "x" << mDstHeight << ")");
 
+  mBaseHeight = mHeight;
+  SetLevel(0, cv::Mat());
+
+  // The basis and the projected database only depend on the tile size
+  Level &state = *mState;
+  state.extracted = false;
+  state.features.release();
+  state.search.srcPixels.release();
+  state.projected.release();
+  state.assignment.clear();
+  state.variants.clear();
+}
+
+void HexaMosaic::SetLevel(cInt inLevel, const cv::Mat &inDetail)
+{
+  cInt scale = 1 << inLevel;
+
+  // Decoded tiles only fit the hexagons of their level
+  if (inLevel != mLevel)
+    mTileCache.Clear();
+
+  mLevel = inLevel;
+  mHexHeight = roundf(mTileSize / float(scale));
+  mHexRadius = mHexHeight / 2.0f;
+  mHexWidth  = roundf(mHexRadius * HEXAGON_WIDTH);
+  mWidth = mBaseWidth * scale;
+  mHeight = mBaseHeight;
+
+  // Finer levels fill the canvas of the first one with as many rows fit
+  if (inLevel > 0)
+    mHeight = (mDstHeight - mHexHeight * .25f) / (mHexHeight * .75f);
+
+  cFloat dx = mHexRadius * HEXAGON_WIDTH;
+  cFloat dy = mHexRadius * HEXAGON_HEIGHT * (3.0f / 4.0f);
+
   // Cache coordinates, so we can e.g. randomize
+  mCoords.clear();
+  mIndices.clear();
+
   for (int y = 0; y < mHeight; y++)
   {
     for (int x = 0; x < mWidth; x++)
@@ -102,16 +342,35 @@ HexaMosaic::HexaMosaic(
       if (y % 2 == 1 && x == mWidth - 1)
         continue;
 
+      const cv::Point2i location(x, y);
+
+      // Finer levels only cover the detailed parts of the source
+      if (inLevel > 0)
+      {
+        cInt dst_x = (x * dx + ((y % 2) * (dx / 2.0f)));
+        cInt dst_y = (y * dy);
+        const cv::Rect roi = SourceRoi(location);
+
+        if (dst_x + mHexWidth > mDstWidth || dst_y + mHexHeight > mDstHeight ||
+            inDetail.at<Uint8>(roi.y + roi.height / 2, roi.x + roi.width / 2) == 0)
+          continue;
+      }
+
       mIndices.push_back(mCoords.size());
-      mCoords.push_back(cv::Point2i(x, y));
+      mCoords.push_back(location);
     }
   }
   srand(0);
   random_shuffle(mIndices.begin(), mIndices.end());
 
+  mTileCache.SetCapacity(mBudget.Rows(Uint64(mHexWidth) * mHexHeight * 3, 0.125f, TILE_CACHE_SIZE));
+
+  mGeneration = ++sGenerations;
+
   // Precache hexagon mask
   mHexMask.create(mHexHeight, mHexWidth, CV_8UC1);
   mHexMask.setTo(cv::Scalar(0));
+  mHexCoords.clear();
 
   for (int j = -mHexRadius; j < mHexRadius; j++)
   {
@@ -128,203 +387,178 @@ HexaMosaic::HexaMosaic(
     }
   }
 
-#ifndef NDEBUG
-  cv::imwrite("hexmask.jpg", mHexMask);
-#endif // NDEBUG
-}
-
-void HexaMosaic::Im2HexRow(const cv::Mat &in, cv::Mat &out)
-{
-  out.create(1, mHexCoords.size(), CV_8UC3);
+  // The coordinates run row by row from left to right. Truncation repeats
+  // column 0 in some rows, the repeat starts a span of its own.
+  mHexSpans.clear();
 
   for (int i = 0, n = mHexCoords.size(); i < n; i++)
   {
-    cv::Point2i &p = mHexCoords[i];
-    out.at<cv::Vec3b>(0, i) = in.at<cv::Vec3b>(p.y, p.x);
-  }
+    const cv::Point2i &p = mHexCoords[i];
 
-  out = out.reshape(1, 1);
-}
+    if (mHexSpans.empty() || mHexSpans.back().y != p.y ||
+        mHexSpans.back().x + mHexSpans.back().length != p.x)
+    {
+      const Span span = { p.y, p.x, 0, i };
+      mHexSpans.push_back(span);
+    }
 
-void HexaMosaic::Create()
-{
-  // unit dimensions of hexagon facing upwards
-  cFloat unit_dx = HEXAGON_WIDTH;
-  cFloat unit_dy = HEXAGON_HEIGHT * (3.0f / 4.0f);
+    mHexSpans.back().length++;
+  }
 
-  // Compute pca input data from source image
-  cv::Mat pca_input(mCoords.size(), mHexCoords.size() * 3, CV_8UC1);
-  PCA pca(mCoords.size(), mHexCoords.size() * 3);
-  float dx = mSrcImg.cols / float(mWidth);
-  float dy = mSrcImg.rows / float(mHeight);
+  // A variant shows at p what the original shows at the mirror of p. The
+  // pixel grid isn't quite symmetric, a mirror outside the hexagon takes
+  // the nearest pixel inside.
+  cv::Mat pixels(mHexHeight, mHexWidth, CV_32SC1, cv::Scalar(-1));
+  vInt first(mHexHeight, -1), last(mHexHeight, -1);
 
-  for (int i = 0, n = mCoords.size(); i < n; i++)
+  for (int i = 0, n = mHexCoords.size(); i < n; i++)
   {
-    cInt x = mCoords[i].x;
-    cInt y = mCoords[i].y;
-    cInt src_y = (y * dy);
-    cInt src_x = (x * dx + ((y % 2) * (dx / 2.0f)));
-    cv::Rect roi(src_x, src_y, roundf(dx), roundf(dy));
-    cv::Mat data_row, patch_resized, patch = mSrcImg(roi);
-    cv::resize(patch, patch_resized, cv::Size(mHexWidth, mHexHeight));
-    Im2HexRow(patch_resized, data_row);
-    cv::Mat pca_input_row = pca_input.row(i);
-    data_row.copyTo(pca_input_row);
-    pca.AddRow(data_row);
+    const cv::Point2i &p = mHexCoords[i];
+    pixels.at<int>(p.y, p.x) = i;
+    first[p.y] = first[p.y] < 0 ? p.x : std::min(first[p.y], p.x);
+    last[p.y] = std::max(last[p.y], p.x);
   }
 
-  Notice("Performing pca...");
-  pca.Solve(mDimensions);
-#ifndef NDEBUG
+  mVariantPixels.assign(mVariants, vInt());
 
-  // Construct eigenvector images for debugging
-  for (int i = 0; i < mDimensions; i++)
+  for (int v = 1; v < mVariants; v++)
   {
-    cv::Mat eigenvec;
-    cv::Mat correct;
-    pca.GetEigenVector(i, eigenvec);
-    cv::normalize(eigenvec, eigenvec, 255, 0, cv::NORM_MINMAX);
-    eigenvec.convertTo(correct, CV_8UC3);
-    HexRow2Im(correct, eigenvec);
-    std::stringstream s;
-    s << i;
-    std::string entry = "eigenvector-" + s.str() + ".jpg";
-    cv::imwrite(entry, eigenvec);
-  }
+    cInt code = FlipCode(v);
+    vInt &variant = mVariantPixels[v];
+    variant.resize(mHexCoords.size());
 
-#endif // DEBUG
-  NoticeLine("[done]");
+    for (int i = 0, n = mHexCoords.size(); i < n; i++)
+    {
+      int x = code != 0 ? mHexWidth - 1 - mHexCoords[i].x : mHexCoords[i].x;
+      int y = code != 1 ? mHexHeight - 1 - mHexCoords[i].y : mHexCoords[i].y;
 
-  // Compress original image data
-  Notice("Compress source image...");
-  cv::Mat compressed_src_img(pca_input.rows, mDimensions, CV_32FC1);
-  pca.Project(pca_input, compressed_src_img);
-  NoticeLine("[done]");
+      while (first[y] < 0)
+        y += y < mHexHeight / 2 ? 1 : -1;
 
-  // Compress database image data
-  Notice("Compress database...");
-  INIT_COUNTER(compress);
-  cv::Mat compressed_database(mNumImages, mDimensions, CV_32FC1);
-  cv::Mat entry, compressed_entry;
-  for (int i = 0; i < mNumImages; i++)
-  {
-    cv::Mat data_row;
-    LoadImage(mImages[i], data_row);
-    compressed_entry = compressed_database.row(i);
-    pca.Project(data_row, compressed_entry);
-    COUNT_DOWN(i, compress, mNumImages);
+      x = std::min(std::max(x, first[y]), last[y]);
+      variant[i] = pixels.at<int>(y, x);
+    }
   }
-  NoticeLine("[done]");
-
-  // Construct mosaic
-  INIT_COUNTER(mosaic);
-  Notice("Construct mosaic...");
-
-  // prepare destination image
-  cv::Mat dst_img(mDstHeight, mDstWidth, CV_8UC3);
-  cv::Mat dst_img_gray(mDstHeight, mDstWidth, CV_8UC1, cv::Scalar(0));
 
-  dx = mHexRadius * unit_dx;
-  dy = mHexRadius * unit_dy;
-  cv::Mat src_entry, tmp_entry, dst_patch, dst_patch_gray, src_patch;
-  vInt ids;
-  std::vector<cv::Point2i> locations;
+#ifndef NDEBUG
+  if (inLevel == 0)
+    cv::imwrite("hexmask.jpg", mHexMask);
+#endif // NDEBUG
+}
 
+int HexaMosaic::Refine(cv::Mat &outDetail)
+{
+  Metrics::Phase phase("refine", mCoords.size());
+  cv::Mat gray;
+  cv::cvtColor(mSrcImg, gray, CV_BGR2GRAY);
+  outDetail.create(mSrcImg.size(), CV_8UC1);
+  outDetail.setTo(cv::Scalar(0));
+  int refined = 0;
+
+  // A hexagon is subdivided when the luminance under it deviates enough,
+  // only subdivided areas are considered again on the next level
   for (int i = 0, n = mCoords.size(); i < n; i++)
   {
-    const cv::Point2i &loc = mCoords[mIndices[i]];
-    src_entry = compressed_src_img.row(mIndices[i]);
-    // Match with database
-    std::priority_queue<Match> KNN; // All nearest neighbours
+    const cv::Rect roi = SourceRoi(mCoords[i]);
+    cv::Scalar mean, deviation;
+    cv::meanStdDev(gray(roi), mean, deviation);
 
-    for (int k = 0; k < mNumImages; k++)
+    if (deviation[0] > mDetail)
     {
-      tmp_entry = compressed_database.row(k);
-      float dist = GetDistance(src_entry, tmp_entry);
-      KNN.push(Match(k, dist));
+      outDetail(roi).setTo(cv::Scalar(255));
+      refined++;
     }
+  }
 
-    int best_id = KNN.top().id;
-
-    while (!KNN.empty())
-    {
-      // Stop if the image is new
-      if (find(ids.begin(), ids.end(), best_id) == ids.end())
-        break;
+  DebugLine("Level " << mLevel << ": " << refined << " of " << mCoords.size()
+            << " hexagons subdivided");
+  return refined;
+}
 
-      // Stop if the image has no duplicates in a certain radius
-      bool is_used = false;
+HexaMosaic::Scratch &HexaMosaic::ThreadScratch()
+{
+  static thread_local Scratch scratch;
 
-      for (int k = 0, n = locations.size(); k < n; k++)
-      {
-        cInt x = locations[k].x - loc.x;
-        cInt y = locations[k].y - loc.y;
-        cInt r = int(ceil(sqrt(x * x + y * y)));
+  // Size the buffers once for the geometry of the current level
+  if (scratch.generation != mGeneration)
+  {
+    cInt row_size = mHexCoords.size() * mChannels;
+    scratch.generation = mGeneration;
+    scratch.patch.create(mHexHeight, mHexWidth, CV_8UC3);
+    scratch.gray.create(mHexHeight, mHexWidth, CV_8UC1);
+    scratch.row.create(1, row_size, CV_8UC1);
+    scratch.srcRow.create(1, row_size, CV_8UC1);
+    scratch.dbRow.create(1, row_size, CV_8UC1);
+    scratch.variantRow.create(1, row_size, CV_8UC1);
+    scratch.dstHex.create(mHexHeight, mHexWidth, CV_8UC(mChannels));
+    scratch.dstBgr.create(mHexHeight, mHexWidth, CV_8UC3);
+    scratch.dstLab.create(mHexHeight, mHexWidth, CV_8UC3);
+    scratch.srcLab.create(mHexHeight, mHexWidth, CV_8UC3);
+    scratch.difference.create(1, mDimensions, CV_32FC1);
+    scratch.ids.reserve(mNumImages);
+    scratch.distances.reserve(mNumImages);
+    scratch.matches.reserve(mNumImages);
+  }
 
-        if (r <= mMinRadius && ids[k] == best_id)
-        {
-          is_used = true;
-          break;
-        }
-      }
+  return scratch;
+}
 
-      if (!is_used)
-        break;
+template<int Channels>
+void HexaMosaic::GatherSpans(const cv::Mat &in, Uint8 *out) const
+{
+  ASSERT(in.type() == CV_8UC(Channels) && in.rows >= mHexHeight && in.cols >= mHexWidth);
 
-      KNN.pop();
-      best_id = KNN.top().id;
-    }
+  for (int i = 0, n = mHexSpans.size(); i < n; i++)
+  {
+    const Span &span = mHexSpans[i];
+    memcpy(out + span.offset * Channels, in.ptr<Uint8>(span.y) + span.x * Channels,
+           span.length * Channels);
+  }
+}
 
-    ids.push_back(best_id);
-    locations.push_back(loc);
+template<int Channels>
+void HexaMosaic::ScatterSpans(const Uint8 *in, cv::Mat &out) const
+{
+  ASSERT(out.type() == CV_8UC(Channels) && out.rows >= mHexHeight && out.cols >= mHexWidth);
 
-    // Copy hexagon to destination
-    cInt src_y = (loc.y * dy);
-    cInt src_x = (loc.x * dx + ((loc.y % 2) * (dx / 2.0f)));
-    cv::Rect roi(src_x, src_y, mHexWidth, mHexHeight);
-    dst_patch = dst_img(roi);
-    dst_patch_gray = dst_img_gray(roi);
-    src_patch = cv::imread(mImages[best_id], 1);
-    cv::getRectSubPix(src_patch, cv::Size(mHexWidth, mHexHeight),
-                      cv::Point2f(src_patch.cols / 2.0f, src_patch.rows / 2.0f), entry);
-    ColorBalance(entry, pca_input.row(mIndices[i]));
-    entry.copyTo(dst_patch, mHexMask);
-    mHexMask.copyTo(dst_patch_gray, mHexMask);
-#ifndef NDEBUG
-    std::string img_name = mImages[best_id].substr(mImages[best_id].find_last_of('/') + 1);
-    cv::putText(dst_img, img_name,
-                cv::Point(src_x + dx / 3.0f - mHexWidth/2, src_y + dy / 1.5f),
-                CV_FONT_HERSHEY_PLAIN, 0.8,
-                cv::Scalar(255, 0, 255),
-                2);
-#endif // NDEBUG
-    COUNT_DOWN(i, mosaic, n);
+  for (int i = 0, n = mHexSpans.size(); i < n; i++)
+  {
+    const Span &span = mHexSpans[i];
+    memcpy(out.ptr<Uint8>(span.y) + span.x * Channels, in + span.offset * Channels,
+           span.length * Channels);
   }
+}
 
-  // Stich edges with neighbouring pixel on x-axis
-  cv::threshold(dst_img_gray, dst_img_gray, 0.0, 255.0, CV_THRESH_BINARY_INV);
-
-#ifndef NDEBUG
-  cv::imwrite("binary.png", dst_img_gray);
-#endif // NDEBUG
+void HexaMosaic::Im2HexRow(const cv::Mat &in, cv::Mat &out)
+{
+  cInt n = mHexCoords.size();
 
-  for (int y = 0; y < dst_img_gray.rows; y++)
+  if (mUseGrayscale)
   {
-    for (int x = 1; x < dst_img_gray.cols; x++)
+    // Only luminance is matched, the tiles themselves stay in colour
+    cv::Mat gray = in;
+
+    if (in.channels() == 3)
     {
-      if (dst_img_gray.at<Uint8>(y, x) > 0)
-      {
-        while (x < dst_img_gray.cols && dst_img_gray.at<Uint8>(y, x) > 0)
-        {
-          dst_img.at<cv::Vec3b>(y, x) = dst_img.at<cv::Vec3b>(y, x - 1);
-          x++;
-        }
-      }
+      cv::Mat &converted = ThreadScratch().gray;
+      cv::cvtColor(in, converted, CV_BGR2GRAY);
+      gray = converted;
     }
+
+    out.create(1, n, CV_8UC1);
+    GatherSpans<1>(gray, out.ptr<Uint8>(0));
+    return;
   }
 
+  // Channels stay interleaved in a single channel row, created as such so
+  // a caller's row is written in place
+  out.create(1, 3 * n, CV_8UC1);
+  GatherSpans<3>(in, out.ptr<Uint8>(0));
+}
 
-  // Write image to disk
+String HexaMosaic::OutputName()
+{
+  // Name the result after the first level, later ones change the geometry
   int p = mDatabaseDir.substr(0, mDatabaseDir.size() - 1).find_last_of('/') + 1;
   std::string database = mDatabaseDir.substr(p);
   p = mSourceImage.find_last_of('/') + 1;
@@ -332,102 +566,1757 @@ void HexaMosaic::Create()
   std::transform(source.begin(), source.end(), source.begin(), ::tolower);
   std::stringstream s;
   s << "source:" << source
-    << "-mosaic:" << mWidth << "x" << mHeight
+    << "-mosaic:" << mBaseWidth << "x" << mBaseHeight
     << "-pca:" << mDimensions
-    << "-hexdims:"  << mHexWidth << "x" << mHexHeight
-    << "-minradius:" << mMinRadius
-    << "-db:" << database.substr(0, database.size() - 1)
-    << "-cbr:" << mCBRatio
-    << ".tiff";
+    << "-hexdims:"  << mHexWidth << "x" << mHexHeight;
 
-  cv::imwrite(s.str(), dst_img);
-  NoticeLine("[done]");
-  NoticeLine("Resulting image: " << s.str());
-}
+  if (mLevels > 1)
+    s << "-levels:" << mLevels;
 
-void HexaMosaic::LoadImage(rcString inImageName, cv::Mat &out)
-{
-  cv::Mat entry, img;
-  img = cv::imread(inImageName, 1);
-  cv::getRectSubPix(img, cv::Size(mHexWidth, mHexHeight),
-                    cv::Point2f(img.cols / 2.0f, img.rows / 2.0f), entry);
-  Im2HexRow(entry, out);
+  if (mVariants > 1)
+    s << "-variants:" << mVariants;
+
+  s << "-minradius:" << mMinRadius
+    << "-db:" << database.substr(0, database.size() - 1)
+    << "-cbr:" << mCBRatio;
+  return s.str();
 }
 
-void HexaMosaic::Crawl(const boost::filesystem::path &inPath)
+void HexaMosaic::AllocateCanvas(MappedFile &outFile, cv::Mat &outImg, cv::Mat &outMask)
 {
-  static boost::match_results<std::string::const_iterator> what;
-  static boost::regex img_ext(".*(bmp|BMP|jpg|JPG|jpeg|JPEG|png|PNG|tiff|TIFF)");
+  // The destination image is paged to disk when it doesn't fit
+  const Uint64 dst_pixels = Uint64(mDstWidth) * mDstHeight;
+
+  if (!mBudget.Fits(4 * dst_pixels, 0.5f) && outFile.Create(".hexapic-canvas", 4 * dst_pixels))
+  {
+    WarningLine("Memory limit: " << MemoryBudget::Format(4 * dst_pixels)
+                << " canvas is assembled in a memory mapped file");
+    METRIC_ADD("out-of-core-fallbacks", 1);
+    Uint8 *canvas = static_cast<Uint8*>(outFile.Data());
+    outImg = cv::Mat(mDstHeight, mDstWidth, CV_8UC3, canvas);
+    outMask = cv::Mat(mDstHeight, mDstWidth, CV_8UC1, canvas + 3 * dst_pixels);
+  }
+  else
+  {
+    outImg.create(mDstHeight, mDstWidth, CV_8UC3);
+    outMask.create(mDstHeight, mDstWidth, CV_8UC1);
+  }
 
-  boost::filesystem::directory_iterator n;
+  outMask.setTo(cv::Scalar(0));
+}
 
-  for (boost::filesystem::directory_iterator i(inPath); i != n; ++i)
+void HexaMosaic::Stitch(cv::Mat &ioDstImg, const cv::Mat &inGaps, cInt inRowBegin, cInt inRowEnd)
+{
+  // Stich edges with neighbouring pixel on x-axis
+  for (int y = std::max(inRowBegin, 0); y < std::min(inRowEnd, inGaps.rows); y++)
   {
-    try
+    for (int x = 1; x < inGaps.cols; x++)
     {
-      if (boost::filesystem::is_directory(i->status()))
+      if (inGaps.at<Uint8>(y, x) > 0)
       {
-        Crawl(i->path());
-      }
-      else
-      {
-        if (boost::filesystem::is_regular_file(i->status()) &&
-            boost::regex_match(i->path().string(), what, img_ext, boost::match_default))
+        while (x < inGaps.cols && inGaps.at<Uint8>(y, x) > 0)
         {
-          Process(i->path().string());
+          ioDstImg.at<cv::Vec3b>(y, x) = ioDstImg.at<cv::Vec3b>(y, x - 1);
+          x++;
         }
       }
     }
-    catch (const std::exception &ex)
+  }
+}
+
+void HexaMosaic::WriteMosaic(rcString inFile, const cv::Mat &inImg)
+{
+  Metrics::Phase phase("write-mosaic");
+  const size_t dot = inFile.find_last_of('.');
+  cString extension = dot == String::npos ? String() : inFile.substr(dot);
+
+  const bool written = extension == ".tiff" || extension == ".tif" ?
+                       TiffWriter::Write(inFile, inImg, mCompression) :
+                       cv::imwrite(inFile, inImg);
+
+  if (!written)
+    ErrorLine("Unable to write `" << inFile << "'");
+
+  METRIC_ADD("bytes-written", ImageDecoder::FileSize(inFile));
+}
+
+void HexaMosaic::Create()
+{
+  cString file = OutputName() + ".tiff";
+  cv::Mat dst_img, dst_img_gray;
+  MappedFile dst_file;
+  AllocateCanvas(dst_file, dst_img, dst_img_gray);
+
+  // Finer levels are painted over the subdivided parts of the coarser ones
+  cv::Mat detail;
+
+  for (int level = 0; level < mLevels; level++)
+  {
+    if (level > 0)
+    {
+      if (roundf(mTileSize / float(1 << level)) < MIN_HEX_HEIGHT || Refine(detail) == 0)
+        break;
+
+      SetLevel(level, detail);
+
+      // Too few hexagons left to learn a basis from
+      if (int(mCoords.size()) <= 2 * mDimensions)
+        break;
+
+      NoticeLine("Level " << level << ": " << mCoords.size() << " hexagons of "
+                 << mHexWidth << "x" << mHexHeight);
+    }
+
+    // Only one level's workers hold a database at a time
+    if (level == 1)
+      mState->StopShards();
+
+    // The first level stays available to the stages afterwards
+    if (level == 0)
+      CreateLevel(*mState, dst_img, dst_img_gray);
+    else
     {
-      ErrorLine(i->path() << " " << ex.what());
+      Level state;
+      CreateLevel(state, dst_img, dst_img_gray);
     }
   }
+
+  if (mLevel != 0)
+    SetLevel(0, cv::Mat());
+
+  {
+    Metrics::Phase phase("stitch");
+    cv::threshold(dst_img_gray, dst_img_gray, 0.0, 255.0, CV_THRESH_BINARY_INV);
+
+#ifndef NDEBUG
+    cv::imwrite("binary.png", dst_img_gray);
+#endif // NDEBUG
+
+    Stitch(dst_img, dst_img_gray, 0, dst_img_gray.rows);
+  }
+
+  // Write image to disk
+  Notice("Write mosaic...");
+  WriteMosaic(file, dst_img);
+  NoticeLine("[done]");
+  NoticeLine("Resulting image: " << file);
 }
 
-void HexaMosaic::HexRow2Im(const cv::Mat &in, cv::Mat &out)
+void HexaMosaic::Extract()
 {
-  out.create(mHexHeight, mHexWidth, CV_8UC3);
-  out.setTo(cv::Scalar(0));
+  ASSERT_MSG(mSrcImg.data != NULL, "No source image set");
+  ExtractFeatures(*mState);
+}
 
-  for (int i = 0, n = mHexCoords.size(); i < n; i++)
+void HexaMosaic::Fit()
+{
+  if (!mState->extracted)
+    Extract();
+
+  FitBasis(*mState);
+}
+
+void HexaMosaic::Project()
+{
+  Level &state = *mState;
+
+  if (state.pca == NULL)
+    Fit();
+  else
+  if (!state.extracted)
+    Extract();
+
+  CompressSource(state);
+
+  if (!state.HasDatabase())
   {
-    cv::Point2i &p = mHexCoords[i];
-    out.at<cv::Vec3b>(p.y, p.x) = in.at<cv::Vec3b>(0, i);
+    if (mShards > 1)
+      StartShards(state);
+    else
+      CompressDatabase(state);
   }
 }
 
-void HexaMosaic::ColorBalance(cv::Mat &ioSrc, const cv::Mat &inDst)
+void HexaMosaic::MatchTiles()
 {
-  cv::Mat dst_lab;
-  HexRow2Im(inDst, dst_lab);
-  cvtColor(dst_lab, dst_lab, CV_RGB2Lab);
-  cv::Scalar dst_lab_mean = cv::mean(dst_lab, mHexMask);
+  if (mState->projected.empty() || !mState->HasDatabase())
+    Project();
 
-  cv::Mat src_lab;
-  cvtColor(ioSrc, src_lab, CV_RGB2Lab);
-  cv::Scalar src_lab_mean = cv::mean(src_lab, mHexMask);
+  Place(*mState);
+}
 
-  // Calculate deltas
-  cv::Scalar deltas;
+void HexaMosaic::Assemble(cv::Mat &outMosaic)
+{
+  if (mState->assignment.empty())
+    MatchTiles();
 
-  for (int i = 0; i < 3; i++)
-    deltas[i] = mCBRatio * (dst_lab_mean[i] - src_lab_mean[i]);
+  cv::Mat mask(mDstHeight, mDstWidth, CV_8UC1, cv::Scalar(0));
+  outMosaic.create(mDstHeight, mDstWidth, CV_8UC3);
+  Assemble(*mState, mIndices, outMosaic, mask);
 
-  // Translate X,Y by deltas
-  cv::add(src_lab, deltas, src_lab);
+  Metrics::Phase phase("stitch");
+  cv::threshold(mask, mask, 0.0, 255.0, CV_THRESH_BINARY_INV);
+  Stitch(outMosaic, mask, 0, mask.rows);
+}
 
-  // X,Y to rgb
-  cvtColor(src_lab, ioSrc, CV_Lab2RGB);
+bool HexaMosaic::Encode(const cv::Mat &inMosaic, rcString inExtension, std::vector<Uint8> &outBuffer)
+{
+  Metrics::Phase phase("encode");
+  const bool encoded = cv::imencode(inExtension, inMosaic, outBuffer);
+  METRIC_ADD("bytes-encoded", outBuffer.size());
+  return encoded;
 }
 
+rcvInt HexaMosaic::Placement() const
+{
+  return mState->assignment;
+}
 
-void HexaMosaic::Process(rcString inImgName)
+rcvInt HexaMosaic::Variants() const
 {
-  mImages.push_back(inImgName);
-  mNumImages++;
+  return mState->variants;
 }
 
+void HexaMosaic::CreateSequence(rcvString inFrames)
+{
+  ASSERT(!inFrames.empty());
+
+  if (mLevels > 1)
+  {
+    WarningLine("Sequences are created with a single level");
+    mLevels = 1;
+  }
+
+  cString name = OutputName();
+  const cv::Size frame_size = mSrcImg.size();
+  cv::Mat dst_img, dst_gaps;
+  MappedFile dst_file;
+  AllocateCanvas(dst_file, dst_img, dst_gaps);
+
+  // The first frame builds the basis, database and index everything else reuses
+  Level &level = *mState;
+  Fit();
+  MatchTiles();
+  Assemble(level, mIndices, dst_img, dst_gaps);
+
+  // Every frame paints the same hexagons, so the gaps never change
+  cv::threshold(dst_gaps, dst_gaps, 0.0, 255.0, CV_THRESH_BINARY_INV);
+
+  for (int f = 0, n = inFrames.size(); f < n; f++)
+  {
+    Metrics::Phase phase("frame");
+    int row_begin = 0, row_end = dst_gaps.rows;
+
+    if (f > 0)
+    {
+      {
+        Metrics::Phase phase("read-frame");
+        mSrcImg = cv::imread(inFrames[f], 1);
+        METRIC_ADD("bytes-read", ImageDecoder::FileSize(inFrames[f]));
+      }
+      ASSERT_MSG(mSrcImg.data != NULL, "Invalid frame `%s'", inFrames[f].c_str());
+
+      // The tile geometry follows the first frame
+      if (mSrcImg.size() != frame_size)
+        cv::resize(mSrcImg, mSrcImg, frame_size, 0, 0, cv::INTER_AREA);
+
+      vInt changed;
+      DetectChanges(level, changed);
+      NoticeLine("Frame " << f << ": " << changed.size() << " of " << mCoords.size()
+                 << " tiles changed");
+
+      if (!changed.empty())
+      {
+        Rematch(level, changed);
+        Assemble(level, changed, dst_img, dst_gaps);
+      }
+
+      // Only rows below repainted hexagons need stitching again
+      cFloat dy = mHexRadius * HEXAGON_HEIGHT * (3.0f / 4.0f);
+      row_begin = dst_gaps.rows;
+      row_end = 0;
+
+      for (int i = 0, n_changed = changed.size(); i < n_changed; i++)
+      {
+        cInt y = mCoords[changed[i]].y * dy;
+        row_begin = std::min(row_begin, y);
+        row_end = std::max(row_end, y + mHexHeight);
+      }
+    }
+
+    {
+      Metrics::Phase phase("stitch");
+      Stitch(dst_img, dst_gaps, row_begin, row_end);
+    }
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "-frame:%06d.tiff", f);
+    WriteMosaic(name + suffix, dst_img);
+    METRIC_ADD("frames", 1);
+  }
+
+  NoticeLine("Resulting images: " << name << "-frame:*.tiff");
+}
+
+void HexaMosaic::CreateLevel(Level &ioLevel, cv::Mat &ioDstImg, cv::Mat &ioDstMask)
+{
+  ExtractFeatures(ioLevel);
+  FitBasis(ioLevel);
+  CompressSource(ioLevel);
+
+  if (mShards > 1)
+    StartShards(ioLevel);
+  else
+    CompressDatabase(ioLevel);
+
+  Place(ioLevel);
+  Assemble(ioLevel, mIndices, ioDstImg, ioDstMask);
+}
+
+void HexaMosaic::ExtractFeatures(Level &ioLevel)
+{
+  // Features of every tile are needed for projection and color balance,
+  // they are cached unless they take too much of the memory budget
+  cInt n_tiles = mCoords.size();
+  cInt feature_size = mHexCoords.size() * mChannels;
+  ioLevel.cacheFeatures = mBudget.Fits(Uint64(n_tiles) * feature_size, 0.25f);
+  ioLevel.extracted = true;
+
+  // The tiles of a level follow from the source, the hexagon size and
+  // the subdivided regions, i.e. their coordinates
+  cInt geometry[5] = { mChannels, mTileSize, mHexWidth, mHexHeight, mLevel };
+  ioLevel.sourceKey = Hash(geometry, sizeof(geometry), mSourceKey);
+  ioLevel.sourceKey = Hash(&mCoords[0], mCoords.size() * sizeof(cv::Point2i), ioLevel.sourceKey);
+  DebugLine("Feature size: " << feature_size << " bytes"
+            << (mUseGrayscale ? " (grayscale)" : " (color)"));
+
+  if (!ioLevel.cacheFeatures)
+  {
+    WarningLine("Memory limit: source features are recomputed instead of cached");
+    METRIC_ADD("out-of-core-fallbacks", 1);
+    ioLevel.features.release();
+    ioLevel.search.srcPixels.release();
+    return;
+  }
+
+  Metrics::Phase phase("extract-features", n_tiles);
+  ioLevel.features.create(n_tiles, feature_size, CV_8UC1);
+
+  for (int i = 0; i < n_tiles; i++)
+  {
+    cv::Mat pca_input_row = ioLevel.features.row(i);
+    SourceRow(i, pca_input_row);
+  }
+
+  ioLevel.search.srcPixels = ioLevel.features;
+}
+
+void HexaMosaic::FitBasis(Level &ioLevel)
+{
+  // The pca basis is learned from evenly spread tiles, at most one per
+  // feature dimension and as many as its data and gram matrix leave room for
+  cInt n_tiles = mCoords.size();
+  cInt feature_size = mHexCoords.size() * mChannels;
+  int pca_rows = std::min<int>(n_tiles, feature_size);
+  while (pca_rows > 2 * mDimensions &&
+         !mBudget.Fits(Uint64(pca_rows) * feature_size * sizeof(float) +
+                       3 * Uint64(pca_rows) * pca_rows * sizeof(float), 0.5f))
+    pca_rows /= 2;
+
+  if (pca_rows < n_tiles)
+    DebugLine("Pca trained on " << pca_rows << " of " << n_tiles << " tiles");
+
+  ioLevel.ResetBasis();
+  cInt shape[2] = { mDimensions, pca_rows };
+  ioLevel.basisKey = Hash(shape, sizeof(shape), ioLevel.sourceKey);
+  cv::Mat basis;
+
+  if (mStages.Load("basis", ioLevel.basisKey, basis) && basis.rows == mDimensions + 1 &&
+      basis.cols == feature_size)
+  {
+    ioLevel.pca = new PCA();
+    ioLevel.pca->Import(basis);
+    NoticeLine("Loaded pca basis from the stage cache");
+    return;
+  }
+
+  ioLevel.pca = new PCA(pca_rows, feature_size);
+  PCA &pca = *ioLevel.pca;
+  cv::Mat data_row;
+
+  for (int k = 0; k < pca_rows; k++)
+  {
+    cInt i = Uint64(k) * n_tiles / pca_rows;
+
+    if (ioLevel.cacheFeatures)
+      data_row = ioLevel.features.row(i);
+    else
+      SourceRow(i, data_row);
+
+    pca.AddRow(data_row);
+  }
+
+  Notice("Performing pca...");
+  {
+    Metrics::Phase phase("pca-solve");
+    pca.Solve(mDimensions);
+  }
+
+  pca.Export(basis);
+  mStages.Save("basis", ioLevel.basisKey, basis);
+#ifndef NDEBUG
+
+  // Construct eigenvector images for debugging
+  for (int i = 0; i < mDimensions; i++)
+  {
+    cv::Mat eigenvec;
+    cv::Mat correct;
+    pca.GetEigenVector(i, eigenvec);
+    cv::normalize(eigenvec, eigenvec, 255, 0, cv::NORM_MINMAX);
+    eigenvec.convertTo(correct, CV_8UC(mChannels));
+    HexRow2Im(correct, eigenvec);
+    std::stringstream s;
+    s << i;
+    std::string entry = "eigenvector-" + s.str() + ".jpg";
+    cv::imwrite(entry, eigenvec);
+  }
+
+#endif // DEBUG
+  NoticeLine("[done]");
+}
+
+void HexaMosaic::CompressSource(Level &ioLevel)
+{
+  cInt n_tiles = mCoords.size();
+  cInt feature_size = mHexCoords.size() * mChannels;
+  const Uint64 keys[2] = { ioLevel.sourceKey, ioLevel.basisKey };
+  ioLevel.projectionKey = Hash(keys, sizeof(keys));
+  ioLevel.projectionKey = Hash(&mVariants, sizeof(mVariants), ioLevel.projectionKey);
+
+  if (mStages.Load("projection", ioLevel.projectionKey, ioLevel.projected) &&
+      ioLevel.projected.rows == n_tiles * mVariants && ioLevel.projected.cols == mDimensions)
+  {
+    NoticeLine("Loaded source projection from the stage cache");
+    return;
+  }
+
+  // Compress original image data, in blocks when memory is limited since
+  // the projection holds float copies of its input and output
+  Notice("Compress source image...");
+  ioLevel.projected.create(n_tiles * mVariants, mDimensions, CV_32FC1);
+  {
+    Metrics::Phase phase("compress-source", n_tiles);
+    cInt block = mBudget.Rows(2 * mVariants * feature_size * sizeof(float), 0.125f, n_tiles);
+    cv::Mat block_input;
+
+    for (int i = 0; i < n_tiles; i += block)
+    {
+      cInt rows = std::min<int>(block, n_tiles - i);
+
+      if (ioLevel.cacheFeatures)
+        block_input = ioLevel.features.rowRange(i, i + rows);
+      else
+      {
+        block_input.create(rows, feature_size, CV_8UC1);
+
+        for (int r = 0; r < rows; r++)
+        {
+          cv::Mat block_row = block_input.row(r);
+          SourceRow(i + r, block_row);
+        }
+      }
+
+      cv::Mat compressed_block = ioLevel.projected.rowRange(i * mVariants, (i + rows) * mVariants);
+      ProjectVariants(ioLevel, block_input, compressed_block);
+    }
+  }
+  NoticeLine("[done]");
+
+  mStages.Save("projection", ioLevel.projectionKey, ioLevel.projected);
+}
+
+void HexaMosaic::CompressDatabase(Level &ioLevel)
+{
+  // Pixel re-ranking needs the decoded rows, so it always decodes
+  cv::Mat compressed_database;
+  Search &search = ioLevel.search;
+  ioLevel.databaseKey = HashImages(ioLevel.basisKey);
+
+  if (mRerankPixels == 0 &&
+      mStages.Load("database", ioLevel.databaseKey, compressed_database) &&
+      compressed_database.rows == mNumImages && compressed_database.cols == mDimensions)
+    NoticeLine("Loaded projected database from the stage cache");
+  else
+  {
+    ProjectDatabase(ioLevel, compressed_database);
+    mStages.Save("database", ioLevel.databaseKey, compressed_database);
+  }
+
+  // Move the database into its search representation, the ivfpq index
+  // only needs the (quantized) features to re-rank its candidates
+  ioLevel.index = new IvfPqIndex(std::max<int>(mIvfLists, 1), mPqSubspaces);
+  if (mIndex == IVFPQ)
+    BuildIndex(compressed_database, *ioLevel.index);
+
+  // Quantize harder rather than exceeding the budget
+  FeatureStore::Format quantization = mQuantization;
+  const Uint64 float_bytes = Uint64(mNumImages) * mDimensions * sizeof(float);
+  if (quantization == FeatureStore::FLOAT32 && !mBudget.Fits(float_bytes, 0.25f))
+    quantization = mBudget.Fits(float_bytes / 2, 0.25f) ? FeatureStore::FLOAT16 : FeatureStore::INT8;
+  if (quantization == FeatureStore::FLOAT16 && !mBudget.Fits(float_bytes / 2, 0.25f))
+    quantization = FeatureStore::INT8;
+
+  if (quantization != mQuantization)
+  {
+    WarningLine("Memory limit: database features stored as "
+                << (quantization == FeatureStore::FLOAT16 ? "fp16" : "int8"));
+    METRIC_ADD("out-of-core-fallbacks", 1);
+  }
+
+  ioLevel.store = new FeatureStore(quantization, mRerank > 0);
+  if (mIndex == EXACT || mRerank > 0)
+    ioLevel.store->Build(compressed_database);
+
+  // Leading components rank the whole database before the full distance
+  ioLevel.cascade = new CascadeFilter(std::min(mCascadeDims, mDimensions));
+  if (mIndex == EXACT && mCascadeKeep > 0.0f)
+  {
+    ioLevel.cascade->Build(compressed_database);
+    DebugLine("Cascade filter: " << ioLevel.cascade->Bytes() << " bytes, keeps "
+              << mCascadeKeep * 100.0f << "% of the database");
+  }
+
+  compressed_database.release();
+  DebugLine("Database store: " << ioLevel.store->Bytes() << " bytes");
+
+  search.store = ioLevel.store;
+  search.index = ioLevel.index;
+  search.cascade = ioLevel.cascade;
+}
+
+void HexaMosaic::ProjectDatabase(Level &ioLevel, cv::Mat &outDatabase)
+{
+  // Compress database image data, pixel re-ranking also keeps the raw
+  // rows around if they fit, it decodes the tiles again otherwise
+  Notice("Compress database...");
+  cInt feature_size = mHexCoords.size() * mChannels;
+  outDatabase.create(mNumImages, mDimensions, CV_32FC1);
+  cv::Mat compressed_entry;
+  Search &search = ioLevel.search;
+
+  // The decoded database only depends on the hexagons of the first level,
+  // so an engine that keeps it decodes it once for all of its sources
+  const bool keep_rows = mKeepDatabase && mLevel == 0;
+  const bool decode = !keep_rows || mDatabaseRows.empty();
+
+  if (keep_rows && mDatabaseRows.empty() && mBudget.Fits(Uint64(mNumImages) * feature_size, 0.25f))
+    mDatabaseRows.create(mNumImages, feature_size, CV_8UC1);
+
+  if (!decode)
+    METRIC_ADD("database-rows-hits", 1);
+  else
+  if (keep_rows)
+    METRIC_ADD("database-rows-misses", 1);
+
+  if (mRerankPixels > 0)
+  {
+    if (keep_rows && !mDatabaseRows.empty())
+      search.dbPixels = mDatabaseRows;
+    else
+    if (mBudget.Fits(Uint64(mNumImages) * feature_size, 0.25f))
+      search.dbPixels.create(mNumImages, feature_size, CV_8UC1);
+  }
+
+  {
+    Metrics::Phase phase("compress-database", mNumImages);
+
+    for (int i = 0; i < mNumImages; i++)
+    {
+      PROFILE("compress-database-entry");
+      cv::Mat data_row;
+
+      if (decode)
+        LoadImage(mImages[i], data_row);
+      else
+        data_row = mDatabaseRows.row(i);
+
+      compressed_entry = outDatabase.row(i);
+      ioLevel.pca->Project(data_row, compressed_entry);
+
+      if (decode && keep_rows && !mDatabaseRows.empty())
+      {
+        cv::Mat kept_row = mDatabaseRows.row(i);
+        data_row.copyTo(kept_row);
+      }
+
+      if (!search.dbPixels.empty() && search.dbPixels.data != mDatabaseRows.data)
+      {
+        cv::Mat pixel_row = search.dbPixels.row(i);
+        data_row.copyTo(pixel_row);
+      }
+
+      Progress(i + 1, mNumImages);
+    }
+  }
+  NoticeLine("[done]");
+}
+
+void HexaMosaic::Place(Level &ioLevel)
+{
+  // Global placement keeps every candidate list in memory at once
+  if (mAssignment == GLOBAL)
+  {
+    cInt max_candidates = mBudget.Rows(Uint64(mCoords.size()) * sizeof(Match), 0.25f, mCandidates);
+
+    if (max_candidates < mCandidates)
+    {
+      WarningLine("Memory limit: global placement uses " << max_candidates
+                  << " instead of " << mCandidates << " candidates per tile");
+      METRIC_ADD("out-of-core-fallbacks", 1);
+      mCandidates = max_candidates;
+    }
+  }
+
+  // Candidates follow from the projections and the search parameters, the
+  // placement also from the tile order and its own parameters
+  cInt n_tiles = mCoords.size();
+  const Uint64 keys[2] = { ioLevel.projectionKey, ioLevel.databaseKey };
+  cInt search[11] = { mIndex, mCandidates, mIvfLists, mIvfProbe, mPqSubspaces, mRerank,
+                      mQuantization, mCascadeDims, mRerankPixels, mShards, mVariants };
+  Uint64 search_key = Hash(keys, sizeof(keys));
+  search_key = Hash(search, sizeof(search), search_key);
+  search_key = Hash(&mCascadeKeep, sizeof(mCascadeKeep), search_key);
+
+  cInt placement[3] = { mMinRadius, mAssignment, mAssignRounds };
+  Uint64 placement_key = Hash(placement, sizeof(placement), search_key);
+  placement_key = Hash(&mAssignPenalty, sizeof(mAssignPenalty), placement_key);
+  placement_key = Hash(&mIndices[0], mIndices.size() * sizeof(int), placement_key);
+  cv::Mat entry;
+
+  // The ids of the placement, followed by their variants
+  if (mStages.Load("placement", placement_key, entry) && entry.rows == 2 && entry.cols == n_tiles)
+  {
+    ioLevel.assignment.assign(entry.ptr<int>(0), entry.ptr<int>(0) + n_tiles);
+    ioLevel.variants.assign(entry.ptr<int>(1), entry.ptr<int>(1) + n_tiles);
+    NoticeLine("Loaded tile placement from the stage cache");
+    return;
+  }
+
+  // Match every tile with the database, bounded candidate lists of all
+  // tiles are kept for runs with other placement parameters
+  Notice("Match tiles...");
+  {
+    Metrics::Phase phase("match", n_tiles);
+    std::vector<vMatch> candidates;
+
+    if (mAssignment == GLOBAL || (mStages.IsEnabled() && mCandidates > 0 &&
+        mBudget.Fits(Uint64(n_tiles) * mCandidates * sizeof(Match), 0.25f)))
+      LoadCandidates(ioLevel, search_key, candidates);
+
+    if (mAssignment == GLOBAL)
+      AssignGlobal(ioLevel, candidates);
+    else
+      AssignGreedy(ioLevel, candidates);
+  }
+  NoticeLine("[done]");
+
+  entry.create(2, n_tiles, CV_32SC1);
+  std::copy(ioLevel.assignment.begin(), ioLevel.assignment.end(), entry.ptr<int>(0));
+  std::copy(ioLevel.variants.begin(), ioLevel.variants.end(), entry.ptr<int>(1));
+  mStages.Save("placement", placement_key, entry);
+}
+
+void HexaMosaic::DetectChanges(Level &ioLevel, rvInt outTiles)
+{
+  Metrics::Phase phase("detect-changes", mCoords.size());
+  cInt n_tiles = mCoords.size();
+  cInt feature_size = mHexCoords.size() * mChannels;
+  std::vector<char> changed(n_tiles, 1);
+
+  // Without the previous features every tile has to be treated as changed
+  if (ioLevel.cacheFeatures)
+  {
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < n_tiles; i++)
+    {
+      cv::Mat &data_row = ThreadScratch().row;
+      SourceRow(i, data_row);
+      cv::Mat prev_row = ioLevel.features.row(i);
+      changed[i] = cv::norm(data_row, prev_row, cv::NORM_L1) > mChangeThreshold * feature_size;
+
+      if (changed[i])
+        data_row.copyTo(prev_row);
+    }
+  }
+
+  // Visit them in the shuffled order of the greedy placement
+  outTiles.clear();
+
+  for (int i = 0; i < n_tiles; i++)
+  {
+    if (changed[mIndices[i]])
+      outTiles.push_back(mIndices[i]);
+  }
+
+  cInt n_changed = outTiles.size();
+  METRIC_ADD("changed-tiles", n_changed);
+
+  if (n_changed == 0)
+    return;
+
+  // Project the changed tiles as one block
+  cv::Mat block_input(n_changed, feature_size, CV_8UC1);
+  cv::Mat block_output(n_changed * mVariants, mDimensions, CV_32FC1);
+
+  for (int i = 0; i < n_changed; i++)
+  {
+    cv::Mat block_row = block_input.row(i);
+
+    if (ioLevel.cacheFeatures)
+      ioLevel.features.row(outTiles[i]).copyTo(block_row);
+    else
+      SourceRow(outTiles[i], block_row);
+  }
+
+  ProjectVariants(ioLevel, block_input, block_output);
+
+  for (int i = 0; i < n_changed; i++)
+  {
+    cv::Mat projected_rows = ioLevel.projected.rowRange(outTiles[i] * mVariants, (outTiles[i] + 1) * mVariants);
+    block_output.rowRange(i * mVariants, (i + 1) * mVariants).copyTo(projected_rows);
+  }
+}
+
+void HexaMosaic::Rematch(Level &ioLevel, rcvInt inTiles)
+{
+  Metrics::Phase phase("rematch", inTiles.size());
+  rvInt assignment = ioLevel.assignment;
+  cInt batch = ioLevel.shards.empty() ? 1 : SHARD_BATCH;
+  std::vector<vMatch> candidates; // Nearest neighbours, closest first
+
+  for (int i = 0, n = inTiles.size(); i < n; i++)
+  {
+    if (i % batch == 0)
+      FetchCandidates(ioLevel, &inTiles[i], std::min(batch, n - i), candidates);
+
+    const vMatch &KNN = candidates[i % batch];
+    cInt tile = inTiles[i];
+    cInt previous = assignment[tile];
+    const cv::Point2i &loc = mCoords[tile];
+
+    // Unchanged tiles keep their images, so duplicates are checked against
+    // the whole current placement
+    assignment[tile] = -1;
+    int best = -1;
+
+    for (int k = 0, n_knn = KNN.size(); k < n_knn; k++)
+    {
+      if (!IsDuplicate(KNN[k].id, loc, assignment, mCoords))
+      {
+        best = k;
+        break;
+      }
+
+      METRIC_ADD("min-radius-rejections", 1);
+    }
+
+    // Without candidates the tile keeps its image
+    if (KNN.empty())
+    {
+      assignment[tile] = previous;
+      continue;
+    }
+
+    // Keep the previous image while it is about as close, against flicker
+    const Match &chosen = KNN[best >= 0 ? best : 0];
+    assignment[tile] = chosen.id;
+    ioLevel.variants[tile] = chosen.variant;
+
+    for (int k = 0, n_knn = KNN.size(); best >= 0 && k < n_knn; k++)
+    {
+      if (KNN[k].id != previous)
+        continue;
+
+      if (KNN[k].val <= KNN[best].val * SEQUENCE_HYSTERESIS &&
+          !IsDuplicate(previous, loc, assignment, mCoords))
+      {
+        assignment[tile] = previous;
+        ioLevel.variants[tile] = KNN[k].variant;
+      }
+
+      break;
+    }
+
+    METRIC_ADD("replaced-tiles", assignment[tile] != previous ? 1 : 0);
+  }
+}
+
+void HexaMosaic::Assemble(
+  const Level &inLevel,
+  rcvInt inTiles,
+  cv::Mat &ioDstImg,
+  cv::Mat &ioDstMask
+)
+{
+  // unit dimensions of hexagon facing upwards
+  cFloat unit_dx = HEXAGON_WIDTH;
+  cFloat unit_dy = HEXAGON_HEIGHT * (3.0f / 4.0f);
+
+  // Construct mosaic
+  Notice("Construct mosaic...");
+  cFloat dx = mHexRadius * unit_dx;
+  cFloat dy = mHexRadius * unit_dy;
+  cv::Mat dst_patch, dst_patch_gray, src_row, tile, entry;
+
+  // The tiles missing the cache are known in painting order, so they are
+  // decoded in the background a window ahead of the loop below
+  vInt loads;
+  std::vector<bool> listed(mNumImages, false);
+
+  for (int i = 0, n = inTiles.size(); i < n; i++)
+  {
+    cInt id = inLevel.assignment[inTiles[i]];
+
+    if (id < 0)
+      continue;
+
+    if (!listed[id] && !mTileCache.Contains(id))
+      loads.push_back(id);
+
+    listed[id] = true;
+  }
+
+  // The loader threads live as long as the engine, so levels and frames
+  // don't start new ones
+  if (mPrefetcher == NULL)
+    mPrefetcher = new Prefetcher(PREFETCH_THREADS);
+
+  cInt window = mBudget.Rows(Uint64(mHexWidth) * mHexHeight * 3, 0.125f, PREFETCH_WINDOW);
+  Prefetcher &prefetcher = *mPrefetcher;
+  prefetcher.Start(loads.size(), window,
+    [&](cInt inItem, cv::Mat &out)
+    {
+      PROFILE("load-tile");
+      LoadTile(mImages[loads[inItem]], out);
+    },
+    [&](cInt inItem)
+    {
+      ImageDecoder::Advise(TileFile(mImages[loads[inItem]]));
+    });
+  int next_load = 0;
+
+  {
+    Metrics::Phase phase("assemble", inTiles.size());
+
+    for (int i = 0, n = inTiles.size(); i < n; i++)
+    {
+      const cv::Point2i &loc = mCoords[inTiles[i]];
+      cInt best_id = inLevel.assignment[inTiles[i]];
+
+      if (best_id < 0)
+      {
+        Progress(i + 1, n);
+        continue;
+      }
+
+      // Copy hexagon to destination
+      cInt src_y = (loc.y * dy);
+      cInt src_x = (loc.x * dx + ((loc.y % 2) * (dx / 2.0f)));
+      cv::Rect roi(src_x, src_y, mHexWidth, mHexHeight);
+      dst_patch = ioDstImg(roi);
+      dst_patch_gray = ioDstMask(roi);
+
+      if (mTileCache.Get(best_id, tile))
+        METRIC_ADD("tile-cache-hits", 1);
+      else
+      {
+        // Tiles evicted since the list was made are loaded right here, into
+        // a new buffer, the last one may still be held by the cache
+        tile = cv::Mat();
+
+        if (next_load < int(loads.size()) && loads[next_load] == best_id)
+          prefetcher.Take(next_load++, tile);
+        else
+        {
+          PROFILE("load-tile");
+          LoadTile(mImages[best_id], tile);
+        }
+
+        mTileCache.Put(best_id, tile);
+        METRIC_ADD("tile-cache-misses", 1);
+      }
+
+      // Color balance works in place, the cached tile stays untouched and
+      // variants are flipped only here
+      cInt variant = inLevel.variants[inTiles[i]];
+
+      if (variant > 0)
+        cv::flip(tile, entry, FlipCode(variant));
+      else
+        tile.copyTo(entry);
+
+      if (inLevel.cacheFeatures)
+        ColorBalance(entry, inLevel.features.row(inTiles[i]));
+      else
+      {
+        SourceRow(inTiles[i], src_row);
+        ColorBalance(entry, src_row);
+      }
+      PasteHexagon(entry, dst_patch, dst_patch_gray);
+#ifndef NDEBUG
+      std::string img_name = mImages[best_id].substr(mImages[best_id].find_last_of('/') + 1);
+      cv::putText(ioDstImg, img_name,
+                  cv::Point(src_x + dx / 3.0f - mHexWidth/2, src_y + dy / 1.5f),
+                  CV_FONT_HERSHEY_PLAIN, 0.8,
+                  cv::Scalar(255, 0, 255),
+                  2);
+#endif // NDEBUG
+      Progress(i + 1, n);
+    }
+  }
+
+  // The loader refers to this call's list
+  prefetcher.Finish();
+  NoticeLine("[done]");
+}
+
+cv::Rect HexaMosaic::SourceRoi(const cv::Point2i &inLocation)
+{
+  cFloat dx = mSrcImg.cols / float(mWidth);
+  cFloat dy = mSrcImg.rows / float(mHeight);
+  cInt src_y = (inLocation.y * dy);
+  cInt src_x = (inLocation.x * dx + ((inLocation.y % 2) * (dx / 2.0f)));
+  return cv::Rect(src_x, src_y, roundf(dx), roundf(dy)) &
+         cv::Rect(0, 0, mSrcImg.cols, mSrcImg.rows);
+}
+
+void HexaMosaic::SourceRow(cInt inIndex, cv::Mat &out)
+{
+  cv::Mat &patch_resized = ThreadScratch().patch;
+  const cv::Mat patch = mSrcImg(SourceRoi(mCoords[inIndex]));
+  cv::resize(patch, patch_resized, cv::Size(mHexWidth, mHexHeight));
+
+  // Writes into a caller's row as long as it has the size of a feature
+  Im2HexRow(patch_resized, out);
+}
+
+String HexaMosaic::CoveringMip(rcString inImageName)
+{
+  // The smallest mip covering a hexagon, empty when all are smaller
+  for (int i = 0, n = mMipSizes.size(); i < n; i++)
+    if (mMipSizes[i] >= mHexHeight)
+      return HexaCrawler::MipFile(mDatabaseDir, mMipSizes[i], inImageName.substr(mDatabaseDir.size()));
+
+  return String();
+}
+
+String HexaMosaic::TileFile(rcString inImageName)
+{
+  // A mip missing for this image falls back to the full tile
+  cString mip = CoveringMip(inImageName);
+
+  if (mip.empty())
+    return inImageName;
+
+  if (ImageDecoder::FileSize(mip) > 0)
+  {
+    METRIC_ADD("mip-hits", 1);
+    return mip;
+  }
+
+  METRIC_ADD("mip-misses", 1);
+  return inImageName;
+}
+
+Uint64 HexaMosaic::HashImages(Uint64 inSeed)
+{
+  PROFILE("hash-images");
+  // Size and mtime of every image and of the mip the level reads instead,
+  // a file that is missing or replaced changes the key
+  std::vector<Int64> stamps(4 * mNumImages, -1);
+
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int i = 0; i < mNumImages; i++)
+  {
+    cString mip = CoveringMip(mImages[i]);
+    FileList::Stat(mImages[i], stamps[4 * i], stamps[4 * i + 1]);
+
+    if (!mip.empty())
+      FileList::Stat(mip, stamps[4 * i + 2], stamps[4 * i + 3]);
+  }
+
+  inSeed = Hash(mMipSizes.data(), mMipSizes.size() * sizeof(int), inSeed);
+
+  for (int i = 0; i < mNumImages; i++)
+  {
+    inSeed = Hash(mImages[i], inSeed);
+    inSeed = Hash(&stamps[4 * i], 4 * sizeof(Int64), inSeed);
+  }
+
+  return inSeed;
+}
+
+void HexaMosaic::LoadTile(rcString inImageName, cv::Mat &out)
+{
+  cv::Mat img = ImageDecoder::Read(TileFile(inImageName), mHexHeight);
+
+  // Tiles and mips are larger than the hexagons of finer levels or of a
+  // smaller tile size
+  if (img.rows != mHexHeight)
+    cv::resize(img, img, cv::Size(roundf(img.cols * mHexHeight / float(img.rows)), mHexHeight),
+               0, 0, cv::INTER_AREA);
+
+  cv::getRectSubPix(img, cv::Size(mHexWidth, mHexHeight),
+                    cv::Point2f(img.cols / 2.0f, img.rows / 2.0f), out);
+}
+
+void HexaMosaic::LoadImage(rcString inImageName, cv::Mat &out)
+{
+  cv::Mat entry;
+  LoadTile(inImageName, entry);
+  Im2HexRow(entry, out);
+}
+
+void HexaMosaic::HexRow2Im(const cv::Mat &in, cv::Mat &out)
+{
+  if (mUseGrayscale)
+  {
+    out.create(mHexHeight, mHexWidth, CV_8UC1);
+    out.setTo(cv::Scalar(0));
+    ScatterSpans<1>(in.ptr<Uint8>(0), out);
+    return;
+  }
+
+  out.create(mHexHeight, mHexWidth, CV_8UC3);
+  out.setTo(cv::Scalar(0));
+  ScatterSpans<3>(in.ptr<Uint8>(0), out);
+}
+
+void HexaMosaic::PermuteRow(cInt inVariant, const cv::Mat &in, cv::Mat &out)
+{
+  // Gathers the row of the flipped image from the row of the original
+  ASSERT(inVariant > 0 && inVariant < mVariants && in.data != out.data);
+  const vInt &pixels = mVariantPixels[inVariant];
+  out.create(1, in.cols, CV_8UC1);
+  const Uint8 *src = in.ptr<Uint8>(0);
+  Uint8 *dst = out.ptr<Uint8>(0);
+
+  if (mChannels == 1)
+  {
+    for (int i = 0, n = pixels.size(); i < n; i++)
+      dst[i] = src[pixels[i]];
+
+    return;
+  }
+
+  for (int i = 0, n = pixels.size(); i < n; i++)
+  {
+    dst[3 * i] = src[3 * pixels[i]];
+    dst[3 * i + 1] = src[3 * pixels[i] + 1];
+    dst[3 * i + 2] = src[3 * pixels[i] + 2];
+  }
+}
+
+void HexaMosaic::ProjectVariants(const Level &inLevel, const cv::Mat &inRows, cv::Mat &outProjected)
+{
+  if (mVariants == 1)
+  {
+    inLevel.pca->Project(inRows, outProjected);
+    return;
+  }
+
+  // Every tile is followed by its variants, so the rows of a tile are a
+  // block. Matching the flipped source against the database is matching
+  // the source against the flipped database, which is thus never stored.
+  cv::Mat rows(inRows.rows * mVariants, inRows.cols, CV_8UC1);
+
+  for (int r = 0; r < inRows.rows; r++)
+  {
+    cv::Mat row = rows.row(r * mVariants);
+    inRows.row(r).copyTo(row);
+
+    for (int v = 1; v < mVariants; v++)
+    {
+      row = rows.row(r * mVariants + v);
+      PermuteRow(v, inRows.row(r), row);
+    }
+  }
+
+  inLevel.pca->Project(rows, outProjected);
+}
+
+int HexaMosaic::FlipCode(cInt inVariant)
+{
+  ASSERT(inVariant > 0 && inVariant < 4);
+  const int codes[4] = { 0, 1, 0, -1 };
+  return codes[inVariant];
+}
+
+void HexaMosaic::PasteHexagon(const cv::Mat &inTile, cv::Mat &ioDst, cv::Mat &ioMask) const
+{
+  // Same as copying through mHexMask, without testing every mask pixel
+  ASSERT(inTile.type() == CV_8UC3 && ioDst.type() == CV_8UC3 && ioMask.type() == CV_8UC1);
+
+  for (int i = 0, n = mHexSpans.size(); i < n; i++)
+  {
+    const Span &span = mHexSpans[i];
+    memcpy(ioDst.ptr<Uint8>(span.y) + 3 * span.x, inTile.ptr<Uint8>(span.y) + 3 * span.x,
+           3 * span.length);
+    memset(ioMask.ptr<Uint8>(span.y) + span.x, 255, span.length);
+  }
+}
+
+void HexaMosaic::ColorBalance(cv::Mat &ioSrc, const cv::Mat &inDst)
+{
+  PROFILE("color-balance");
+  Scratch &scratch = ThreadScratch();
+  cv::Mat &dst_lab = scratch.dstLab;
+  HexRow2Im(inDst, scratch.dstHex);
+
+  if (mUseGrayscale)
+  {
+    cvtColor(scratch.dstHex, scratch.dstBgr, CV_GRAY2BGR);
+    cvtColor(scratch.dstBgr, dst_lab, CV_RGB2Lab);
+  }
+  else
+    cvtColor(scratch.dstHex, dst_lab, CV_RGB2Lab);
+
+  cv::Scalar dst_lab_mean = cv::mean(dst_lab, mHexMask);
+
+  cv::Mat &src_lab = scratch.srcLab;
+  cvtColor(ioSrc, src_lab, CV_RGB2Lab);
+  cv::Scalar src_lab_mean = cv::mean(src_lab, mHexMask);
+
+  // Calculate deltas, a grayscale source only says something about lightness
+  cv::Scalar deltas;
+  cInt channels = mUseGrayscale ? 1 : 3;
+
+  for (int i = 0; i < channels; i++)
+    deltas[i] = mCBRatio * (dst_lab_mean[i] - src_lab_mean[i]);
+
+  // Translate X,Y by deltas
+  cv::add(src_lab, deltas, src_lab);
+
+  // X,Y to rgb
+  cvtColor(src_lab, ioSrc, CV_Lab2RGB);
+}
+
+void HexaMosaic::AssignGreedy(Level &ioLevel, const std::vector<vMatch> &inCandidates)
+{
+  rvInt outAssignment = ioLevel.assignment;
+  outAssignment.assign(mCoords.size(), -1);
+  ioLevel.variants.assign(mCoords.size(), 0);
+
+  // Shards answer whole batches of tiles, in process they're looked up one
+  // by one so the candidates of the whole database are never held twice
+  const bool fetch = inCandidates.empty();
+  cInt batch = ioLevel.shards.empty() ? 1 : SHARD_BATCH;
+  vInt ids;
+  std::vector<cv::Point2i> locations;
+  std::vector<vMatch> candidates; // Nearest neighbours, closest first
+  ids.reserve(mCoords.size());
+  locations.reserve(mCoords.size());
+
+  for (int i = 0, n = mCoords.size(); i < n; i++)
+  {
+    if (fetch && i % batch == 0)
+      FetchCandidates(ioLevel, &mIndices[i], std::min(batch, n - i), candidates);
+
+    const vMatch &KNN = fetch ? candidates[i % batch] : inCandidates[mIndices[i]];
+    const cv::Point2i &loc = mCoords[mIndices[i]];
+
+    // Without candidates the tile stays unassigned and isn't painted
+    if (KNN.empty())
+    {
+      Progress(i + 1, n);
+      continue;
+    }
+
+    // Take the nearest image without duplicates in a certain radius
+    int best = 0;
+
+    for (int k = 0, n_knn = KNN.size(); k < n_knn; k++)
+    {
+      if (!IsDuplicate(KNN[k].id, loc, ids, locations))
+      {
+        best = k;
+        break;
+      }
+
+      METRIC_ADD("min-radius-rejections", 1);
+    }
+
+    ids.push_back(KNN[best].id);
+    locations.push_back(loc);
+    outAssignment[mIndices[i]] = KNN[best].id;
+    ioLevel.variants[mIndices[i]] = KNN[best].variant;
+    Progress(i + 1, n);
+  }
+}
+
+void HexaMosaic::AssignGlobal(Level &ioLevel, const std::vector<vMatch> &inCandidates)
+{
+  TileAssigner assigner(mMinRadius, mAssignPenalty, mAssignRounds);
+  assigner.Solve(mCoords, inCandidates, ioLevel.assignment);
+
+  // A list holds an image once, with its closest variant
+  ioLevel.variants.assign(mCoords.size(), 0);
+
+  for (int i = 0, n = mCoords.size(); i < n; i++)
+  {
+    for (int k = 0, n_knn = inCandidates[i].size(); k < n_knn; k++)
+    {
+      if (inCandidates[i][k].id == ioLevel.assignment[i])
+      {
+        ioLevel.variants[i] = inCandidates[i][k].variant;
+        break;
+      }
+    }
+  }
+
+  DebugLine("Global assignment: " << assigner.Rounds() << " rounds, "
+            << assigner.Conflicts() << " duplicates within radius");
+  METRIC_ADD("global-assign-rounds", assigner.Rounds());
+  METRIC_ADD("min-radius-duplicates", assigner.Conflicts());
+}
+
+void HexaMosaic::FetchCandidates(
+  Level &ioLevel,
+  const int *inTiles,
+  cInt inCount,
+  std::vector<vMatch> &outKNN
+)
+{
+  outKNN.resize(inCount);
+
+  if (ioLevel.shards.empty())
+  {
+    #pragma omp parallel for schedule(dynamic, 16) if (inCount > 1)
+    for (int i = 0; i < inCount; i++)
+      FindVariants(inTiles[i], ioLevel.projected.rowRange(inTiles[i] * mVariants, (inTiles[i] + 1) * mVariants),
+                   ioLevel.search, outKNN[i]);
+
+    return;
+  }
+
+  for (int b = 0; b < inCount; b += SHARD_BATCH)
+    QueryShards(ioLevel, inTiles + b, std::min(SHARD_BATCH, inCount - b), &outKNN[b]);
+}
+
+void HexaMosaic::QueryShards(Level &ioLevel, const int *inTiles, cInt inCount, vMatch *outKNN)
+{
+  PROFILE("query-shards");
+  cInt n_shards = ioLevel.shards.size();
+  const Uint32 header[2] = { Uint32(inCount), Uint32(mDimensions) };
+  Scratch &scratch = ThreadScratch();
+  vFloat &rows = scratch.distances;
+  cInt tile_size = mVariants * mDimensions;
+  rows.resize(inCount * tile_size);
+
+  for (int i = 0; i < inCount; i++)
+    std::copy(ioLevel.projected.ptr<float>(inTiles[i] * mVariants),
+              ioLevel.projected.ptr<float>(inTiles[i] * mVariants) + tile_size, &rows[i * tile_size]);
+
+  // Every shard gets the whole batch and searches its slice in parallel to
+  // the others, they read a request completely before answering it
+  for (int s = 0; s < n_shards; s++)
+  {
+    Channel &channel = ioLevel.shards[s].channel;
+    const bool sent = channel.Send(header, sizeof(header)) &&
+                      channel.Send(inTiles, inCount * sizeof(int)) &&
+                      channel.Send(&rows[0], rows.size() * sizeof(float));
+
+    if (!sent)
+    {
+      FatalLine("Shard " << s << " stopped responding");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (int i = 0; i < inCount; i++)
+    outKNN[i].clear();
+
+  vInt &sizes = scratch.ids;
+  std::vector<Match> &matches = scratch.matches;
+  Uint64 bytes = 0;
+  sizes.resize(inCount);
+
+  for (int s = 0; s < n_shards; s++)
+  {
+    Channel &channel = ioLevel.shards[s].channel;
+    bool received = channel.Receive(&sizes[0], inCount * sizeof(int));
+    int total = 0;
+
+    for (int i = 0; i < inCount; i++)
+      total += sizes[i];
+
+    if (received)
+    {
+      matches.resize(total);
+      received = total == 0 || channel.Receive(&matches[0], total * sizeof(Match));
+    }
+
+    if (!received)
+    {
+      FatalLine("Shard " << s << " stopped responding");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0, offset = 0; i < inCount; offset += sizes[i], i++)
+      outKNN[i].insert(outKNN[i].end(), matches.begin() + offset, matches.begin() + offset + sizes[i]);
+
+    bytes += inCount * sizeof(int) + total * sizeof(Match);
+  }
+
+  // Each shard sent its own best, the overall best are among them
+  cInt n_candidates = std::min(mCandidates, mNumImages);
+
+  for (int i = 0; i < inCount; i++)
+  {
+    vMatch &KNN = outKNN[i];
+    cInt n_kept = std::min<int>(n_candidates, KNN.size());
+    std::partial_sort(KNN.begin(), KNN.begin() + n_kept, KNN.end(), Match::Closer);
+    KNN.resize(n_kept);
+  }
+
+  METRIC_ADD("shard-requests", n_shards);
+  METRIC_ADD("shard-bytes", bytes + n_shards * (sizeof(header) + inCount * (sizeof(int) + tile_size * sizeof(float))));
+}
+
+void HexaMosaic::LoadCandidates(Level &ioLevel, const Uint64 inKey, std::vector<vMatch> &outKNN)
+{
+  // Entries hold mCandidates matches per tile, shorter lists end with id -1
+  cInt n_tiles = mCoords.size();
+  cInt row_bytes = mCandidates * sizeof(Match);
+  cv::Mat entry;
+
+  if (mCandidates > 0 && mStages.Load("candidates", inKey, entry) &&
+      entry.rows == n_tiles && entry.cols == row_bytes)
+  {
+    outKNN.resize(n_tiles);
+
+    for (int i = 0; i < n_tiles; i++)
+    {
+      const Match *row = entry.ptr<Match>(i);
+      int n = 0;
+
+      while (n < mCandidates && row[n].id >= 0)
+        n++;
+
+      outKNN[i].assign(row, row + n);
+    }
+
+    return;
+  }
+
+  vInt tiles(n_tiles);
+  for (int i = 0; i < n_tiles; i++)
+    tiles[i] = i;
+
+  FetchCandidates(ioLevel, &tiles[0], n_tiles, outKNN);
+
+  if (mCandidates <= 0 || !mStages.IsEnabled())
+    return;
+
+  entry.create(n_tiles, row_bytes, CV_8UC1);
+
+  for (int i = 0; i < n_tiles; i++)
+  {
+    Match *row = entry.ptr<Match>(i);
+    std::fill(row, row + mCandidates, Match());
+    std::copy(outKNN[i].begin(), outKNN[i].begin() + std::min<int>(outKNN[i].size(), mCandidates), row);
+  }
+
+  mStages.Save("candidates", inKey, entry);
+}
+
+void HexaMosaic::StartShards(Level &ioLevel)
+{
+  Notice("Start " << mShards << " database shards...");
+  ioLevel.databaseKey = HashImages(ioLevel.basisKey);
+
+  // Nothing the parent queued may be written a second time by a child
+  Verbose::Flush();
+
+  for (int s = 0; s < mShards; s++)
+  {
+    Channel coordinator, worker;
+    const pid_t pid = Channel::Pair(coordinator, worker) ? fork() : -1;
+
+    // Without all of its shards the level matches in process
+    if (pid < 0)
+    {
+      coordinator.Close();
+      worker.Close();
+      NoticeLine("[failed]");
+      WarningLine("Unable to start shard " << s << ", the database is matched in process");
+      ioLevel.StopShards();
+      CompressDatabase(ioLevel);
+      return;
+    }
+
+    if (pid == 0)
+    {
+      Verbose::AfterFork();
+      coordinator.Close();
+
+      // The channels of the shards before belong to the coordinator
+      for (int k = 0, n = ioLevel.shards.size(); k < n; k++)
+        ioLevel.shards[k].channel.Close();
+
+      ioLevel.shards.clear();
+      ServeShard(ioLevel, s, worker);
+    }
+
+    worker.Close();
+    Level::Shard shard;
+    shard.pid = pid;
+    shard.channel = coordinator;
+    ioLevel.shards.push_back(shard);
+  }
+  NoticeLine("[done]");
+}
+
+void HexaMosaic::ServeShard(Level &ioLevel, cInt inShard, Channel &ioChannel)
+{
+  // Only the forking thread exists in the child, the pools of the parent are
+  // gone, so neither OpenMP nor OpenCV may hand work to them. The shards are
+  // the parallelism.
+  cv::setNumThreads(0);
+#ifdef _OPENMP
+  omp_set_num_threads(1);
+#endif // _OPENMP
+
+  // The shards share the terminal, only their warnings are of interest
+  Verbose::SetVerbosity(Verbose::WRN);
+
+  cInt begin = Uint64(inShard) * mNumImages / mShards;
+  cInt end = Uint64(inShard + 1) * mNumImages / mShards;
+  mImages = vString(mImages.begin() + begin, mImages.begin() + end);
+  mNumImages = end - begin;
+  mShard = inShard;
+  CompressDatabase(ioLevel);
+
+  Uint32 header[2];
+  vInt tiles, sizes;
+  vFloat rows;
+  vMatch matches, KNN;
+
+  while (ioChannel.Receive(header, sizeof(header)) && header[0] > 0)
+  {
+    cInt count = header[0];
+    ASSERT(int(header[1]) == mDimensions);
+    tiles.resize(count);
+    rows.resize(count * mVariants * mDimensions);
+
+    if (!ioChannel.Receive(&tiles[0], count * sizeof(int)) ||
+        !ioChannel.Receive(&rows[0], rows.size() * sizeof(float)))
+      break;
+
+    sizes.resize(count);
+    matches.clear();
+
+    for (int i = 0; i < count; i++)
+    {
+      cv::Mat tile_rows(mVariants, mDimensions, CV_32FC1, &rows[i * mVariants * mDimensions]);
+      FindVariants(tiles[i], tile_rows, ioLevel.search, KNN);
+
+      // Ids of the coordinator's database
+      for (int k = 0, n = KNN.size(); k < n; k++)
+        KNN[k].id += begin;
+
+      sizes[i] = KNN.size();
+      matches.insert(matches.end(), KNN.begin(), KNN.end());
+    }
+
+    if (!ioChannel.Send(&sizes[0], count * sizeof(int)) ||
+        (!matches.empty() && !ioChannel.Send(&matches[0], matches.size() * sizeof(Match))))
+      break;
+  }
+
+  ioChannel.Close();
+  Verbose::Flush();
+
+  // Nothing of the parent's may run at exit, neither destructors nor handlers
+  _exit(EXIT_SUCCESS);
+}
+
+void HexaMosaic::BuildIndex(const cv::Mat &inDatabase, IvfPqIndex &outIndex)
+{
+  Metrics::Phase phase("build-index");
+
+  // The features depend on the pca basis of the source image, so the key
+  // covers the projected database itself
+  Uint64 key = Hash(inDatabase.ptr<float>(0), inDatabase.total() * sizeof(float));
+  key = Hash(&mPqSubspaces, sizeof(mPqSubspaces), key);
+  key = Hash(&mIvfLists, sizeof(mIvfLists), key);
+  std::stringstream file_name;
+  file_name << mDatabaseDir << CACHE_DIR << "index";
+  if (mLevel > 0)
+    file_name << "-" << mLevel;
+  if (mShard >= 0)
+    file_name << "-shard" << mShard << "of" << mShards;
+  file_name << ".ivfpq";
+  cString file = file_name.str();
+
+  if (outIndex.Load(file, key, inDatabase.rows))
+  {
+    METRIC_ADD("index-cache-hits", 1);
+    NoticeLine("Loaded ivfpq index `" << file << "'");
+    return;
+  }
+
+  cInt lists = mIvfLists > 0 ? mIvfLists : std::max<int>(1, roundf(4.0f * sqrtf(mNumImages)));
+  outIndex = IvfPqIndex(lists, mPqSubspaces);
+  METRIC_ADD("index-cache-misses", 1);
+
+  Notice("Training ivfpq index (" << lists << " lists)...");
+  outIndex.Build(inDatabase);
+  NoticeLine("[done]");
+
+  if (!outIndex.Save(file, key))
+    WarningLine("Unable to store ivfpq index in `" << file << "'");
+
+  DebugLine("Ivfpq index: " << outIndex.Bytes() << " bytes");
+}
+
+void HexaMosaic::FindCandidates(
+  cInt inTile,
+  const cv::Mat &inSrcRow,
+  const Search &inSearch,
+  std::vector<Match> &outKNN,
+  cInt inVariant
+)
+{
+  PROFILE("find-candidates");
+  const FeatureStore &store = *inSearch.store;
+  cInt n_candidates = mCandidates > 0 ? std::min<int>(mCandidates, mNumImages) : mNumImages;
+
+  // Candidates are ranked in the thread's buffers, only the kept ones are
+  // copied to outKNN which thus never holds the whole database
+  Scratch &scratch = ThreadScratch();
+  vInt &ids = scratch.ids;
+  vFloat &distances = scratch.distances;
+  std::vector<Match> &ranked = scratch.matches;
+
+  if (mIndex == IVFPQ)
+  {
+    inSearch.index->Search(inSrcRow.ptr<float>(0), mIvfProbe, n_candidates, ids, distances,
+                           scratch.search);
+
+    outKNN.resize(ids.size());
+    for (int k = 0, n = ids.size(); k < n; k++)
+      outKNN[k] = Match(ids[k], distances[k]);
+  }
+  else
+  if (!inSearch.cascade->IsEmpty())
+  {
+    // Only the survivors of the cheap ranking are scored on all dimensions
+    cInt keep = std::max<int>(ceilf(mCascadeKeep * mNumImages), mCandidates > 0 ? n_candidates : 1);
+    {
+      PROFILE("cascade-filter");
+      inSearch.cascade->Filter(inSrcRow.ptr<float>(0), keep, ids, ranked, distances);
+    }
+    METRIC_ADD("cascade-evaluations", mNumImages);
+
+    distances.resize(ids.size());
+    store.Distances(inSrcRow.ptr<float>(0), ids, &distances[0]);
+    METRIC_ADD("distance-evaluations", ids.size());
+
+    ranked.resize(ids.size());
+    for (int k = 0, n = ids.size(); k < n; k++)
+      ranked[k] = Match(ids[k], distances[k]);
+
+    cInt n_kept = std::min<int>(n_candidates, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + n_kept, ranked.end(), Match::Closer);
+    outKNN.assign(ranked.begin(), ranked.begin() + n_kept);
+
+    // Recall of the cascade against the exhaustive search on a sample of tiles
+    if (inTile % CASCADE_RECALL_SAMPLE == 0)
+    {
+      distances.resize(mNumImages);
+      ranked.resize(mNumImages);
+      store.Distances(inSrcRow.ptr<float>(0), &distances[0]);
+
+      for (int k = 0; k < mNumImages; k++)
+        ranked[k] = Match(k, distances[k]);
+
+      cInt n_recall = std::min<int>(CASCADE_RECALL_AT, n_kept);
+      std::partial_sort(ranked.begin(), ranked.begin() + n_recall, ranked.end(), Match::Closer);
+      int hits = 0;
+
+      for (int k = 0; k < n_recall; k++)
+      {
+        for (int l = 0; l < n_recall; l++)
+        {
+          if (outKNN[l].id == ranked[k].id)
+          {
+            hits++;
+            break;
+          }
+        }
+      }
+
+      METRIC_ADD("cascade-recall-hits", hits);
+      METRIC_ADD("cascade-recall-misses", n_recall - hits);
+    }
+  }
+  else
+  {
+    distances.resize(mNumImages);
+    store.Distances(inSrcRow.ptr<float>(0), &distances[0]);
+    METRIC_ADD("distance-evaluations", mNumImages);
+
+    ranked.resize(mNumImages);
+    for (int k = 0; k < mNumImages; k++)
+      ranked[k] = Match(k, distances[k]);
+
+    std::partial_sort(ranked.begin(), ranked.begin() + n_candidates, ranked.end(), Match::Closer);
+    outKNN.assign(ranked.begin(), ranked.begin() + n_candidates);
+  }
+
+  // Re-rank the best approximate candidates on the exact features
+  if (mRerank > 0 && store.HasExact())
+  {
+    cInt n_rerank = std::min<int>(mRerank, outKNN.size());
+
+    for (int k = 0; k < n_rerank; k++)
+      outKNN[k].val = GetDistance(inSrcRow, store.ExactRow(outKNN[k].id));
+
+    std::sort(outKNN.begin(), outKNN.begin() + n_rerank, Match::Closer);
+    METRIC_ADD("rerank-evaluations", n_rerank);
+  }
+
+  for (int k = 0, n = outKNN.size(); inVariant > 0 && k < n; k++)
+    outKNN[k].variant = inVariant;
+
+  if (mRerankPixels > 0)
+    RerankPixels(inTile, inSearch, outKNN);
+}
+
+void HexaMosaic::FindVariants(
+  cInt inTile,
+  const cv::Mat &inRows,
+  const Search &inSearch,
+  std::vector<Match> &outKNN
+)
+{
+  if (inRows.rows == 1)
+  {
+    FindCandidates(inTile, inRows, inSearch, outKNN);
+    return;
+  }
+
+  // Each variant is searched on its own, the merged list keeps the closest
+  // variant of an image so the min radius still applies to images
+  Scratch &scratch = ThreadScratch();
+  std::vector<Match> &merged = scratch.variants;
+  std::vector<char> &seen = scratch.seen;
+  merged.clear();
+
+  for (int v = 0; v < inRows.rows; v++)
+  {
+    FindCandidates(inTile, inRows.row(v), inSearch, outKNN, v);
+    merged.insert(merged.end(), outKNN.begin(), outKNN.end());
+  }
+
+  std::sort(merged.begin(), merged.end(), Match::CloserById);
+  cInt n_candidates = mCandidates > 0 ? std::min<int>(mCandidates, mNumImages) : mNumImages;
+
+  if (int(seen.size()) < mNumImages)
+    seen.resize(mNumImages, 0);
+
+  outKNN.clear();
+
+  for (int k = 0, n = merged.size(); k < n && int(outKNN.size()) < n_candidates; k++)
+  {
+    if (!seen[merged[k].id])
+    {
+      seen[merged[k].id] = 1;
+      outKNN.push_back(merged[k]);
+    }
+  }
+
+  for (int k = 0, n = outKNN.size(); k < n; k++)
+    seen[outKNN[k].id] = 0;
+}
+
+void HexaMosaic::RerankPixels(cInt inTile, const Search &inSearch, std::vector<Match> &ioKNN)
+{
+  PROFILE("rerank-pixels");
+  cInt n_rerank = std::min<int>(mRerankPixels, ioKNN.size());
+  Scratch &scratch = ThreadScratch();
+  cv::Mat src_row, db_row;
+
+  if (!inSearch.srcPixels.empty())
+    src_row = inSearch.srcPixels.row(inTile);
+  else
+  {
+    SourceRow(inTile, scratch.srcRow);
+    src_row = scratch.srcRow;
+  }
+
+  std::vector<Match> &pixel = scratch.matches;
+  pixel.resize(n_rerank);
+
+  // A list holds a single variant, compared as the flipped source
+  if (n_rerank > 0 && ioKNN.front().variant > 0)
+  {
+    PermuteRow(ioKNN.front().variant, src_row, scratch.variantRow);
+    src_row = scratch.variantRow;
+  }
+
+  for (int k = 0; k < n_rerank; k++)
+  {
+    if (!inSearch.dbPixels.empty())
+      db_row = inSearch.dbPixels.row(ioKNN[k].id);
+    else
+    {
+      LoadImage(mImages[ioKNN[k].id], scratch.dbRow);
+      db_row = scratch.dbRow;
+    }
+
+    pixel[k] = Match(k, cv::norm(src_row, db_row, cv::NORM_L2));
+  }
+
+  METRIC_ADD("rerank-pixel-evaluations", n_rerank);
+
+  // Pixel distances live on another scale than the pca ones, so the ids are
+  // reordered and keep the sorted pca distances for global placement. Ties
+  // keep the pca order without the buffer of a stable sort.
+  std::sort(pixel.begin(), pixel.end(), Match::CloserById);
+  vInt &ids = scratch.ids;
+  ids.resize(n_rerank);
+
+  for (int k = 0; k < n_rerank; k++)
+    ids[k] = ioKNN[pixel[k].id].id;
+
+  for (int k = 0; k < n_rerank; k++)
+    ioKNN[k].id = ids[k];
+}
+
+bool HexaMosaic::IsDuplicate(
+  cInt inId,
+  const cv::Point2i &inLocation,
+  rcvInt inIds,
+  const std::vector<cv::Point2i> &inLocations
+)
+{
+  for (int k = 0, n = inLocations.size(); k < n; k++)
+  {
+    if (inIds[k] != inId)
+      continue;
+
+    cInt x = inLocations[k].x - inLocation.x;
+    cInt y = inLocations[k].y - inLocation.y;
+    cInt r = int(ceil(sqrt(x * x + y * y)));
+
+    if (r <= mMinRadius)
+      return true;
+  }
+
+  return false;
+}
 
 bool HexaMosaic::InHexagon(cFloat inX, cFloat inY, cFloat inRadius)
 {
@@ -438,7 +2327,7 @@ bool HexaMosaic::InHexagon(cFloat inX, cFloat inY, cFloat inRadius)
 
 float HexaMosaic::GetDistance(const cv::Mat &inSrcRow, const cv::Mat &inDataRow)
 {
-  cv::Mat tmp;
+  cv::Mat &tmp = ThreadScratch().difference;
   cv::subtract(inSrcRow, inDataRow, tmp);
   cv::pow(tmp, 2.0, tmp);
   return sqrtf(cv::sum(tmp)[0]);
@@ -3,57 +3,314 @@
 
 #include <string>
 #include <boost/filesystem.hpp>
-#include <boost/regex.hpp>
 #include <opencv/cv.h>
 #include <opencv/highgui.h>
+#include "index/CascadeFilter.hpp"
+#include "index/FeatureStore.hpp"
+#include "index/IvfPqIndex.hpp"
+#include "index/Match.hpp"
+#include "utils/Channel.hpp"
+#include "utils/LruCache.hpp"
+#include "utils/MemoryBudget.hpp"
+#include "utils/StageCache.hpp"
 #include "utils/Types.hpp"
 
+class Prefetcher;
+
 DECLARE_CLASS(HexaMosaic)
 
+/// @brief Mosaic engine, usable as a library
+///
+/// The database is listed once on construction, sources are set as images
+/// in memory. The stages extract, fit, project, match and assemble can be
+/// called one by one, each runs the ones before it that haven't run yet.
+/// A new source keeps the pca basis and the projected database, so calling
+/// MatchTiles without Fit skips both and reuses them.
 class HexaMosaic
 {
 public:
+  enum Assignment
+  {
+    GREEDY, ///< Nearest free candidate in shuffled tile order
+    GLOBAL  ///< Penalized assignment over all tiles at once
+  };
+
+  enum SearchIndex
+  {
+    EXACT, ///< Scan every database feature
+    IVFPQ  ///< Inverted file with product quantized residuals
+  };
+
+  struct Options
+  {
+    Options():
+      width(0),
+      height(0),
+      grayscale(false),
+      dimensions(8),
+      minRadius(5),
+      cbRatio(1.0f),
+      quantization(FeatureStore::FLOAT32),
+      rerank(0),
+      index(EXACT),
+      candidates(0),
+      ivfLists(0),
+      ivfProbe(8),
+      pqSubspaces(4),
+      assignment(GREEDY),
+      assignRounds(10),
+      assignPenalty(-1.0f),
+      cascadeKeep(0.0f),
+      cascadeDims(2),
+      rerankPixels(0),
+      levels(1),
+      detail(20.0f),
+      memoryLimit(0),
+      changeThreshold(4.0f),
+      keepDatabase(false),
+      shards(1),
+      stageCache(true),
+      compression(6),
+      tileSize(0),
+      variants(1) {}
+
+    int width; ///< Width in tiles
+    int height; ///< Height in tiles, 0 derives it from the source ratio
+    bool grayscale; ///< Match on luminance only
+    int dimensions; ///< Pca dimensions, at most MAX_QUERY_DIMS
+    int minRadius; ///< Min radius between duplicates
+    float cbRatio; ///< Color balance shift in [0, 1]
+    FeatureStore::Format quantization; ///< Database storage format
+    int rerank; ///< Re-rank this many candidates on exact features
+    SearchIndex index; ///< Candidate generator
+    int candidates; ///< Candidates per tile, 0 means the whole database
+    int ivfLists; ///< Coarse lists, 0 picks 4 * sqrt(images)
+    int ivfProbe; ///< Coarse lists visited per query
+    int pqSubspaces; ///< Product quantizer subspaces, must divide dimensions
+    Assignment assignment; ///< Placement engine
+    int assignRounds; ///< Max rounds of the global assignment
+    float assignPenalty; ///< Cost of a duplicate in radius, < 0 is more than any match
+    float cascadeKeep; ///< Fraction surviving the cheap ranking, 0 disables it
+    int cascadeDims; ///< Leading pca components of the cheap ranking
+    int rerankPixels; ///< Re-rank this many candidates on raw hex pixels
+    int levels; ///< Hexagon sizes, each level halves the one before
+    float detail; ///< Luminance deviation above which a hexagon is subdivided
+    Uint64 memoryLimit; ///< Max resident bytes, 0 is unlimited
+    float changeThreshold; ///< Mean abs pixel change above which a frame's tile is matched again
+    bool keepDatabase; ///< Keep the decoded database between sources
+    int shards; ///< Worker processes splitting the database, 1 matches in process
+    bool stageCache; ///< Keep stage results in the database's cache directory
+    int compression; ///< Deflate level of written tiffs in [0, 9], 0 is uncompressed
+    int tileSize; ///< Hexagon height of the first level, 0 is the database's tile size
+    int variants; ///< Flips matched per database image, 1 to 4, see FlipCode
+  };
+
+  HexaMosaic(rcString inDatabase, const Options &inOptions);
+
   HexaMosaic(
     rcString inSourceImage,
     rcString inDatabase,
-    cInt inWidth,
-    cInt inHeight,
-    cInt inDimensions,
-    cInt inMinRadius,
-    cFloat inCBRatio
+    const Options &inOptions
   );
 
+  ~HexaMosaic();
+
+  /// @brief Sets the image to build mosaics of, inName is only used to name
+  /// files. Keeps the pca basis and the database of a previous source.
+  void SetSource(const cv::Mat &inImage, rcString inName = "memory");
+
+  /// @brief Cuts the source into hexagon rows
+  void Extract();
+
+  /// @brief Learns the pca basis of the source
+  void Fit();
+
+  /// @brief Projects the source and, once per basis, the database
+  void Project();
+
+  /// @brief Places a database image on every tile
+  void MatchTiles();
+
+  /// @brief Paints and stitches the placed tiles into outMosaic
+  void Assemble(cv::Mat &outMosaic);
+
+  /// @brief Compresses inMosaic in memory, inExtension picks the format
+  static bool Encode(const cv::Mat &inMosaic, rcString inExtension, std::vector<Uint8> &outBuffer);
+
+  /// @brief Database id per tile, empty before MatchTiles
+  rcvInt Placement() const;
+
+  /// @brief Variant of the placed image per tile, see FlipCode, empty before
+  /// MatchTiles
+  rcvInt Variants() const;
+
+  /// @brief cv::flip code of a variant: 1 mirrors, 0 turns upside down and
+  /// -1 rotates by 180 degrees. Variant 0 is the image itself.
+  static int FlipCode(cInt inVariant);
+
+  /// @brief Tile positions in hexagon rows and columns
+  const std::vector<cv::Point2i> &Coordinates() const { return mCoords; }
+
+  rcvString Images() const { return mImages; }
+
+  /// @brief Writes the multi level mosaic of the source to the working directory
   void Create();
 
+  /// @brief Creates one mosaic per frame, inFrames[0] must be the source image.
+  /// The pca basis, database and index of the first frame are reused, only
+  /// tiles whose source changed are matched and painted again.
+  void CreateSequence(rcvString inFrames);
+
 private:
-  struct Match
+  friend class HexaBench;
+
+  struct Level;
+
+  /// @brief Buffers of the per tile paths, one set per thread. They are
+  /// sized from the hexagon geometry and reused, so matching and assembly
+  /// don't allocate once every thread has seen its first tile.
+  struct Scratch
   {
-    Match(): id(-1), val(-1.0f) {}
-    Match(int pid, float v): id(pid), val(v) {}
-    int id;
-    float val;
-    bool operator< (const Match &m) const
-    {
-      return val > m.val;
-    }
+    Scratch(): generation(0) {}
+
+    Uint64 generation; ///< Geometry the buffers were sized for
+    cv::Mat patch; ///< Source region resized to a hexagon
+    cv::Mat gray;
+    cv::Mat row; ///< Hex row of the current patch
+    cv::Mat srcRow;
+    cv::Mat dbRow;
+    cv::Mat variantRow; ///< Source row of a variant, see PermuteRow
+    cv::Mat dstHex; ///< Color balance target as an image
+    cv::Mat dstBgr;
+    cv::Mat dstLab;
+    cv::Mat srcLab;
+    cv::Mat difference;
+    vInt ids;
+    vFloat distances;
+    std::vector<Match> matches;
+    std::vector<Match> variants; ///< Candidates of all variants of a tile
+    std::vector<char> seen; ///< Per database image, while merging variants
+    IvfPqIndex::Workspace search;
+  };
+
+  /// @brief Where the candidates of a level are looked up
+  struct Search
+  {
+    Search(): store(NULL), index(NULL), cascade(NULL) {}
+
+    const FeatureStore *store;
+    const IvfPqIndex *index;
+    const CascadeFilter *cascade;
+    cv::Mat srcPixels; ///< Hex rows of the source tiles, empty if not cached
+    cv::Mat dbPixels; ///< Hex rows of the database, empty if not cached
+  };
+
+  /// @brief Pixels x to x + length - 1 of hexagon row y, a hex row stores
+  /// them from offset on. A hexagon is convex, so a row is mostly one span.
+  struct Span
+  {
+    int y;
+    int x;
+    int length;
+    int offset;
   };
 
+  Scratch &ThreadScratch();
+  void SetLevel(cInt inLevel, const cv::Mat &inDetail);
+  int Refine(cv::Mat &outDetail);
+  HexaMosaic(const HexaMosaic &);
+  HexaMosaic &operator=(const HexaMosaic &);
+
+  void CreateLevel(Level &ioLevel, cv::Mat &ioDstImg, cv::Mat &ioDstMask);
+
+  void ExtractFeatures(Level &ioLevel);
+  void FitBasis(Level &ioLevel);
+  void CompressSource(Level &ioLevel);
+  void CompressDatabase(Level &ioLevel);
+  void ProjectDatabase(Level &ioLevel, cv::Mat &outDatabase);
+  void StartShards(Level &ioLevel);
+  void ServeShard(Level &ioLevel, cInt inShard, Channel &ioChannel);
+  void Place(Level &ioLevel);
+  void Rematch(Level &ioLevel, rcvInt inTiles);
+  void Assemble(const Level &inLevel, rcvInt inTiles, cv::Mat &ioDstImg, cv::Mat &ioDstMask);
+  void DetectChanges(Level &ioLevel, rvInt outTiles);
+
+  String OutputName();
+  void AllocateCanvas(MappedFile &outFile, cv::Mat &outImg, cv::Mat &outMask);
+  void Stitch(cv::Mat &ioDstImg, const cv::Mat &inGaps, cInt inRowBegin, cInt inRowEnd);
+  void WriteMosaic(rcString inFile, const cv::Mat &inImg);
+
   float GetDistance(
     const cv::Mat &inSrcRow,
     const cv::Mat &inDataRow
   );
 
+  /// @brief Candidates of one projected row, tagged as inVariant
+  void FindCandidates(
+    cInt inTile,
+    const cv::Mat &inSrcRow,
+    const Search &inSearch,
+    std::vector<Match> &outKNN,
+    cInt inVariant = 0
+  );
+
+  /// @brief Candidates of every variant row of inRows, the best variant of
+  /// an image only
+  void FindVariants(
+    cInt inTile,
+    const cv::Mat &inRows,
+    const Search &inSearch,
+    std::vector<Match> &outKNN
+  );
+
+  void RerankPixels(cInt inTile, const Search &inSearch, std::vector<Match> &ioKNN);
+
+  /// @brief Candidates of inCount tiles, from the shards if there are any
+  void FetchCandidates(
+    Level &ioLevel,
+    const int *inTiles,
+    cInt inCount,
+    std::vector<vMatch> &outKNN
+  );
+
+  void QueryShards(Level &ioLevel, const int *inTiles, cInt inCount, vMatch *outKNN);
+
+  /// @brief Candidates of every tile, from the stage cache if possible
+  void LoadCandidates(Level &ioLevel, const Uint64 inKey, std::vector<vMatch> &outKNN);
+
+  /// @brief Looks up candidates tile by tile if inCandidates is empty
+  void AssignGreedy(Level &ioLevel, const std::vector<vMatch> &inCandidates);
+  void AssignGlobal(Level &ioLevel, const std::vector<vMatch> &inCandidates);
+
+  void BuildIndex(const cv::Mat &inDatabase, IvfPqIndex &outIndex);
+
+  bool IsDuplicate(
+    cInt inId,
+    const cv::Point2i &inLocation,
+    rcvInt inIds,
+    const std::vector<cv::Point2i> &inLocations
+  );
+
   bool InHexagon(
     cFloat inX,
     cFloat inY,
     cFloat inRadius
   );
 
-  void Crawl(const boost::filesystem::path &inPath);
-  void Process(rcString inImgName);
   void ColorBalance(cv::Mat &ioSrc, const cv::Mat &inDst);
+  cv::Rect SourceRoi(const cv::Point2i &inLocation);
+  void SourceRow(cInt inIndex, cv::Mat &out);
   void Im2HexRow(const cv::Mat &in, cv::Mat &out);
+  void PermuteRow(cInt inVariant, const cv::Mat &in, cv::Mat &out);
+  void ProjectVariants(const Level &inLevel, const cv::Mat &inRows, cv::Mat &outProjected);
   void HexRow2Im(const cv::Mat &in, cv::Mat &out);
+  template<int Channels> void GatherSpans(const cv::Mat &in, Uint8 *out) const;
+  template<int Channels> void ScatterSpans(const Uint8 *in, cv::Mat &out) const;
+  void PasteHexagon(const cv::Mat &inTile, cv::Mat &ioDst, cv::Mat &ioMask) const;
+  String CoveringMip(rcString inImageName);
+  String TileFile(rcString inImageName);
+  Uint64 HashImages(Uint64 inSeed);
+  void LoadTile(rcString inImageName, cv::Mat &out);
   void LoadImage(rcString inImageName, cv::Mat &out);
 
   String mSourceImage;
@@ -62,11 +319,42 @@ private:
   int mWidth;
   int mHeight;
   bool mUseGrayscale;
+  int mChannels;
   int mDimensions;
   int mMinRadius;
   float mCBRatio;
+  FeatureStore::Format mQuantization;
+  int mRerank;
+  SearchIndex mIndex;
+  int mCandidates;
+  int mIvfLists;
+  int mIvfProbe;
+  int mPqSubspaces;
+  Assignment mAssignment;
+  int mAssignRounds;
+  float mAssignPenalty;
+  float mCascadeKeep;
+  int mCascadeDims;
+  int mRerankPixels;
+  bool mKeepDatabase;
+  int mLevels;
+  float mDetail;
+  float mChangeThreshold;
+  int mShards;
+  int mCompression;
+  int mVariants;
+  int mShard; ///< Database slice served by this process, -1 in the coordinator
+  MemoryBudget mBudget;
+  StageCache mStages;
+  Uint64 mSourceKey; ///< Hash of the source pixels, 0 without stage cache
   int mNumImages;
 
+  int mBaseWidth;
+  int mBaseHeight;
+  int mTileSize;
+  vInt mMipSizes; ///< Smaller copies of the tiles in the database, ascending
+  int mLevel;
+
   int mHexWidth;
   int mHexHeight;
   int mHexRadius;
@@ -79,8 +367,15 @@ private:
 
   std::vector<cv::Point2i> mCoords;
   std::vector<cv::Point2i> mHexCoords;
+  std::vector<Span> mHexSpans; ///< Rows of mHexCoords
+  std::vector<vInt> mVariantPixels; ///< Per variant the hex row index of every flipped pixel
   vInt mIndices;
   vString mImages;
+  LruCache<int, cv::Mat> mTileCache; ///< Tiles of the current level by database id
+  Prefetcher *mPrefetcher; ///< Tile loaders of all Assemble calls, started by the first
+  cv::Mat mDatabaseRows; ///< Hex rows of the database on the first level, see keepDatabase
+  Level *mState; ///< Stages of the first level
+  Uint64 mGeneration; ///< Changes with the hexagon geometry, see Scratch
 };
 
 #endif // HEXAMOSAIC_HDR
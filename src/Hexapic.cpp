@@ -6,6 +6,11 @@
 #include "Version.hpp"
 #include "HexaCrawler.hpp"
 #include "HexaMosaic.hpp"
+#include "utils/FileList.hpp"
+#include "utils/MemoryBudget.hpp"
+#include "utils/Metrics.hpp"
+#include "utils/Timer.hpp"
+#include "utils/Trace.hpp"
 #include "utils/Types.hpp"
 #include "utils/Verbose.hpp"
 
@@ -13,29 +18,56 @@ namespace po = boost::program_options;
 
 int main(int argc, char **argv)
 {
-  int tile_size, dimensions, max_radius;
-  float cb_ratio;
+  int tile_size;
+  String quantize, index, assign, memory_limit;
+  HexaMosaic::Options options;
   po::options_description generic("Generic options");
   generic.add_options()
   ("version,v", "print version string")
   ("help,h", "produce help message")
+  ("profile", "print the profiler report when done")
+  ("trace", po::value<String>(), "write a chrome trace-event timeline to this json file")
+  ("metrics", po::value<String>(), "write run metrics to this json file")
   ;
 
   po::options_description crawl("Crawler options");
   crawl.add_options()
   ("image-dir,i", po::value<String>(), "image directory")
   ("output-dir,o", po::value<String>(), "cache directory and database")
-  ("tile-size,t", po::value<int>(&tile_size)->default_value(100), "image tile size")
+  ("tile-size,t", po::value<int>(&tile_size)->default_value(100), "image tile size, with --database the hexagon size of the mosaic")
   ;
 
   po::options_description hexapic("Hexapic options");
   hexapic.add_options()
   ("input-image", po::value<String>(), "source image")
+  ("frames", po::value<String>(), "directory of source frames, one mosaic per frame")
   ("database", po::value<String>(), "database directory")
   ("width", po::value<int>(), "width in tile size")
-  ("dimensions", po::value<int>(&dimensions)->default_value(8), "pca dimensions")
-  ("min-radius", po::value<int>(&max_radius)->default_value(5), "min radius between duplicates")
-  ("cb-ratio", po::value<float>(&cb_ratio)->default_value(1.0), "color balance shift in [0, 1]")
+  ("grayscale", "use grayscale")
+  ("dimensions", po::value<int>(&options.dimensions)->default_value(8), "pca dimensions")
+  ("min-radius", po::value<int>(&options.minRadius)->default_value(5), "min radius between duplicates")
+  ("cb-ratio", po::value<float>(&options.cbRatio)->default_value(1.0), "color balance shift in [0, 1]")
+  ("quantize", po::value<String>(&quantize)->default_value("none"), "database storage: none, fp16 or int8")
+  ("rerank", po::value<int>(&options.rerank)->default_value(0), "re-rank top candidates on exact features")
+  ("index", po::value<String>(&index)->default_value("exact"), "candidate search: exact or ivfpq")
+  ("candidates", po::value<int>(&options.candidates)->default_value(0), "candidates per tile, 0 is all (exact) or 100 (ivfpq)")
+  ("ivf-lists", po::value<int>(&options.ivfLists)->default_value(0), "ivfpq coarse lists, 0 is 4 * sqrt(images)")
+  ("ivf-probe", po::value<int>(&options.ivfProbe)->default_value(8), "ivfpq lists visited per tile")
+  ("pq-subspaces", po::value<int>(&options.pqSubspaces)->default_value(4), "ivfpq subspaces, must divide dimensions")
+  ("assign", po::value<String>(&assign)->default_value("greedy"), "tile placement: greedy or global")
+  ("assign-rounds", po::value<int>(&options.assignRounds)->default_value(10), "max rounds of global placement")
+  ("assign-penalty", po::value<float>(&options.assignPenalty)->default_value(-1.0f), "global placement duplicate cost, < 0 makes duplicates within the radius costlier than any match")
+  ("cascade-keep", po::value<float>(&options.cascadeKeep)->default_value(0.0f), "fraction of the database scored on all dimensions after a cheap ranking, 0 disables it")
+  ("cascade-dims", po::value<int>(&options.cascadeDims)->default_value(2), "leading pca components of the cheap ranking")
+  ("rerank-pixels", po::value<int>(&options.rerankPixels)->default_value(0), "re-rank top candidates on raw hex pixels")
+  ("levels", po::value<int>(&options.levels)->default_value(1), "hexagon sizes, each level halves the previous one")
+  ("detail", po::value<float>(&options.detail)->default_value(20.0f), "luminance deviation above which hexagons are subdivided")
+  ("memory-limit", po::value<String>(&memory_limit)->default_value("0"), "max resident memory, e.g. 2G, 0 is unlimited")
+  ("change-threshold", po::value<float>(&options.changeThreshold)->default_value(4.0f), "mean pixel change above which a frame's tile is matched again")
+  ("shards", po::value<int>(&options.shards)->default_value(1), "worker processes splitting the database, 1 matches in process")
+  ("no-stage-cache", "don't reuse or store intermediate results")
+  ("compression", po::value<int>(&options.compression)->default_value(6), "deflate level of the tiff in [0, 9], 0 is uncompressed")
+  ("variants", po::value<int>(&options.variants)->default_value(1), "flips matched per database image: 1, 2 adds the mirrored, 3 upside down, 4 rotated")
   ;
 
   po::options_description cmdline_options;
@@ -45,6 +77,9 @@ int main(int argc, char **argv)
   po::store(po::parse_command_line(argc, argv, cmdline_options), vm);
   po::notify(vm);
 
+  if (vm.count("trace"))
+    Trace::Enable();
+
   if (vm.count("version"))
   {
     std::cout << std::endl << HUMAN_NAME << std::endl;
@@ -66,14 +101,41 @@ int main(int argc, char **argv)
 
     HexaCrawler hc;
     hc.Crawl(image_dir, output_dir, tile_size);
+
+    if (vm.count("profile"))
+      std::cout << std::endl << Timer::GetReport() << std::endl;
   }
   else
-  if (vm.count("input-image") && vm.count("database") && vm.count("width"))
+  if ((vm.count("input-image") || vm.count("frames")) && vm.count("database") && vm.count("width"))
   {
-    cString input_image  = vm["input-image"].as<String>();
     cString database     = vm["database"].as<String>();
-    cInt width           = vm["width"].as<int>();
-    cInt height          = 0;
+    options.width        = vm["width"].as<int>();
+    options.height       = 0;
+    options.grayscale    = vm.count("grayscale") > 0;
+    options.stageCache   = vm.count("no-stage-cache") == 0;
+    options.tileSize     = vm["tile-size"].defaulted() ? 0 : tile_size;
+    vString frames;
+
+    if (vm.count("frames"))
+    {
+      cString frame_dir = vm["frames"].as<String>();
+
+      if (!boost::filesystem::is_directory(frame_dir))
+      {
+        std::cerr << frame_dir << " isn't a directory" << std::endl;
+        return 1;
+      }
+
+      FileList::Enumerate(frame_dir, frames);
+
+      if (frames.empty())
+      {
+        std::cerr << frame_dir << " doesn't contain images" << std::endl;
+        return 1;
+      }
+    }
+
+    cString input_image  = frames.empty() ? vm["input-image"].as<String>() : frames.front();
 
     if (!boost::filesystem::exists(input_image))
     {
@@ -87,8 +149,134 @@ int main(int argc, char **argv)
       return 1;
     }
 
-    HexaMosaic hm(input_image, database, width, height, dimensions, max_radius, cb_ratio);
-    hm.Create();
+    if (options.dimensions <= 0 || options.dimensions > MAX_QUERY_DIMS)
+    {
+      std::cerr << "dimensions must be in [1, " << MAX_QUERY_DIMS << "]" << std::endl;
+      return 1;
+    }
+
+    if (!FeatureStore::ParseFormat(quantize, options.quantization))
+    {
+      std::cerr << "unknown quantization `" << quantize << "'" << std::endl;
+      return 1;
+    }
+
+    if (index == "ivfpq")
+    {
+      options.index = HexaMosaic::IVFPQ;
+
+      if (options.candidates <= 0)
+        options.candidates = 100;
+
+      if (options.pqSubspaces <= 0 || options.dimensions % options.pqSubspaces != 0)
+      {
+        std::cerr << "pq-subspaces must divide dimensions" << std::endl;
+        return 1;
+      }
+    }
+    else
+    if (index != "exact")
+    {
+      std::cerr << "unknown index `" << index << "'" << std::endl;
+      return 1;
+    }
+
+    if (options.minRadius < 0)
+    {
+      std::cerr << "min-radius must not be negative" << std::endl;
+      return 1;
+    }
+
+    if (assign == "global")
+    {
+      options.assignment = HexaMosaic::GLOBAL;
+
+      // Every tile keeps its candidates in memory, don't keep them all
+      if (options.candidates <= 0)
+        options.candidates = 32;
+
+      if (options.assignRounds <= 0)
+      {
+        std::cerr << "assign-rounds must be positive" << std::endl;
+        return 1;
+      }
+    }
+    else
+    if (assign != "greedy")
+    {
+      std::cerr << "unknown assignment `" << assign << "'" << std::endl;
+      return 1;
+    }
+
+    if (options.cascadeKeep < 0.0f || options.cascadeKeep > 1.0f)
+    {
+      std::cerr << "cascade-keep must be in [0, 1]" << std::endl;
+      return 1;
+    }
+
+    if (options.cascadeKeep > 0.0f && options.index != HexaMosaic::EXACT)
+    {
+      std::cerr << "cascade-keep requires the exact index" << std::endl;
+      return 1;
+    }
+
+    if (options.cascadeDims <= 0 || options.cascadeDims > options.dimensions)
+    {
+      std::cerr << "cascade-dims must be in [1, dimensions]" << std::endl;
+      return 1;
+    }
+
+    if (options.levels <= 0)
+    {
+      std::cerr << "levels must be positive" << std::endl;
+      return 1;
+    }
+
+    if (!MemoryBudget::ParseSize(memory_limit, options.memoryLimit))
+    {
+      std::cerr << "invalid memory-limit `" << memory_limit << "'" << std::endl;
+      return 1;
+    }
+
+    if (options.changeThreshold < 0.0f)
+    {
+      std::cerr << "change-threshold must not be negative" << std::endl;
+      return 1;
+    }
+
+    if (options.compression < 0 || options.compression > 9)
+    {
+      std::cerr << "compression must be in [0, 9]" << std::endl;
+      return 1;
+    }
+
+    if (!vm["tile-size"].defaulted() && tile_size <= 0)
+    {
+      std::cerr << "tile-size must be positive" << std::endl;
+      return 1;
+    }
+
+    if (options.variants < 1 || options.variants > 4)
+    {
+      std::cerr << "variants must be in [1, 4]" << std::endl;
+      return 1;
+    }
+
+    if (options.shards <= 0)
+    {
+      std::cerr << "shards must be positive" << std::endl;
+      return 1;
+    }
+
+    HexaMosaic hm(input_image, database, options);
+
+    if (frames.empty())
+      hm.Create();
+    else
+      hm.CreateSequence(frames);
+
+    if (vm.count("profile"))
+      std::cout << std::endl << Timer::GetReport() << std::endl;
   }
   else
   {
@@ -100,5 +288,27 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  if (vm.count("metrics"))
+  {
+    cString metrics = vm["metrics"].as<String>();
+
+    if (!Metrics::Write(metrics))
+    {
+      std::cerr << "unable to write metrics `" << metrics << "'" << std::endl;
+      return 1;
+    }
+  }
+
+  if (vm.count("trace"))
+  {
+    cString trace = vm["trace"].as<String>();
+
+    if (!Trace::Write(trace))
+    {
+      std::cerr << "unable to write trace `" << trace << "'" << std::endl;
+      return 1;
+    }
+  }
+
   return 0;
 }
@@ -0,0 +1,171 @@
+#include "TileAssigner.hpp"
+
+#include "../utils/Debugger.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+TileAssigner::TileAssigner(cInt inMinRadius, cFloat inPenalty, cInt inRounds):
+  mMinRadius(inMinRadius),
+  mPenalty(inPenalty),
+  mRounds(inRounds),
+  mConflicts(0),
+  mRoundsUsed(0)
+{
+  ASSERT(mMinRadius >= 0);
+  ASSERT(mRounds > 0);
+}
+
+void TileAssigner::FindNeighbours(const std::vector<cv::Point2i> &inLocations)
+{
+  cInt n = inLocations.size();
+  int max_x = 0, max_y = 0;
+
+  for (int i = 0; i < n; i++)
+  {
+    max_x = std::max<int>(max_x, inLocations[i].x);
+    max_y = std::max<int>(max_y, inLocations[i].y);
+  }
+
+  // Grid lookup from location to tile
+  cInt width = max_x + 1;
+  vInt grid(width * (max_y + 1), -1);
+
+  for (int i = 0; i < n; i++)
+    grid[inLocations[i].y * width + inLocations[i].x] = i;
+
+  mNeighbours.assign(n, vInt());
+
+  #pragma omp parallel for
+  for (int i = 0; i < n; i++)
+  {
+    const cv::Point2i &loc = inLocations[i];
+
+    for (int y = std::max<int>(0, loc.y - mMinRadius); y <= std::min<int>(max_y, loc.y + mMinRadius); y++)
+    {
+      for (int x = std::max<int>(0, loc.x - mMinRadius); x <= std::min<int>(max_x, loc.x + mMinRadius); x++)
+      {
+        cInt j = grid[y * width + x];
+
+        if (j < 0 || j == i)
+          continue;
+
+        // Same metric as the greedy duplicate check
+        cInt dx = x - loc.x;
+        cInt dy = y - loc.y;
+        cInt r = int(ceil(sqrt(dx * dx + dy * dy)));
+
+        if (r <= mMinRadius)
+          mNeighbours[i].push_back(j);
+      }
+    }
+  }
+}
+
+int TileAssigner::CountConflicts(rcvInt inAssignment) const
+{
+  int conflicts = 0;
+
+  for (int i = 0, n = mNeighbours.size(); i < n; i++)
+    for (int k = 0, m = mNeighbours[i].size(); k < m; k++)
+      if (mNeighbours[i][k] > i && inAssignment[mNeighbours[i][k]] == inAssignment[i])
+        conflicts++;
+
+  return conflicts;
+}
+
+void TileAssigner::Solve(
+  const std::vector<cv::Point2i> &inLocations,
+  const std::vector<vMatch> &inCandidates,
+  rvInt outAssignment
+)
+{
+  ASSERT(inLocations.size() == inCandidates.size());
+  cInt n = inLocations.size();
+
+  FindNeighbours(inLocations);
+
+  // Default penalty: a duplicate is worse than the worst candidate
+  float penalty = mPenalty;
+  if (penalty < 0.0f)
+  {
+    penalty = 0.0f;
+
+    for (int i = 0; i < n; i++)
+      for (int k = 0, m = inCandidates[i].size(); k < m; k++)
+        penalty = std::max<float>(penalty, inCandidates[i][k].val);
+
+    penalty = 2.0f * penalty + 1.0f;
+  }
+
+  // Start from every tile's nearest candidate
+  outAssignment.assign(n, -1);
+  for (int i = 0; i < n; i++)
+  {
+    ASSERT(!inCandidates[i].empty());
+    outAssignment[i] = inCandidates[i].front().id;
+  }
+
+  // Tiles sharing (x, y) modulo radius + 1 are always outside each other's
+  // radius, so a colour class can bid concurrently
+  cInt period = mMinRadius + 1;
+  std::vector<vInt> colours(period * period);
+
+  for (int i = 0; i < n; i++)
+    colours[(inLocations[i].y % period) * period + inLocations[i].x % period].push_back(i);
+
+  mRoundsUsed = 0;
+
+  for (int round = 0; round < mRounds; round++)
+  {
+    int changes = 0;
+
+    for (int c = 0, n_colours = colours.size(); c < n_colours; c++)
+    {
+      rcvInt tiles = colours[c];
+
+      #pragma omp parallel for schedule(dynamic, 64) reduction(+:changes)
+      for (int t = 0; t < int(tiles.size()); t++)
+      {
+        cInt i = tiles[t];
+        rcvInt neighbours = mNeighbours[i];
+        const vMatch &candidates = inCandidates[i];
+
+        int best_id = outAssignment[i];
+        float best_cost = std::numeric_limits<float>::max();
+
+        for (int k = 0, m = candidates.size(); k < m; k++)
+        {
+          cInt id = candidates[k].id;
+          int holders = 0;
+
+          for (int j = 0, n_neighbours = neighbours.size(); j < n_neighbours; j++)
+            if (outAssignment[neighbours[j]] == id)
+              holders++;
+
+          cFloat cost = candidates[k].val + penalty * holders;
+
+          if (cost < best_cost)
+          {
+            best_cost = cost;
+            best_id = id;
+          }
+        }
+
+        if (best_id != outAssignment[i])
+        {
+          outAssignment[i] = best_id;
+          changes++;
+        }
+      }
+    }
+
+    mRoundsUsed = round + 1;
+
+    if (changes == 0)
+      break;
+  }
+
+  mConflicts = CountConflicts(outAssignment);
+}
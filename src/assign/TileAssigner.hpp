@@ -0,0 +1,51 @@
+#ifndef TILEASSIGNER_HDR
+#define TILEASSIGNER_HDR
+
+#include <opencv/cv.h>
+
+#include "../index/Match.hpp"
+#include "../utils/Types.hpp"
+
+DECLARE_CLASS(TileAssigner)
+
+/// @brief Order independent placement over per tile candidate lists
+///
+/// Minimizes the sum of match distances plus a penalty for every pair of
+/// tiles within the min radius that use the same image. Like an auction,
+/// tiles repeatedly bid on their cheapest candidate where the price of an
+/// image is the penalty times the neighbours currently holding it. Tiles
+/// that are further than the radius apart never compete, so the grid is
+/// coloured such that each colour class can bid in parallel.
+class TileAssigner
+{
+public:
+  /// @brief Const: inPenalty < 0 makes duplicates cost more than any match
+  TileAssigner(cInt inMinRadius, cFloat inPenalty, cInt inRounds);
+
+  /// @brief Assign one candidate id per location
+  void Solve(
+    const std::vector<cv::Point2i> &inLocations,
+    const std::vector<vMatch> &inCandidates,
+    rvInt outAssignment
+  );
+
+  /// @brief Number of duplicate pairs within the radius in the last Solve
+  int Conflicts() const { return mConflicts; }
+
+  /// @brief Rounds used by the last Solve
+  int Rounds() const { return mRoundsUsed; }
+
+private:
+  void FindNeighbours(const std::vector<cv::Point2i> &inLocations);
+  int CountConflicts(rcvInt inAssignment) const;
+
+  int mMinRadius;
+  float mPenalty;
+  int mRounds;
+  int mConflicts;
+  int mRoundsUsed;
+
+  std::vector<vInt> mNeighbours; ///< Per location the locations within radius
+};
+
+#endif // TILEASSIGNER_HDR
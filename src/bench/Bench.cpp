@@ -0,0 +1,433 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <opencv/highgui.h>
+#include <unistd.h>
+
+#include "Version.hpp"
+#include "Synthetic.hpp"
+#include "../HexaMosaic.hpp"
+#include "../index/CascadeFilter.hpp"
+#include "../index/FeatureStore.hpp"
+#include "../index/IvfPqIndex.hpp"
+#include "../pca/PCA.hpp"
+#include "../utils/Timer.hpp"
+#include "../utils/Types.hpp"
+
+namespace po = boost::program_options;
+
+// Every heap allocation of the process, OpenCV's included, is counted by
+// interposing the glibc allocator entry points
+static std::atomic<Uint64> sAllocations(0);
+
+#ifdef __GLIBC__
+extern "C"
+{
+  void *__libc_malloc(size_t inSize);
+  void *__libc_calloc(size_t inCount, size_t inSize);
+  void *__libc_realloc(void *inPtr, size_t inSize);
+  void *__libc_memalign(size_t inAlignment, size_t inSize);
+
+  void *malloc(size_t inSize)
+  {
+    sAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(inSize);
+  }
+
+  void *calloc(size_t inCount, size_t inSize)
+  {
+    sAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(inCount, inSize);
+  }
+
+  void *realloc(void *inPtr, size_t inSize)
+  {
+    sAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(inPtr, inSize);
+  }
+
+  void *memalign(size_t inAlignment, size_t inSize)
+  {
+    sAllocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(inAlignment, inSize);
+  }
+
+  int posix_memalign(void **outPtr, size_t inAlignment, size_t inSize)
+  {
+    sAllocations.fetch_add(1, std::memory_order_relaxed);
+    *outPtr = __libc_memalign(inAlignment, inSize);
+    return *outPtr != NULL ? 0 : 12; // ENOMEM
+  }
+}
+#endif // __GLIBC__
+
+/// @brief Micro and end-to-end benchmarks on a synthetic database
+class HexaBench
+{
+public:
+  HexaBench(rcString inFilter, cDouble inMinTime):
+    mFilter(inFilter),
+    mMinTime(inMinTime) {}
+
+  /// @brief Call inFunc until mMinTime passed, report the time per call
+  template<typename Func>
+  void Run(rcString inName, Func inFunc, cInt inOpsPerCall = 1)
+  {
+    if (!mFilter.empty() && inName.find(mFilter) == String::npos)
+      return;
+
+    inFunc(); // warm up caches and lazy allocations
+
+    Uint64 calls = 0;
+    const Uint64 allocations = sAllocations.load();
+    const Uint64 start = Timer::Now();
+    Uint64 elapsed = 0;
+
+    do
+    {
+      inFunc();
+      calls++;
+      elapsed = Timer::Now() - start;
+    }
+    while (elapsed < mMinTime * 1e9);
+
+    cDouble ns_per_op = elapsed / double(calls * inOpsPerCall);
+    cDouble allocs_per_call = (sAllocations.load() - allocations) / double(calls);
+    std::cout << Timer::SpacePadding(inName, NAME_SPACING)
+              << Timer::SpacePadding(Format(ns_per_op, 1) + " ns", 2 * CELL_SPACING)
+              << Timer::SpacePadding(Format(1e9 / ns_per_op, 0) + " op/s", 2 * CELL_SPACING)
+              << Timer::SpacePadding(Format(allocs_per_call, 2) + " allocs", 2 * CELL_SPACING)
+              << calls * inOpsPerCall << std::endl;
+  }
+
+  void Micro(HexaMosaic &ioMosaic, cInt inImages)
+  {
+    HexaMosaic &hm = ioMosaic;
+    cv::RNG rng(1);
+    cv::Mat tile, row, gray_row;
+    Synthetic::Tile(rng, hm.mHexHeight, tile);
+    cv::Mat hex = tile(cv::Rect(0, 0, hm.mHexWidth, hm.mHexHeight));
+
+    // Feature extraction
+    hm.mUseGrayscale = false;
+    hm.mChannels = 3;
+    Run("Im2HexRow color", [&]() { hm.Im2HexRow(hex, row); });
+    hm.mUseGrayscale = true;
+    hm.mChannels = 1;
+    Run("Im2HexRow grayscale", [&]() { hm.Im2HexRow(hex, gray_row); });
+    hm.mUseGrayscale = false;
+    hm.mChannels = 3;
+
+    cv::Mat balanced;
+    Run("ColorBalance", [&]() { hex.copyTo(balanced); hm.ColorBalance(balanced, row); });
+
+    cv::Mat source_row;
+    Run("SourceRow", [&]() { hm.SourceRow(0, source_row); });
+
+    // Per tile search of the greedy placement on the exact store
+    {
+      cv::Mat database(hm.mNumImages, hm.mDimensions, CV_32FC1), query(1, hm.mDimensions, CV_32FC1);
+      cv::randu(database, cv::Scalar(-100), cv::Scalar(100));
+      cv::randu(query, cv::Scalar(-100), cv::Scalar(100));
+      FeatureStore store(FeatureStore::FLOAT32, false);
+      store.Build(database);
+      CascadeFilter cascade(2);
+      HexaMosaic::Search search;
+      search.store = &store;
+      search.cascade = &cascade;
+      std::vector<Match> knn;
+      Run("FindCandidates exact", [&]() { hm.FindCandidates(1, query, search, knn); });
+
+      cascade.Build(database);
+      hm.mCascadeKeep = 0.05f;
+      Run("FindCandidates cascade 5%", [&]() { hm.FindCandidates(1, query, search, knn); });
+      hm.mCascadeKeep = 0.0f;
+    }
+
+    // Distances between projected features
+    for (int dims = 8; dims <= 32; dims *= 2)
+    {
+      cv::Mat a(1, dims, CV_32FC1), b(1, dims, CV_32FC1);
+      cv::randu(a, cv::Scalar(-100), cv::Scalar(100));
+      cv::randu(b, cv::Scalar(-100), cv::Scalar(100));
+      Run("GetDistance d=" + Format(dims, 0), [&]() { hm.GetDistance(a, b); });
+
+      cv::Mat database(inImages, dims, CV_32FC1);
+      cv::randu(database, cv::Scalar(-100), cv::Scalar(100));
+      vFloat distances(inImages);
+
+      const char *names[] = { "fp32", "fp16", "int8" };
+      const FeatureStore::Format formats[] = { FeatureStore::FLOAT32, FeatureStore::FLOAT16, FeatureStore::INT8 };
+
+      for (int f = 0; f < 3; f++)
+      {
+        FeatureStore store(formats[f], false);
+        store.Build(database);
+        Run("FeatureStore::Distances " + String(names[f]) + " d=" + Format(dims, 0),
+            [&]() { store.Distances(a.ptr<float>(0), &distances[0]); }, inImages);
+      }
+
+      if (dims % 4 == 0)
+      {
+        IvfPqIndex index(std::max<int>(1, 4 * sqrtf(inImages)), 4);
+        index.Build(database);
+        vInt ids;
+        Run("IvfPqIndex::Search d=" + Format(dims, 0),
+            [&]() { index.Search(a.ptr<float>(0), 8, 100, ids, distances); });
+      }
+    }
+
+    // Pca on the source rows of a 1000 tile mosaic
+    cInt rows = std::min<int>(1000, row.cols - 1);
+    cv::Mat data(rows, row.cols, CV_8UC1);
+    cv::randu(data, cv::Scalar(0), cv::Scalar(256));
+    Run("PCA::Solve " + Format(rows, 0) + "x" + Format(row.cols, 0), [&]()
+    {
+      PCA pca(rows, row.cols);
+      for (int i = 0; i < rows; i++)
+        pca.AddRow(data.row(i));
+      pca.Solve(8);
+    });
+
+    PCA pca(rows, row.cols);
+    for (int i = 0; i < rows; i++)
+      pca.AddRow(data.row(i));
+    pca.Solve(8);
+    cv::Mat projected;
+    Run("PCA::Project row", [&]() { pca.Project(row, projected); });
+
+    // Duplicate check against a full neighbourhood of placed tiles
+    vInt ids;
+    std::vector<cv::Point2i> locations;
+    for (int y = 0; y < 100; y++)
+    {
+      for (int x = 0; x < 100; x++)
+      {
+        ids.push_back(rng.uniform(0, inImages));
+        locations.push_back(cv::Point2i(x, y));
+      }
+    }
+    // An image that is placed, so the distance is computed for its copies
+    cInt placed = ids[0];
+    Run("IsDuplicate 10k placed", [&]() { hm.IsDuplicate(placed, cv::Point2i(50, 50), ids, locations); });
+  }
+
+  /// @brief Recall@10 and time per query of the cascaded search, on features
+  /// whose variance decays with the component like pca output does
+  void Cascade(cInt inImages)
+  {
+    cInt n_queries = 200;
+    cInt k = 10;
+    cv::RNG rng(2);
+
+    for (int dims = 8; dims <= 16; dims *= 2)
+    {
+      cv::Mat database(inImages, dims, CV_32FC1), queries(n_queries, dims, CV_32FC1);
+      rng.fill(database, cv::RNG::NORMAL, 0.0, 1.0);
+      rng.fill(queries, cv::RNG::NORMAL, 0.0, 1.0);
+
+      for (int i = 0; i < inImages; i++)
+        for (int d = 0; d < dims; d++)
+          database.at<float>(i, d) *= 100.0f / (d + 1);
+
+      for (int i = 0; i < n_queries; i++)
+        for (int d = 0; d < dims; d++)
+          queries.at<float>(i, d) *= 100.0f / (d + 1);
+
+      FeatureStore store(FeatureStore::FLOAT32, false);
+      store.Build(database);
+      CascadeFilter cascade(2);
+      cascade.Build(database);
+
+      // Ground truth of the exhaustive search
+      std::vector<vInt> exact(n_queries);
+      vFloat all(inImages);
+      for (int q = 0; q < n_queries; q++)
+      {
+        std::vector<Match> ranked(inImages);
+        store.Distances(queries.ptr<float>(q), &all[0]);
+        for (int i = 0; i < inImages; i++)
+          ranked[i] = Match(i, all[i]);
+        std::partial_sort(ranked.begin(), ranked.begin() + k, ranked.end(), Match::Closer);
+        for (int i = 0; i < k; i++)
+          exact[q].push_back(ranked[i].id);
+      }
+
+      const float fractions[] = { 0.01f, 0.02f, 0.05f, 0.1f, 0.2f, 0.5f };
+
+      for (int f = 0; f < 6; f++)
+      {
+        cString name = "Cascade keep=" + Format(fractions[f] * 100.0, 0) + "% d=" + Format(dims, 0);
+
+        if (!mFilter.empty() && name.find(mFilter) == String::npos)
+          continue;
+
+        cInt keep = std::max<int>(k, ceilf(fractions[f] * inImages));
+        int hits = 0;
+        vInt ids;
+        vFloat distances;
+        std::vector<Match> ranked;
+        const Uint64 start = Timer::Now();
+
+        for (int q = 0; q < n_queries; q++)
+        {
+          cascade.Filter(queries.ptr<float>(q), keep, ids);
+          distances.resize(ids.size());
+          store.Distances(queries.ptr<float>(q), ids, &distances[0]);
+          ranked.resize(ids.size());
+          for (int i = 0, n = ids.size(); i < n; i++)
+            ranked[i] = Match(ids[i], distances[i]);
+          std::partial_sort(ranked.begin(), ranked.begin() + k, ranked.end(), Match::Closer);
+
+          for (int i = 0; i < k; i++)
+            hits += std::count(exact[q].begin(), exact[q].end(), ranked[i].id);
+        }
+
+        cDouble ns_per_query = (Timer::Now() - start) / double(n_queries);
+        std::cout << Timer::SpacePadding(name, NAME_SPACING)
+                  << Timer::SpacePadding(Format(ns_per_query, 1) + " ns", 2 * CELL_SPACING)
+                  << "recall@10 " << Format(hits / double(n_queries * k), 3) << std::endl;
+      }
+    }
+  }
+
+  void EndToEnd(rcString inSource, rcString inDatabase, HexaMosaic::Options inOptions, rcString inName)
+  {
+    if (!mFilter.empty() && inName.find(mFilter) == String::npos)
+      return;
+
+    const Uint64 allocations = sAllocations.load();
+    const Uint64 start = Timer::Now();
+    HexaMosaic hm(inSource, inDatabase, inOptions);
+    hm.Create();
+    cDouble seconds = (Timer::Now() - start) * 1e-9;
+    cDouble allocs_per_tile = (sAllocations.load() - allocations) / double(hm.mCoords.size());
+
+    std::cout << Timer::SpacePadding(inName, NAME_SPACING)
+              << Timer::SpacePadding(Format(seconds, 3) + " s", 2 * CELL_SPACING)
+              << Timer::SpacePadding(Format(hm.mCoords.size() / seconds, 0) + " tiles/s", 2 * CELL_SPACING)
+              << Timer::SpacePadding(Format(allocs_per_tile, 1) + " allocs/tile", 2 * CELL_SPACING)
+              << hm.mCoords.size() << std::endl;
+  }
+
+  static String Format(cDouble inValue, cInt inPrecision)
+  {
+    std::stringstream s;
+    s << std::setiosflags(std::ios::fixed) << std::setprecision(inPrecision) << inValue;
+    return s.str();
+  }
+
+private:
+  String mFilter;
+  double mMinTime;
+};
+
+int main(int argc, char **argv)
+{
+  int tiles, tile_size, width, source_width, source_height;
+  Uint64 seed;
+  double min_time;
+  String dir, filter;
+
+  po::options_description options("Benchmark options");
+  options.add_options()
+  ("help,h", "produce help message")
+  ("tiles", po::value<int>(&tiles)->default_value(2000), "synthetic database size")
+  ("tile-size", po::value<int>(&tile_size)->default_value(100), "synthetic tile size")
+  ("width", po::value<int>(&width)->default_value(40), "mosaic width in tiles")
+  ("source-width", po::value<int>(&source_width)->default_value(1600), "synthetic source width")
+  ("source-height", po::value<int>(&source_height)->default_value(1200), "synthetic source height")
+  ("seed", po::value<Uint64>(&seed)->default_value(0), "generator seed")
+  ("min-time", po::value<double>(&min_time)->default_value(0.5), "seconds per micro benchmark")
+  ("filter", po::value<String>(&filter)->default_value(""), "only run benchmarks containing this")
+  ("dir", po::value<String>(&dir)->default_value(""), "keep the synthetic data in this directory")
+  ("no-end-to-end", "skip the end-to-end benchmarks")
+  ;
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, options), vm);
+  po::notify(vm);
+
+  if (vm.count("help"))
+  {
+    std::cout << HUMAN_NAME << " benchmarks" << std::endl;
+    std::cout << std::endl << options << std::endl;
+    return 1;
+  }
+
+  // The paths must stay valid once the runs chdir into the directory
+  const bool keep = !dir.empty();
+  if (keep)
+    dir = boost::filesystem::absolute(dir).string();
+  else
+    dir = (boost::filesystem::temp_directory_path() /
+           boost::filesystem::unique_path("hexapic-bench-%%%%%%%%")).string();
+
+  cString database = dir + "/database/";
+  cString source = dir + "/source.png";
+
+  if (!boost::filesystem::exists(database))
+  {
+    std::cout << "Generating " << tiles << " tiles of " << tile_size << "px in " << dir << std::endl;
+    Synthetic::Database(database, tiles, tile_size, seed);
+  }
+
+  if (!boost::filesystem::exists(source))
+  {
+    cv::Mat img;
+    cv::RNG rng(seed + 1);
+    Synthetic::Source(rng, cv::Size(source_width, source_height), img);
+    cv::imwrite(source, img);
+  }
+
+  // Results of end-to-end runs land in the working directory
+  if (chdir(dir.c_str()) != 0)
+  {
+    std::cerr << "unable to enter " << dir << std::endl;
+    return 1;
+  }
+
+  HexaBench bench(filter, min_time);
+  HexaMosaic::Options mosaic;
+  mosaic.width = width;
+
+  {
+    HexaMosaic hm(source, database, mosaic);
+    bench.Micro(hm, tiles);
+  }
+
+  bench.Cascade(tiles);
+
+  if (!vm.count("no-end-to-end"))
+  {
+    bench.EndToEnd(source, database, mosaic, "end-to-end color");
+
+    HexaMosaic::Options grayscale = mosaic;
+    grayscale.grayscale = true;
+    bench.EndToEnd(source, database, grayscale, "end-to-end grayscale");
+
+    HexaMosaic::Options quantized = mosaic;
+    quantized.quantization = FeatureStore::INT8;
+    bench.EndToEnd(source, database, quantized, "end-to-end int8");
+
+    HexaMosaic::Options cascade = mosaic;
+    cascade.cascadeKeep = 0.05f;
+    bench.EndToEnd(source, database, cascade, "end-to-end cascade 5%");
+
+    HexaMosaic::Options global = mosaic;
+    global.assignment = HexaMosaic::GLOBAL;
+    global.candidates = 32;
+    bench.EndToEnd(source, database, global, "end-to-end global assignment");
+  }
+
+  if (!keep)
+    boost::filesystem::remove_all(dir);
+
+  return 0;
+}
@@ -0,0 +1,84 @@
+#include "Synthetic.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <boost/filesystem.hpp>
+#include <cstdio>
+#include <opencv/highgui.h>
+
+cv::Scalar Synthetic::Color(cv::RNG &ioRng)
+{
+  return cv::Scalar(ioRng.uniform(0, 256), ioRng.uniform(0, 256), ioRng.uniform(0, 256));
+}
+
+void Synthetic::Gradient(cv::RNG &ioRng, cv::Mat &ioImg)
+{
+  const cv::Scalar from = Color(ioRng);
+  const cv::Scalar to = Color(ioRng);
+  cFloat angle = ioRng.uniform(0.0f, float(2.0 * M_PI));
+  cFloat cx = cosf(angle) / ioImg.cols;
+  cFloat cy = sinf(angle) / ioImg.rows;
+
+  for (int y = 0; y < ioImg.rows; y++)
+  {
+    cv::Vec3b *row = ioImg.ptr<cv::Vec3b>(y);
+
+    for (int x = 0; x < ioImg.cols; x++)
+    {
+      cFloat t = std::min<float>(1.0f, fabsf(x * cx + y * cy));
+
+      for (int c = 0; c < 3; c++)
+        row[x][c] = Uint8(from[c] + t * (to[c] - from[c]));
+    }
+  }
+}
+
+void Synthetic::Shapes(cv::RNG &ioRng, cInt inCount, cInt inMaxSize, cv::Mat &ioImg)
+{
+  for (int i = 0; i < inCount; i++)
+  {
+    const cv::Point center(ioRng.uniform(0, ioImg.cols), ioRng.uniform(0, ioImg.rows));
+    cInt size = ioRng.uniform(2, std::max<int>(3, inMaxSize));
+
+    if (ioRng.uniform(0, 2) == 0)
+      cv::circle(ioImg, center, size, Color(ioRng), -1);
+    else
+      cv::rectangle(ioImg, cv::Rect(center.x - size, center.y - size, size, 2 * size),
+                    Color(ioRng), -1);
+  }
+}
+
+void Synthetic::Tile(cv::RNG &ioRng, cInt inSize, cv::Mat &out)
+{
+  out.create(inSize, inSize, CV_8UC3);
+  Gradient(ioRng, out);
+  Shapes(ioRng, ioRng.uniform(0, 4), inSize / 3, out);
+}
+
+void Synthetic::Source(cv::RNG &ioRng, const cv::Size &inSize, cv::Mat &out)
+{
+  out.create(inSize.height, inSize.width, CV_8UC3);
+  Gradient(ioRng, out);
+  Shapes(ioRng, 12, std::min<int>(inSize.width, inSize.height) / 4, out);
+  Shapes(ioRng, 200, std::min<int>(inSize.width, inSize.height) / 40, out);
+}
+
+void Synthetic::Database(
+  rcString inDir,
+  cInt inTiles,
+  cInt inTileSize,
+  const Uint64 inSeed
+)
+{
+  boost::filesystem::create_directories(inDir);
+  cv::RNG rng(inSeed);
+  cv::Mat tile;
+
+  for (int i = 0; i < inTiles; i++)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "tile-%06d.tiff", i);
+    Tile(rng, inTileSize, tile);
+    cv::imwrite(inDir + "/" + name, tile);
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef SYNTHETIC_HDR
+#define SYNTHETIC_HDR
+
+#include <opencv/cv.h>
+
+#include "../utils/Types.hpp"
+
+/// @brief Reproducible tile databases and source images for benchmarks
+class Synthetic
+{
+public:
+  /// @brief Square tile: gradient over a random colour with a few shapes
+  static void Tile(cv::RNG &ioRng, cInt inSize, cv::Mat &out);
+
+  /// @brief Source image with large smooth regions and some detail
+  static void Source(cv::RNG &ioRng, const cv::Size &inSize, cv::Mat &out);
+
+  /// @brief Write inTiles tiles to inDir like the crawler does
+  static void Database(
+    rcString inDir,
+    cInt inTiles,
+    cInt inTileSize,
+    const Uint64 inSeed
+  );
+
+private:
+  static cv::Scalar Color(cv::RNG &ioRng);
+  static void Gradient(cv::RNG &ioRng, cv::Mat &ioImg);
+  static void Shapes(cv::RNG &ioRng, cInt inCount, cInt inMaxSize, cv::Mat &ioImg);
+};
+
+#endif // SYNTHETIC_HDR
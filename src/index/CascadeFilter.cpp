@@ -0,0 +1,81 @@
+#include "CascadeFilter.hpp"
+
+#include "Match.hpp"
+#include "../utils/Debugger.hpp"
+
+#include <algorithm>
+
+CascadeFilter::CascadeFilter(cInt inDims):
+  mDims(inDims),
+  mRows(0)
+{
+}
+
+void CascadeFilter::Build(const cv::Mat &inFeatures)
+{
+  ASSERT(inFeatures.type() == CV_32FC1);
+  ASSERT(mDims > 0 && mDims <= inFeatures.cols);
+
+  mRows = inFeatures.rows;
+  mColumns.resize(size_t(mDims) * mRows);
+
+  for (int i = 0; i < mRows; i++)
+  {
+    pcFloat row = inFeatures.ptr<float>(i);
+
+    for (int d = 0; d < mDims; d++)
+      mColumns[size_t(d) * mRows + i] = row[d];
+  }
+}
+
+void CascadeFilter::Filter(pcFloat inQuery, cInt inKeep, rvInt outIds) const
+{
+  std::vector<Match> ranked;
+  vFloat distances;
+  Filter(inQuery, inKeep, outIds, ranked, distances);
+}
+
+void CascadeFilter::Filter(
+  pcFloat inQuery,
+  cInt inKeep,
+  rvInt outIds,
+  std::vector<Match> &ioRanked,
+  rvFloat ioDistances
+) const
+{
+  ASSERT(!IsEmpty());
+  cInt keep = std::min(inKeep, mRows);
+  outIds.clear();
+
+  if (keep <= 0)
+    return;
+
+  std::vector<Match> &ranked = ioRanked;
+  ranked.resize(mRows);
+
+  // Squared distances, one component at a time over contiguous memory
+  vFloat &distances = ioDistances;
+  distances.assign(mRows, 0.0f);
+
+  for (int d = 0; d < mDims; d++)
+  {
+    pcFloat column = &mColumns[size_t(d) * mRows];
+    cFloat q = inQuery[d];
+
+    for (int i = 0; i < mRows; i++)
+    {
+      cFloat diff = column[i] - q;
+      distances[i] += diff * diff;
+    }
+  }
+
+  for (int i = 0; i < mRows; i++)
+    ranked[i] = Match(i, distances[i]);
+
+  std::nth_element(ranked.begin(), ranked.begin() + (keep - 1), ranked.end(), Match::Closer);
+
+  outIds.resize(keep);
+
+  for (int i = 0; i < keep; i++)
+    outIds[i] = ranked[i].id;
+}
@@ -0,0 +1,50 @@
+#ifndef CASCADEFILTER_HDR
+#define CASCADEFILTER_HDR
+
+#include <opencv/cv.h>
+
+#include "Match.hpp"
+#include "../utils/Types.hpp"
+
+DECLARE_CLASS(CascadeFilter)
+
+/// @brief Leading pca components of the database in component major order
+///
+/// Pca components are orthogonal, so the distance over the first few of them
+/// is a lower bound of the full distance. Ranking the database on it touches
+/// a couple of floats per row in contiguous arrays, and only the survivors
+/// need to be scored on all dimensions.
+class CascadeFilter
+{
+public:
+  /// @brief Const: inDims leading components are kept
+  CascadeFilter(cInt inDims);
+
+  /// @brief Keep the first columns of the rows x dims CV_32FC1 inFeatures
+  void Build(const cv::Mat &inFeatures);
+
+  /// @brief Ids of the inKeep rows closest to inQuery on the kept
+  /// components, in no particular order
+  void Filter(pcFloat inQuery, cInt inKeep, rvInt outIds) const;
+
+  /// @brief Like Filter, ranking in the caller's buffers instead of fresh ones
+  void Filter(
+    pcFloat inQuery,
+    cInt inKeep,
+    rvInt outIds,
+    std::vector<Match> &ioRanked,
+    rvFloat ioDistances
+  ) const;
+
+  bool IsEmpty() const { return mRows == 0; }
+  int Dims() const { return mDims; }
+  int Rows() const { return mRows; }
+  size_t Bytes() const { return mColumns.size() * sizeof(float); }
+
+private:
+  int mDims;
+  int mRows;
+  vFloat mColumns; ///< mDims arrays of mRows values each
+};
+
+#endif // CASCADEFILTER_HDR
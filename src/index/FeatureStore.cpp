@@ -0,0 +1,322 @@
+#include "FeatureStore.hpp"
+
+#include "../utils/Debugger.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#define INT8_RANGE 127.0f
+
+FeatureStore::FeatureStore(Format inFormat, cBool inKeepExact):
+  mFormat(inFormat),
+  mKeepExact(inKeepExact || inFormat == FLOAT32),
+  mRows(0),
+  mDims(0),
+  mKernel(&FeatureStore::Scan<FLOAT32, 0>)
+{
+}
+
+void FeatureStore::Build(const cv::Mat &inFeatures)
+{
+  ASSERT(inFeatures.type() == CV_32FC1 && inFeatures.isContinuous());
+  ASSERT(inFeatures.cols <= MAX_QUERY_DIMS);
+
+  mRows = inFeatures.rows;
+  mDims = inFeatures.cols;
+  mExact.release();
+  mHalf.clear();
+  mInt8.clear();
+  mScale.clear();
+  mWeight.clear();
+
+  if (mKeepExact)
+    mExact = inFeatures;
+
+  pcFloat data = inFeatures.ptr<float>(0);
+  cInt n = mRows * mDims;
+
+  switch (mFormat)
+  {
+  case FLOAT16:
+    {
+      mHalf.resize(n);
+
+      for (int i = 0; i < n; i++)
+        mHalf[i] = FloatToHalf(data[i]);
+
+      break;
+    }
+  case INT8:
+    {
+      // Symmetric per dimension scale, pca features are centered around 0
+      mScale.assign(mDims, 0.0f);
+      mWeight.resize(mDims);
+
+      for (int i = 0; i < mRows; i++)
+        for (int d = 0; d < mDims; d++)
+          mScale[d] = std::max<float>(mScale[d], fabsf(data[i * mDims + d]));
+
+      for (int d = 0; d < mDims; d++)
+      {
+        mScale[d] = mScale[d] > 0.0f ? mScale[d] / INT8_RANGE : 1.0f;
+        mWeight[d] = mScale[d] * mScale[d];
+      }
+
+      mInt8.resize(n);
+
+      for (int i = 0; i < mRows; i++)
+      {
+        for (int d = 0; d < mDims; d++)
+        {
+          float q = roundf(data[i * mDims + d] / mScale[d]);
+          q = std::min<float>(std::max<float>(q, -INT8_RANGE), INT8_RANGE);
+          mInt8[i * mDims + d] = int8_t(q);
+        }
+      }
+
+      break;
+    }
+  default:
+    break;
+  }
+
+  switch (mFormat)
+  {
+  case FLOAT16:
+    mKernel = SelectKernel<FLOAT16>();
+    break;
+  case INT8:
+    mKernel = SelectKernel<INT8>();
+    break;
+  default:
+    mKernel = SelectKernel<FLOAT32>();
+    break;
+  }
+}
+
+void FeatureStore::PrepareQuery(pcFloat inQuery, pFloat outQuery) const
+{
+  // Move the query into the int8 domain once instead of per row
+  if (mFormat == INT8)
+  {
+    for (int d = 0; d < mDims; d++)
+      outQuery[d] = inQuery[d] / mScale[d];
+  }
+  else
+  {
+    memcpy(outQuery, inQuery, mDims * sizeof(float));
+  }
+}
+
+template<int Format, int Dims>
+void FeatureStore::Scan(pcFloat inQuery, const int *inRows, cInt inCount, pFloat outDistances) const
+{
+  // With Dims fixed a row is unrolled completely. Four partial sums fit a
+  // vector register, the generic kernel adds in the same order, so every
+  // kernel returns the same distances.
+  cInt dims = Dims > 0 ? Dims : mDims;
+  cInt body = dims & ~3;
+  pcFloat exact = Format == FLOAT32 ? mExact.ptr<float>(0) : NULL;
+  const Uint16 *half = mHalf.data();
+  const int8_t *int8 = mInt8.data();
+  pcFloat weight = mWeight.data();
+
+  auto term = [&](const size_t inIndex, cInt inD) -> float
+  {
+    if (Format == FLOAT16)
+    {
+      cFloat diff = inQuery[inD] - HalfToFloat(half[inIndex]);
+      return diff * diff;
+    }
+
+    if (Format == INT8)
+    {
+      cFloat diff = inQuery[inD] - int8[inIndex];
+      return weight[inD] * diff * diff;
+    }
+
+    cFloat diff = inQuery[inD] - exact[inIndex];
+    return diff * diff;
+  };
+
+  for (int i = 0; i < inCount; i++)
+  {
+    cInt row = inRows ? inRows[i] : i;
+    ASSERT(row >= 0 && row < mRows);
+    const size_t base = size_t(row) * dims;
+    float lanes[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+    for (int d = 0; d < body; d += 4)
+      for (int l = 0; l < 4; l++)
+        lanes[l] += term(base + d + l, d + l);
+
+    for (int d = body; d < dims; d++)
+      lanes[d - body] += term(base + d, d);
+
+    outDistances[i] = sqrtf((lanes[0] + lanes[1]) + (lanes[2] + lanes[3]));
+  }
+}
+
+template<int Format>
+FeatureStore::Kernel FeatureStore::SelectKernel() const
+{
+  switch (mDims)
+  {
+  case 8:
+    return &FeatureStore::Scan<Format, 8>;
+  case 16:
+    return &FeatureStore::Scan<Format, 16>;
+  case 32:
+    return &FeatureStore::Scan<Format, 32>;
+  default:
+    return &FeatureStore::Scan<Format, 0>;
+  }
+}
+
+void FeatureStore::Distances(pcFloat inQuery, pFloat outDistances) const
+{
+  float query[MAX_QUERY_DIMS];
+  PrepareQuery(inQuery, query);
+  (this->*mKernel)(query, NULL, mRows, outDistances);
+}
+
+void FeatureStore::Distances(pcFloat inQuery, rcvInt inRows, pFloat outDistances) const
+{
+  if (inRows.empty())
+    return;
+
+  float query[MAX_QUERY_DIMS];
+  PrepareQuery(inQuery, query);
+  (this->*mKernel)(query, &inRows[0], inRows.size(), outDistances);
+}
+
+float FeatureStore::Distance(pcFloat inQuery, cInt inRow) const
+{
+  float query[MAX_QUERY_DIMS];
+  float distance;
+  PrepareQuery(inQuery, query);
+  (this->*mKernel)(query, &inRow, 1, &distance);
+  return distance;
+}
+
+cv::Mat FeatureStore::ExactRow(cInt inRow) const
+{
+  ASSERT(HasExact());
+  return mExact.row(inRow);
+}
+
+size_t FeatureStore::Bytes() const
+{
+  switch (mFormat)
+  {
+  case FLOAT16:
+    return mHalf.size() * sizeof(Uint16);
+  case INT8:
+    return mInt8.size() + 2 * mDims * sizeof(float);
+  default:
+    return size_t(mRows) * mDims * sizeof(float);
+  }
+}
+
+bool FeatureStore::ParseFormat(rcString inName, Format &outFormat)
+{
+  if (inName == "none" || inName == "fp32")
+    outFormat = FLOAT32;
+  else
+  if (inName == "fp16")
+    outFormat = FLOAT16;
+  else
+  if (inName == "int8")
+    outFormat = INT8;
+  else
+    return false;
+
+  return true;
+}
+
+Uint16 FeatureStore::FloatToHalf(cFloat inValue)
+{
+  Uint32 f;
+  memcpy(&f, &inValue, sizeof(f));
+
+  cUint32 sign = (f >> 16) & 0x8000;
+  cInt exponent = int((f >> 23) & 0xFF) - 127 + 15;
+  Uint32 mantissa = f & 0x7FFFFF;
+
+  // NaN and infinity
+  if (((f >> 23) & 0xFF) == 0xFF)
+    return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+
+  // Overflow saturates to infinity
+  if (exponent >= 0x1F)
+    return sign | 0x7C00;
+
+  // Denormals, or zero when too small
+  if (exponent <= 0)
+  {
+    if (exponent < -10)
+      return sign;
+
+    mantissa |= 0x800000;
+    cInt shift = 14 - exponent;
+    Uint32 half = mantissa >> shift;
+    cUint32 rest = mantissa & ((1u << shift) - 1);
+    cUint32 halfway = 1u << (shift - 1);
+
+    if (rest > halfway || (rest == halfway && (half & 1)))
+      half++;
+
+    return sign | half;
+  }
+
+  // Round to nearest even, a carry correctly bumps the exponent
+  Uint32 half = sign | (exponent << 10) | (mantissa >> 13);
+  cUint32 rest = mantissa & 0x1FFF;
+
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+    half++;
+
+  return half;
+}
+
+float FeatureStore::HalfToFloat(const Uint16 inValue)
+{
+  cUint32 sign = Uint32(inValue & 0x8000) << 16;
+  Uint32 exponent = (inValue >> 10) & 0x1F;
+  Uint32 mantissa = inValue & 0x3FF;
+  Uint32 f;
+
+  if (exponent == 0)
+  {
+    if (mantissa == 0)
+    {
+      f = sign;
+    }
+    else
+    {
+      // Renormalize the denormal
+      exponent = 127 - 15 + 1;
+      while ((mantissa & 0x400) == 0)
+      {
+        mantissa <<= 1;
+        exponent--;
+      }
+      mantissa &= 0x3FF;
+      f = sign | (exponent << 23) | (mantissa << 13);
+    }
+  }
+  else
+  if (exponent == 0x1F)
+  {
+    f = sign | 0x7F800000 | (mantissa << 13);
+  }
+  else
+  {
+    f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  }
+
+  float value;
+  memcpy(&value, &f, sizeof(value));
+  return value;
+}
@@ -0,0 +1,86 @@
+#ifndef FEATURESTORE_HDR
+#define FEATURESTORE_HDR
+
+#include <opencv/cv.h>
+
+#include "../utils/Types.hpp"
+
+// Queries are prepared in a buffer on the stack
+#define MAX_QUERY_DIMS 256
+
+DECLARE_CLASS(FeatureStore)
+
+/// @brief Row major storage of the projected database features
+///
+/// Features can be kept as float32, float16 or as int8 with a per dimension
+/// scale. Distances are computed directly on the stored representation, so
+/// a quantized store never expands the database back to float. The scan
+/// kernel is picked once per build, with fixed loop bounds for 8, 16 and 32
+/// dimensions.
+class FeatureStore
+{
+public:
+  enum Format
+  {
+    FLOAT32,
+    FLOAT16,
+    INT8
+  };
+
+  /// @brief Const: inKeepExact retains a float32 copy for re-ranking
+  FeatureStore(Format inFormat, cBool inKeepExact);
+
+  /// @brief Build the store from a rows x dims CV_32FC1 matrix
+  void Build(const cv::Mat &inFeatures);
+
+  /// @brief Euclidean distance from inQuery to every row
+  void Distances(pcFloat inQuery, pFloat outDistances) const;
+
+  /// @brief Euclidean distance from inQuery to each of inRows
+  void Distances(pcFloat inQuery, rcvInt inRows, pFloat outDistances) const;
+
+  /// @brief Euclidean distance from inQuery to row inRow
+  float Distance(pcFloat inQuery, cInt inRow) const;
+
+  /// @brief Unquantized row, only valid for FLOAT32 or when kept exact
+  cv::Mat ExactRow(cInt inRow) const;
+
+  bool HasExact() const { return !mExact.empty(); }
+  int Rows() const { return mRows; }
+  int Dims() const { return mDims; }
+
+  /// @brief Bytes used by the quantized rows and their scales
+  size_t Bytes() const;
+
+  /// @brief Parse "none", "fp16" or "int8"
+  static bool ParseFormat(rcString inName, Format &outFormat);
+
+  static Uint16 FloatToHalf(cFloat inValue);
+  static float HalfToFloat(const Uint16 inValue);
+
+private:
+  /// @brief Distances to inCount rows, inRows NULL means rows 0 to inCount - 1
+  typedef void (FeatureStore::*Kernel)(pcFloat inQuery, const int *inRows, cInt inCount, pFloat outDistances) const;
+
+  template<int Format, int Dims>
+  void Scan(pcFloat inQuery, const int *inRows, cInt inCount, pFloat outDistances) const;
+
+  template<int Format>
+  Kernel SelectKernel() const;
+
+  void PrepareQuery(pcFloat inQuery, pFloat outQuery) const;
+
+  Format mFormat;
+  bool mKeepExact;
+  int mRows;
+  int mDims;
+  Kernel mKernel; ///< Scan of the format and dimensions, set by Build
+
+  cv::Mat mExact; ///< Float32 features, shared with the input matrix
+  std::vector<Uint16> mHalf; ///< Float16 features
+  std::vector<int8_t> mInt8; ///< Int8 features, x = mScale * q
+  vFloat mScale; ///< Per dimension int8 scale
+  vFloat mWeight; ///< Per dimension mScale^2
+};
+
+#endif // FEATURESTORE_HDR
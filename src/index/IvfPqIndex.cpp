@@ -0,0 +1,387 @@
+#include "IvfPqIndex.hpp"
+#include "FeatureStore.hpp"
+
+#include "../utils/Debugger.hpp"
+#include "../utils/Metrics.hpp"
+#include "../utils/Verbose.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#define IVFPQ_MAGIC       "HEXIVFPQ"
+#define IVFPQ_VERSION     1
+#define MAX_CODES         256
+#define MAX_TRAIN_ROWS    65536
+#define KMEANS_ITERATIONS 20
+#define KMEANS_EPSILON    1e-3
+
+namespace
+{
+  template<typename T>
+  void WriteRaw(std::ofstream &inFile, const T &inValue)
+  {
+    inFile.write(reinterpret_cast<const char*>(&inValue), sizeof(T));
+  }
+
+  template<typename T>
+  bool ReadRaw(std::ifstream &inFile, T &outValue)
+  {
+    return bool(inFile.read(reinterpret_cast<char*>(&outValue), sizeof(T)));
+  }
+
+  float SquaredDistance(pcFloat inA, pcFloat inB, cInt inDims)
+  {
+    float sum = 0.0f;
+
+    for (int d = 0; d < inDims; d++)
+    {
+      cFloat diff = inA[d] - inB[d];
+      sum += diff * diff;
+    }
+
+    return sum;
+  }
+}
+
+IvfPqIndex::IvfPqIndex(cInt inLists, cInt inSubspaces):
+  mLists(inLists),
+  mSubspaces(inSubspaces),
+  mDims(0),
+  mSubDims(0),
+  mCodes(0)
+{
+  ASSERT(mLists > 0 && mSubspaces > 0);
+}
+
+void IvfPqIndex::KMeans(const cv::Mat &inData, cInt inK, cv::Mat &outCenters)
+{
+  cInt k = std::min<int>(inK, inData.rows);
+  cv::Mat labels;
+  cv::kmeans(inData, k, labels,
+             cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS,
+                              KMEANS_ITERATIONS, KMEANS_EPSILON),
+             1, cv::KMEANS_PP_CENTERS, outCenters);
+}
+
+int IvfPqIndex::Nearest(pcFloat inVec, const cv::Mat &inCenters, cInt inDims)
+{
+  int best = 0;
+  float best_dist = std::numeric_limits<float>::max();
+
+  for (int c = 0; c < inCenters.rows; c++)
+  {
+    cFloat dist = SquaredDistance(inVec, inCenters.ptr<float>(c), inDims);
+
+    if (dist < best_dist)
+    {
+      best_dist = dist;
+      best = c;
+    }
+  }
+
+  return best;
+}
+
+void IvfPqIndex::Build(const cv::Mat &inFeatures)
+{
+  ASSERT(inFeatures.type() == CV_32FC1 && inFeatures.rows > 0);
+  ASSERT(inFeatures.cols <= MAX_QUERY_DIMS);
+  ASSERT_MSG(inFeatures.cols % mSubspaces == 0,
+             "%d pq subspaces don't divide %d dimensions", mSubspaces, inFeatures.cols);
+
+  mDims = inFeatures.cols;
+  mSubDims = mDims / mSubspaces;
+
+  // Train on a deterministic subsample, k-means cost grows with the rows
+  cv::Mat train;
+  if (inFeatures.rows > MAX_TRAIN_ROWS)
+  {
+    cv::RNG rng(0);
+    train.create(MAX_TRAIN_ROWS, mDims, CV_32FC1);
+
+    for (int i = 0; i < MAX_TRAIN_ROWS; i++)
+    {
+      cv::Mat row = train.row(i);
+      inFeatures.row(rng.uniform(0, inFeatures.rows)).copyTo(row);
+    }
+  }
+  else
+  {
+    train = inFeatures;
+  }
+
+  KMeans(train, mLists, mCoarse);
+  mLists = mCoarse.rows;
+
+  // Residuals of the training rows to their coarse centroid
+  cv::Mat residuals(train.rows, mDims, CV_32FC1);
+
+  #pragma omp parallel for
+  for (int i = 0; i < train.rows; i++)
+  {
+    pcFloat row = train.ptr<float>(i);
+    pcFloat center = mCoarse.ptr<float>(Nearest(row, mCoarse, mDims));
+    pFloat residual = residuals.ptr<float>(i);
+
+    for (int d = 0; d < mDims; d++)
+      residual[d] = row[d] - center[d];
+  }
+
+  mCodes = std::min<int>(MAX_CODES, train.rows);
+  mCodebooks.resize(mSubspaces);
+
+  for (int m = 0; m < mSubspaces; m++)
+  {
+    cv::Mat sub = residuals.colRange(m * mSubDims, (m + 1) * mSubDims).clone();
+    KMeans(sub, mCodes, mCodebooks[m]);
+  }
+
+  mCodes = mCodebooks[0].rows;
+
+  // Encode every feature into its list
+  vInt list_of(inFeatures.rows);
+  std::vector<Uint8> codes(size_t(inFeatures.rows) * mSubspaces);
+
+  #pragma omp parallel for
+  for (int i = 0; i < inFeatures.rows; i++)
+  {
+    pcFloat row = inFeatures.ptr<float>(i);
+    cInt list = Nearest(row, mCoarse, mDims);
+    pcFloat center = mCoarse.ptr<float>(list);
+    float residual[MAX_QUERY_DIMS];
+
+    for (int d = 0; d < mDims; d++)
+      residual[d] = row[d] - center[d];
+
+    for (int m = 0; m < mSubspaces; m++)
+      codes[size_t(i) * mSubspaces + m] =
+        Nearest(residual + m * mSubDims, mCodebooks[m], mSubDims);
+
+    list_of[i] = list;
+  }
+
+  mIds.assign(mLists, vInt());
+  mListCodes.assign(mLists, std::vector<Uint8>());
+
+  for (int i = 0; i < inFeatures.rows; i++)
+  {
+    mIds[list_of[i]].push_back(i);
+    mListCodes[list_of[i]].insert(mListCodes[list_of[i]].end(),
+                                  codes.begin() + size_t(i) * mSubspaces,
+                                  codes.begin() + size_t(i + 1) * mSubspaces);
+  }
+}
+
+void IvfPqIndex::Search(
+  pcFloat inQuery,
+  cInt inProbe,
+  cInt inK,
+  rvInt outIds,
+  rvFloat outDistances
+) const
+{
+  Workspace work;
+  Search(inQuery, inProbe, inK, outIds, outDistances, work);
+}
+
+void IvfPqIndex::Search(
+  pcFloat inQuery,
+  cInt inProbe,
+  cInt inK,
+  rvInt outIds,
+  rvFloat outDistances,
+  Workspace &ioWork
+) const
+{
+  outIds.clear();
+  outDistances.clear();
+
+  // Rank the coarse lists
+  std::vector<std::pair<float, int> > &lists = ioWork.lists;
+  lists.resize(mLists);
+
+  for (int c = 0; c < mLists; c++)
+    lists[c] = std::make_pair(SquaredDistance(inQuery, mCoarse.ptr<float>(c), mDims), c);
+
+  std::sort(lists.begin(), lists.end());
+
+  std::vector<std::pair<float, int> > &candidates = ioWork.candidates;
+  vFloat &table = ioWork.table;
+  candidates.clear();
+  table.resize(mSubspaces * mCodes);
+  float residual[MAX_QUERY_DIMS];
+
+  // Keep probing past inProbe while the visited lists were all empty
+  for (int p = 0; p < mLists && (p < inProbe || candidates.empty()); p++)
+  {
+    cInt list = lists[p].second;
+    pcFloat center = mCoarse.ptr<float>(list);
+
+    for (int d = 0; d < mDims; d++)
+      residual[d] = inQuery[d] - center[d];
+
+    // Asymmetric distance table, query residual vs every subspace code
+    for (int m = 0; m < mSubspaces; m++)
+      for (int k = 0; k < mCodes; k++)
+        table[m * mCodes + k] = SquaredDistance(residual + m * mSubDims,
+                                                mCodebooks[m].ptr<float>(k), mSubDims);
+
+    const vInt &ids = mIds[list];
+    const Uint8 *codes = ids.empty() ? NULL : &mListCodes[list][0];
+
+    for (int i = 0, n = ids.size(); i < n; i++)
+    {
+      float dist = 0.0f;
+
+      for (int m = 0; m < mSubspaces; m++)
+        dist += table[m * mCodes + codes[i * mSubspaces + m]];
+
+      candidates.push_back(std::make_pair(dist, ids[i]));
+    }
+  }
+
+  METRIC_ADD("distance-evaluations", mLists + candidates.size());
+
+  cInt k = std::min<int>(inK, candidates.size());
+  std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end());
+
+  outIds.resize(k);
+  outDistances.resize(k);
+
+  for (int i = 0; i < k; i++)
+  {
+    outIds[i] = candidates[i].second;
+    outDistances[i] = sqrtf(candidates[i].first);
+  }
+}
+
+size_t IvfPqIndex::Bytes() const
+{
+  size_t bytes = mCoarse.total() * sizeof(float);
+
+  for (int m = 0, n = mCodebooks.size(); m < n; m++)
+    bytes += mCodebooks[m].total() * sizeof(float);
+
+  for (int l = 0, n = mIds.size(); l < n; l++)
+    bytes += mIds[l].size() * sizeof(int) + mListCodes[l].size();
+
+  return bytes;
+}
+
+bool IvfPqIndex::Save(rcString inFile, const Uint64 inKey) const
+{
+  std::ofstream file(inFile.c_str(), std::ios::out | std::ios::binary);
+
+  if (!file.good())
+    return false;
+
+  file.write(IVFPQ_MAGIC, strlen(IVFPQ_MAGIC));
+  WriteRaw(file, Int32(IVFPQ_VERSION));
+  WriteRaw(file, inKey);
+  WriteRaw(file, Int32(mLists));
+  WriteRaw(file, Int32(mSubspaces));
+  WriteRaw(file, Int32(mDims));
+  WriteRaw(file, Int32(mCodes));
+
+  for (int c = 0; c < mLists; c++)
+    file.write(reinterpret_cast<const char*>(mCoarse.ptr<float>(c)), mDims * sizeof(float));
+
+  for (int m = 0; m < mSubspaces; m++)
+    for (int k = 0; k < mCodes; k++)
+      file.write(reinterpret_cast<const char*>(mCodebooks[m].ptr<float>(k)),
+                 mSubDims * sizeof(float));
+
+  for (int l = 0; l < mLists; l++)
+  {
+    WriteRaw(file, Int32(mIds[l].size()));
+
+    if (mIds[l].empty())
+      continue;
+
+    file.write(reinterpret_cast<const char*>(&mIds[l][0]), mIds[l].size() * sizeof(int));
+    file.write(reinterpret_cast<const char*>(&mListCodes[l][0]), mListCodes[l].size());
+  }
+
+  return file.good();
+}
+
+bool IvfPqIndex::Load(rcString inFile, const Uint64 inKey, cInt inRows)
+{
+  std::ifstream file(inFile.c_str(), std::ios::in | std::ios::binary);
+  char magic[sizeof(IVFPQ_MAGIC)] = {0};
+  Int32 version, lists, subspaces, dims, codes;
+  Uint64 key;
+
+  if (!file.read(magic, strlen(IVFPQ_MAGIC)) || strcmp(magic, IVFPQ_MAGIC) != 0)
+    return false;
+
+  if (!ReadRaw(file, version) || version != IVFPQ_VERSION ||
+      !ReadRaw(file, key) || key != inKey ||
+      !ReadRaw(file, lists) || !ReadRaw(file, subspaces) ||
+      !ReadRaw(file, dims) || !ReadRaw(file, codes))
+    return false;
+
+  if (lists <= 0 || lists > inRows || subspaces <= 0 || dims <= 0 || dims > MAX_QUERY_DIMS ||
+      dims % subspaces != 0 || codes <= 0 || codes > MAX_CODES)
+    return false;
+
+  mLists = lists;
+  mSubspaces = subspaces;
+  mDims = dims;
+  mSubDims = dims / subspaces;
+  mCodes = codes;
+
+  mCoarse.create(mLists, mDims, CV_32FC1);
+  for (int c = 0; c < mLists; c++)
+    file.read(reinterpret_cast<char*>(mCoarse.ptr<float>(c)), mDims * sizeof(float));
+
+  mCodebooks.resize(mSubspaces);
+  for (int m = 0; m < mSubspaces; m++)
+  {
+    mCodebooks[m].create(mCodes, mSubDims, CV_32FC1);
+    for (int k = 0; k < mCodes; k++)
+      file.read(reinterpret_cast<char*>(mCodebooks[m].ptr<float>(k)), mSubDims * sizeof(float));
+  }
+
+  mIds.assign(mLists, vInt());
+  mListCodes.assign(mLists, std::vector<Uint8>());
+
+  // Every row is in exactly one list, a damaged file must not index past
+  // the store the ids refer to
+  int remaining = inRows;
+  std::vector<bool> seen(inRows, false);
+
+  for (int l = 0; l < mLists; l++)
+  {
+    Int32 size;
+    if (!ReadRaw(file, size) || size < 0 || size > remaining)
+      return false;
+
+    if (size == 0)
+      continue;
+
+    remaining -= size;
+    mIds[l].resize(size);
+    mListCodes[l].resize(size_t(size) * mSubspaces);
+    file.read(reinterpret_cast<char*>(&mIds[l][0]), size * sizeof(int));
+    file.read(reinterpret_cast<char*>(&mListCodes[l][0]), mListCodes[l].size());
+
+    for (int i = 0; i < size; i++)
+    {
+      cInt id = mIds[l][i];
+      if (id < 0 || id >= inRows || seen[id])
+        return false;
+
+      seen[id] = true;
+    }
+
+    for (size_t i = 0, n = mListCodes[l].size(); i < n; i++)
+      if (mListCodes[l][i] >= mCodes)
+        return false;
+  }
+
+  return remaining == 0 && file.good();
+}
@@ -0,0 +1,83 @@
+#ifndef IVFPQINDEX_HDR
+#define IVFPQINDEX_HDR
+
+#include <utility>
+#include <opencv/cv.h>
+
+#include "../utils/Types.hpp"
+
+DECLARE_CLASS(IvfPqIndex)
+
+/// @brief Inverted file index with product quantized residuals (IVF-PQ)
+///
+/// A coarse k-means partitions the projected features into lists. Within a
+/// list every feature is stored as its residual to the list centroid, split
+/// into subspaces that are each quantized to one byte. A query only visits
+/// the closest lists and scores their entries with per subspace lookup
+/// tables (asymmetric distance computation).
+class IvfPqIndex
+{
+public:
+  /// @brief Buffers of a search, reused by callers that search repeatedly
+  struct Workspace
+  {
+    std::vector<std::pair<float, int> > lists;
+    std::vector<std::pair<float, int> > candidates;
+    vFloat table;
+  };
+
+  /// @brief Const: inLists coarse lists, inSubspaces must divide the dims
+  IvfPqIndex(cInt inLists, cInt inSubspaces);
+
+  /// @brief Train the quantizers and encode all rows of CV_32FC1 inFeatures
+  void Build(const cv::Mat &inFeatures);
+
+  /// @brief Approximate inK nearest rows, visiting inProbe lists
+  void Search(
+    pcFloat inQuery,
+    cInt inProbe,
+    cInt inK,
+    rvInt outIds,
+    rvFloat outDistances
+  ) const;
+
+  /// @brief Like Search, but without allocating once ioWork has grown
+  void Search(
+    pcFloat inQuery,
+    cInt inProbe,
+    cInt inK,
+    rvInt outIds,
+    rvFloat outDistances,
+    Workspace &ioWork
+  ) const;
+
+  /// @brief Store the index, inKey identifies the features it was built on
+  bool Save(rcString inFile, const Uint64 inKey) const;
+
+  /// @brief Load the index of inRows features, fails when it was built on
+  /// different features or doesn't list every row exactly once
+  bool Load(rcString inFile, const Uint64 inKey, cInt inRows);
+
+  int Lists() const { return mLists; }
+  int Subspaces() const { return mSubspaces; }
+  size_t Bytes() const;
+
+private:
+  /// @brief k-means on rows, returns min(inK, rows) centers
+  static void KMeans(const cv::Mat &inData, cInt inK, cv::Mat &outCenters);
+  static int Nearest(pcFloat inVec, const cv::Mat &inCenters, cInt inDims);
+
+  int mLists; ///< Number of coarse lists
+  int mSubspaces; ///< Number of product quantizer subspaces
+  int mDims; ///< Dimensions of a feature
+  int mSubDims; ///< Dimensions of a subspace
+  int mCodes; ///< Centroids per subspace, at most 256
+
+  cv::Mat mCoarse; ///< mLists x mDims coarse centroids
+  std::vector<cv::Mat> mCodebooks; ///< Per subspace mCodes x mSubDims
+
+  std::vector<vInt> mIds; ///< Per list the database row ids
+  std::vector<std::vector<Uint8> > mListCodes; ///< Per list mSubspaces bytes per id
+};
+
+#endif // IVFPQINDEX_HDR
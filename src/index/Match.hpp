@@ -0,0 +1,32 @@
+#ifndef MATCH_HDR
+#define MATCH_HDR
+
+#include "../utils/Types.hpp"
+
+DECLARE_STRUCT(Match)
+
+/// @brief A database candidate for a tile, val is its distance. variant
+/// is the flip of the image the distance was measured on, 0 is none.
+struct Match
+{
+  Match(): id(-1), val(-1.0f), variant(0) {}
+  Match(int pid, float v, int pvariant = 0): id(pid), val(v), variant(pvariant) {}
+  int id;
+  float val;
+  int variant;
+  bool operator< (const Match &m) const
+  {
+    return val > m.val;
+  }
+  static bool Closer(const Match &a, const Match &b)
+  {
+    return a.val < b.val;
+  }
+  /// @brief Closer with ties by id, a stable order that std::sort keeps
+  static bool CloserById(const Match &a, const Match &b)
+  {
+    return a.val < b.val || (a.val == b.val && a.id < b.id);
+  }
+};
+
+#endif // MATCH_HDR
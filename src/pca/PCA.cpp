@@ -3,6 +3,14 @@
 #include "../utils/Debugger.hpp"
 #include "../utils/Verbose.hpp"
 
+PCA::PCA():
+  mRows(0),
+  mCols(0),
+  mCurRow(0),
+  mDimensions(0)
+{
+}
+
 PCA::PCA(const int rows, const int cols):
   mRows(rows),
   mCols(cols),
@@ -118,6 +126,39 @@ void PCA::GetEigenVector(const int i, cv::Mat &eigenvector)
   EigRow2CvMat(e, eigenvector);
 }
 
+void PCA::Export(cv::Mat &basis)
+{
+  ASSERT(mDimensions > 0);
+
+  basis.create(mDimensions + 1, mCols, CV_32FC1);
+  for (int j = 0; j < mCols; j++)
+    basis.at<float>(0, j) = mMean(j);
+
+  for (int i = 0; i < mDimensions; i++)
+    for (int j = 0; j < mCols; j++)
+      basis.at<float>(i + 1, j) = mEigen(i, j);
+}
+
+void PCA::Import(const cv::Mat &basis)
+{
+  ASSERT(basis.type() == CV_32FC1 && basis.rows > 1);
+
+  // Only the basis is kept, as after Solve
+  mCols = basis.cols;
+  mDimensions = basis.rows - 1;
+  mRows = mCurRow = mDimensions + 1;
+  mData.resize(0, 0);
+
+  mMean.resize(mCols);
+  for (int j = 0; j < mCols; j++)
+    mMean(j) = basis.at<float>(0, j);
+
+  mEigen.resize(mDimensions, mCols);
+  for (int i = 0; i < mDimensions; i++)
+    for (int j = 0; j < mCols; j++)
+      mEigen(i, j) = basis.at<float>(i + 1, j);
+}
+
 void PCA::EigRow2CvMat(const RowVectorXf &in, cv::Mat &out)
 {
   out.create(1, in.cols(), CV_32FC1);
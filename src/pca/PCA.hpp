@@ -9,6 +9,9 @@ using namespace Eigen;
 class PCA
 {
 public:
+  /// @brief Const: empty basis, to be filled by Import
+  PCA();
+
   /// @brief Const: create datamatrix rows * cols, rows <= cols
   PCA(const int rows, const int cols);
 
@@ -31,6 +34,12 @@ public:
   void GetEigenVector(const int i, RowVectorXf &eigenvector);
   void GetEigenVector(const int i, cv::Mat &eigenvector);
 
+  /// @brief Export the solved basis: mean in row 0, eigenvectors below
+  void Export(cv::Mat &basis);
+
+  /// @brief Import a basis written by Export instead of solving
+  void Import(const cv::Mat &basis);
+
 
 private:
   void CvMat2EigRow(const cv::Mat &in, RowVectorXf &out);
@@ -0,0 +1,68 @@
+#include "Channel.hpp"
+
+#include <cerrno>
+#include <sys/socket.h>
+#include <unistd.h>
+
+bool Channel::Pair(Channel &outA, Channel &outB)
+{
+  int fds[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return false;
+
+  outA.mFd = fds[0];
+  outB.mFd = fds[1];
+  return true;
+}
+
+bool Channel::Send(const void *inData, const size_t inBytes)
+{
+  const char *data = static_cast<const char*>(inData);
+  size_t sent = 0;
+
+  while (sent < inBytes)
+  {
+    // A vanished peer is an error to the caller, not a SIGPIPE
+    const ssize_t n = send(mFd, data + sent, inBytes - sent, MSG_NOSIGNAL);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0)
+      return false;
+
+    sent += n;
+  }
+
+  return true;
+}
+
+bool Channel::Receive(void *outData, const size_t inBytes)
+{
+  char *data = static_cast<char*>(outData);
+  size_t received = 0;
+
+  while (received < inBytes)
+  {
+    const ssize_t n = recv(mFd, data + received, inBytes - received, 0);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0)
+      return false;
+
+    received += n;
+  }
+
+  return true;
+}
+
+void Channel::Close()
+{
+  if (mFd >= 0)
+    close(mFd);
+
+  mFd = -1;
+}
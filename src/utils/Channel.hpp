@@ -0,0 +1,32 @@
+#ifndef CHANNEL_HDR
+#define CHANNEL_HDR
+
+#include <cstddef>
+#include "Types.hpp"
+
+/// @brief One end of a local stream socket between two processes
+///
+/// Both ends are created before a fork, each process closes the one it
+/// doesn't use. Copies share the descriptor, it is only closed by Close.
+class Channel
+{
+public:
+  Channel(): mFd(-1) {}
+
+  /// @brief Connected ends, false on failure
+  static bool Pair(Channel &outA, Channel &outB);
+
+  /// @brief Blocks until all of inBytes are written, false once the peer is gone
+  bool Send(const void *inData, const size_t inBytes);
+
+  /// @brief Blocks until inBytes are read, false once the peer is gone
+  bool Receive(void *outData, const size_t inBytes);
+
+  void Close();
+  bool IsOpen() const { return mFd >= 0; }
+
+private:
+  int mFd;
+};
+
+#endif // CHANNEL_HDR
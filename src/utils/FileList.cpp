@@ -0,0 +1,258 @@
+#include "FileList.hpp"
+
+#include "Metrics.hpp"
+#include "Timer.hpp"
+#include "Verbose.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC "HEXFILES 1"
+
+bool FileList::IsImage(rcString inFile)
+{
+  static const char *suffixes[] = { "bmp", "jpg", "jpeg", "png", "tif", "tiff" };
+  const size_t dot = inFile.find_last_of('.');
+
+  if (dot == String::npos || inFile.size() - dot > 5)
+    return false;
+
+  char suffix[5] = { 0 };
+  for (size_t i = dot + 1, j = 0; i < inFile.size(); i++, j++)
+    suffix[j] = tolower(inFile[i]);
+
+  for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+  {
+    if (strcmp(suffix, suffixes[i]) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+void FileList::Enumerate(rcString inDir, rvString outFiles)
+{
+  std::vector<Directory> dirs;
+  Enumerate(inDir, outFiles, dirs);
+  Prefix(inDir, outFiles);
+}
+
+void FileList::Enumerate(
+  rcString inDir,
+  rvString outFiles,
+  std::vector<Directory> &outDirs
+)
+{
+  PROFILE("enumerate-files");
+  cString root = inDir.at(inDir.size() - 1) == '/' ? inDir : inDir + '/';
+  std::vector<Directory> level(1);
+  level[0].mtime = 0;
+  outFiles.clear();
+  outDirs.clear();
+
+  while (!level.empty())
+  {
+    std::vector<Directory> next;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int d = 0; d < int(level.size()); d++)
+    {
+      Directory &dir = level[d];
+      cString path = root + dir.path;
+      vString files;
+      std::vector<Directory> subdirs;
+      DIR *handle = opendir(path.c_str());
+
+      if (handle == NULL)
+      {
+        ErrorLine("Unable to read directory `" << path << "'");
+        continue;
+      }
+
+      struct stat st;
+      if (fstat(dirfd(handle), &st) == 0)
+        dir.mtime = Int64(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+
+      while (const dirent *entry = readdir(handle))
+      {
+        // Also skips `.', `..' and the cache directory
+        if (entry->d_name[0] == '.')
+          continue;
+
+        cString name = dir.path + entry->d_name;
+        bool is_dir = entry->d_type == DT_DIR;
+        bool is_file = entry->d_type == DT_REG;
+
+        // Not every file system reports the type, and links need following
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+        {
+          if (stat((root + name).c_str(), &st) != 0)
+            continue;
+
+          is_dir = S_ISDIR(st.st_mode);
+          is_file = S_ISREG(st.st_mode);
+        }
+
+        if (is_dir)
+        {
+          subdirs.push_back(Directory());
+          subdirs.back().path = name + '/';
+          subdirs.back().mtime = 0;
+        }
+        else
+        if (is_file && IsImage(name))
+          files.push_back(name);
+      }
+
+      closedir(handle);
+
+      #pragma omp critical(file_list)
+      {
+        outFiles.insert(outFiles.end(), files.begin(), files.end());
+        next.insert(next.end(), subdirs.begin(), subdirs.end());
+      }
+    }
+
+    outDirs.insert(outDirs.end(), level.begin(), level.end());
+    level.swap(next);
+  }
+
+  std::sort(outFiles.begin(), outFiles.end());
+  METRIC_ADD("directories-listed", outDirs.size());
+}
+
+void FileList::Cached(rcString inDir, rcString inCacheFile, rvString outFiles)
+{
+  if (Load(inDir, inCacheFile, outFiles))
+  {
+    METRIC_ADD("file-list-cache-hits", 1);
+    return;
+  }
+
+  METRIC_ADD("file-list-cache-misses", 1);
+  std::vector<Directory> dirs;
+  Enumerate(inDir, outFiles, dirs);
+  Save(inCacheFile, outFiles, dirs);
+  Prefix(inDir, outFiles);
+}
+
+void FileList::Prefix(rcString inDir, rvString ioFiles)
+{
+  cString root = inDir.at(inDir.size() - 1) == '/' ? inDir : inDir + '/';
+
+  for (int i = 0, n = ioFiles.size(); i < n; i++)
+    ioFiles[i] = root + ioFiles[i];
+}
+
+bool FileList::ModifiedTime(rcString inPath, Int64 &outTime)
+{
+  struct stat st;
+
+  if (stat(inPath.c_str(), &st) != 0)
+    return false;
+
+  outTime = Int64(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+  return true;
+}
+
+bool FileList::Stat(rcString inFile, Int64 &outSize, Int64 &outTime)
+{
+  struct stat st;
+
+  if (stat(inFile.c_str(), &st) != 0)
+    return false;
+
+  outSize = st.st_size;
+  outTime = Int64(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+  return true;
+}
+
+bool FileList::Load(rcString inDir, rcString inCacheFile, rvString outFiles)
+{
+  PROFILE("load-file-list");
+  std::ifstream file(inCacheFile.c_str());
+  cString root = inDir.at(inDir.size() - 1) == '/' ? inDir : inDir + '/';
+  String line;
+
+  if (!std::getline(file, line) || line != CACHE_MAGIC)
+    return false;
+
+  // Adding or removing an entry touches the mtime of its directory, so the
+  // list is still valid if none of them changed
+  std::vector<Directory> dirs;
+  Int64 n_dirs = 0, n_files = 0;
+
+  if (!(file >> n_dirs >> n_files) || !std::getline(file, line))
+    return false;
+
+  // Every entry takes at least two bytes, a damaged header must not make
+  // the lists larger than the file could hold
+  const std::streampos header_end = file.tellg();
+  file.seekg(0, std::ios::end);
+  const Int64 remaining = Int64(file.tellg() - header_end);
+  file.seekg(header_end);
+
+  if (!file || n_dirs < 0 || n_files < 0 || n_dirs > remaining / 2 ||
+      n_files > remaining / 2 - n_dirs)
+    return false;
+
+  dirs.resize(n_dirs);
+  for (Int64 i = 0; i < n_dirs; i++)
+  {
+    if (!(file >> dirs[i].mtime) || file.get() != ' ' || !std::getline(file, dirs[i].path))
+      return false;
+  }
+
+  bool unchanged = true;
+
+  #pragma omp parallel for schedule(dynamic, 64) reduction(&&:unchanged)
+  for (Int64 i = 0; i < n_dirs; i++)
+  {
+    Int64 mtime = 0;
+
+    if (!ModifiedTime(root + dirs[i].path, mtime) || mtime != dirs[i].mtime)
+      unchanged = false;
+  }
+
+  if (!unchanged)
+    return false;
+
+  outFiles.resize(n_files);
+  for (Int64 i = 0; i < n_files; i++)
+  {
+    if (!std::getline(file, outFiles[i]) || outFiles[i].empty())
+      return false;
+  }
+
+  Prefix(inDir, outFiles);
+
+  return true;
+}
+
+void FileList::Save(rcString inCacheFile, rcvString inFiles, const std::vector<Directory> &inDirs)
+{
+  PROFILE("save-file-list");
+  cString tmp_file = inCacheFile + ".tmp";
+  std::ofstream file(tmp_file.c_str());
+
+  file << CACHE_MAGIC << "\n" << inDirs.size() << " " << inFiles.size() << "\n";
+
+  for (int i = 0, n = inDirs.size(); i < n; i++)
+    file << inDirs[i].mtime << " " << inDirs[i].path << "\n";
+
+  // Relative to the root, so the database can move
+  for (int i = 0, n = inFiles.size(); i < n; i++)
+    file << inFiles[i] << "\n";
+
+  file.close();
+
+  if (!file || rename(tmp_file.c_str(), inCacheFile.c_str()) != 0)
+  {
+    WarningLine("Unable to write file list `" << inCacheFile << "'");
+    remove(tmp_file.c_str());
+  }
+}
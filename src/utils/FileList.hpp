@@ -0,0 +1,48 @@
+#ifndef FILELIST_HDR
+#define FILELIST_HDR
+
+#include "Types.hpp"
+
+/// @brief Image files below a directory, enumerated in parallel
+///
+/// Directories are listed breadth first, one level at a time, with every
+/// directory of a level read by its own thread. Hidden files and directories
+/// are skipped, which is also where the cache lives. The result is sorted so
+/// that runs over the same tree see the same order.
+class FileList
+{
+public:
+  /// @brief Whether inFile has an image suffix the decoders understand
+  static bool IsImage(rcString inFile);
+
+  /// @brief All images below inDir, sorted
+  static void Enumerate(rcString inDir, rvString outFiles);
+
+  /// @brief Like Enumerate, but reuses the list stored in inCacheFile as long
+  /// as no directory below inDir changed its mtime since it was written. The
+  /// cache file must not be in a listed directory, e.g. in a hidden one.
+  static void Cached(rcString inDir, rcString inCacheFile, rvString outFiles);
+
+  /// @brief Size and mtime in nanoseconds of inFile, false if it doesn't exist
+  static bool Stat(rcString inFile, Int64 &outSize, Int64 &outTime);
+
+private:
+  struct Directory
+  {
+    String path; ///< Relative to the root, empty for the root itself
+    Int64 mtime; ///< Nanoseconds
+  };
+
+  static void Enumerate(
+    rcString inDir,
+    rvString outFiles,
+    std::vector<Directory> &outDirs
+  );
+
+  static void Prefix(rcString inDir, rvString ioFiles);
+  static bool ModifiedTime(rcString inPath, Int64 &outTime);
+  static bool Load(rcString inDir, rcString inCacheFile, rvString outFiles);
+  static void Save(rcString inCacheFile, rcvString inFiles, const std::vector<Directory> &inDirs);
+};
+
+#endif // FILELIST_HDR
@@ -0,0 +1,31 @@
+#ifndef HASH_HDR
+#define HASH_HDR
+
+#include <cstddef>
+
+#include "Types.hpp"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+/// @brief 64 bit FNV-1a, chain calls by passing the previous hash as seed
+inline Uint64 Hash(const void *inData, size_t inBytes, Uint64 inSeed = FNV_OFFSET_BASIS)
+{
+  const Uint8 *p = static_cast<const Uint8*>(inData);
+  Uint64 h = inSeed;
+
+  for (size_t i = 0; i < inBytes; i++)
+  {
+    h ^= p[i];
+    h *= FNV_PRIME;
+  }
+
+  return h;
+}
+
+inline Uint64 Hash(rcString inString, Uint64 inSeed = FNV_OFFSET_BASIS)
+{
+  return Hash(inString.data(), inString.size(), inSeed);
+}
+
+#endif // HASH_HDR
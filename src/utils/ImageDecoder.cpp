@@ -0,0 +1,131 @@
+#include "ImageDecoder.hpp"
+
+#include "Metrics.hpp"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_REDUCTION_FACTOR 8
+
+bool ImageDecoder::ProbeSize(rcString inFile, cv::Size &outSize)
+{
+  std::ifstream file(inFile.c_str(), std::ios::in | std::ios::binary);
+  Uint8 marker[4];
+
+  if (!file.read(reinterpret_cast<char*>(marker), 2) ||
+      marker[0] != 0xFF || marker[1] != 0xD8)
+    return false;
+
+  // Walk the segments until the first start-of-frame marker
+  while (file.read(reinterpret_cast<char*>(marker), 4))
+  {
+    if (marker[0] != 0xFF)
+      return false;
+
+    // Fill bytes may precede a marker
+    while (marker[1] == 0xFF)
+    {
+      marker[1] = marker[2];
+      marker[2] = marker[3];
+      if (!file.read(reinterpret_cast<char*>(&marker[3]), 1))
+        return false;
+    }
+
+    cInt type   = marker[1];
+    cInt length = (marker[2] << 8) | marker[3];
+
+    if (length < 2)
+      return false;
+
+    // SOF0..SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+    if (type >= 0xC0 && type <= 0xCF && type != 0xC4 && type != 0xC8 && type != 0xCC)
+    {
+      Uint8 sof[5];
+      if (!file.read(reinterpret_cast<char*>(sof), 5))
+        return false;
+
+      outSize.height = (sof[1] << 8) | sof[2];
+      outSize.width  = (sof[3] << 8) | sof[4];
+      return outSize.width > 0 && outSize.height > 0;
+    }
+
+    file.seekg(length - 2, std::ios::cur);
+  }
+
+  return false;
+}
+
+int ImageDecoder::ReductionFactor(const cv::Size &inSize, cInt inMinSide)
+{
+  cInt min_side = std::min<int>(inSize.width, inSize.height);
+  int factor = 1;
+
+  // The decoder rounds up, so the reduced short side is ceil(min_side / f)
+  while (factor < MAX_REDUCTION_FACTOR &&
+         (min_side + 2 * factor - 1) / (2 * factor) >= inMinSide)
+    factor *= 2;
+
+  return factor;
+}
+
+cv::Mat ImageDecoder::Read(rcString inFile, cInt inMinSide)
+{
+  METRIC_ADD("images-decoded", 1);
+  METRIC_ADD("bytes-read", FileSize(inFile));
+
+#if CV_MAJOR_VERSION >= 3
+  cv::Size size;
+
+  if (IsJpeg(inFile) && ProbeSize(inFile, size))
+  {
+    switch (ReductionFactor(size, inMinSide))
+    {
+    case 2:
+      return cv::imread(inFile, cv::IMREAD_REDUCED_COLOR_2);
+    case 4:
+      return cv::imread(inFile, cv::IMREAD_REDUCED_COLOR_4);
+    case 8:
+      return cv::imread(inFile, cv::IMREAD_REDUCED_COLOR_8);
+    default:
+      break;
+    }
+  }
+#else
+  (void) inMinSide;
+#endif // CV_MAJOR_VERSION
+
+  return cv::imread(inFile, 1);
+}
+
+Uint64 ImageDecoder::FileSize(rcString inFile)
+{
+  struct stat info;
+  return stat(inFile.c_str(), &info) == 0 ? Uint64(info.st_size) : 0;
+}
+
+void ImageDecoder::Advise(rcString inFile)
+{
+  cInt fd = open(inFile.c_str(), O_RDONLY);
+
+  if (fd < 0)
+    return;
+
+  // Returns right away, the read happens in the background
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+}
+
+bool ImageDecoder::IsJpeg(rcString inFile)
+{
+  size_t p = inFile.find_last_of('.');
+
+  if (p == String::npos)
+    return false;
+
+  String ext = inFile.substr(p + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext == "jpg" || ext == "jpeg";
+}
@@ -0,0 +1,37 @@
+#ifndef IMAGEDECODER_HDR
+#define IMAGEDECODER_HDR
+
+#include <opencv/cv.h>
+#include <opencv/highgui.h>
+
+#include "Types.hpp"
+
+/// @brief Decodes images at the smallest resolution the caller can use
+///
+/// JPEG decoders can scale the DCT by 1/2, 1/4 and 1/8 while decoding, which
+/// skips most of the inverse transform and colour conversion work. For other
+/// formats OpenCV decodes at full size and resizes afterwards, so there is
+/// nothing to gain and the image is read as is.
+class ImageDecoder
+{
+public:
+  /// @brief Read the dimensions from the image header, jpeg only
+  static bool ProbeSize(rcString inFile, cv::Size &outSize);
+
+  /// @brief Largest factor in {1,2,4,8} keeping the short side >= inMinSide
+  static int ReductionFactor(const cv::Size &inSize, cInt inMinSide);
+
+  /// @brief Decode inFile such that its short side is at least inMinSide
+  static cv::Mat Read(rcString inFile, cInt inMinSide);
+
+  /// @brief Size of inFile in bytes, 0 when it doesn't exist
+  static Uint64 FileSize(rcString inFile);
+
+  /// @brief Ask the kernel to start reading inFile into the page cache
+  static void Advise(rcString inFile);
+
+private:
+  static bool IsJpeg(rcString inFile);
+};
+
+#endif // IMAGEDECODER_HDR
@@ -0,0 +1,31 @@
+#include "Json.hpp"
+
+#include <cstdio>
+
+String JsonEscape(rcString inString)
+{
+  String escaped;
+
+  for (int i = 0, n = inString.size(); i < n; i++)
+  {
+    const unsigned char c = inString[i];
+
+    if (c == '"' || c == '\\')
+    {
+      escaped += '\\';
+      escaped += c;
+    }
+    else
+    if (c < 0x20)
+    {
+      // Control characters may not appear in a string as they are
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", c);
+      escaped += code;
+    }
+    else
+      escaped += c;
+  }
+
+  return escaped;
+}
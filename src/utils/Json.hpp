@@ -0,0 +1,10 @@
+#ifndef JSON_HDR
+#define JSON_HDR
+
+#include "Types.hpp"
+
+/// @brief inString as the contents of a json string literal, without the
+/// surrounding quotes
+String JsonEscape(rcString inString);
+
+#endif // JSON_HDR
@@ -0,0 +1,86 @@
+#ifndef LRUCACHE_HDR
+#define LRUCACHE_HDR
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <utility>
+
+/// @brief Keeps the inCapacity most recently used values, not thread safe
+template<typename Key, typename Value>
+class LruCache
+{
+public:
+  explicit LruCache(const size_t inCapacity = 0): mCapacity(inCapacity) {}
+
+  /// @brief Copies the value of inKey to out and marks it as most recent
+  bool Get(const Key &inKey, Value &out)
+  {
+    typename Lookup::iterator it = mLookup.find(inKey);
+
+    if (it == mLookup.end())
+      return false;
+
+    mEntries.splice(mEntries.begin(), mEntries, it->second);
+    out = it->second->second;
+    return true;
+  }
+
+  /// @brief Whether inKey is cached, without marking it as recent
+  bool Contains(const Key &inKey) const { return mLookup.count(inKey) > 0; }
+
+  /// @brief Inserts or replaces inKey, evicting the least recent value
+  void Put(const Key &inKey, const Value &inValue)
+  {
+    if (mCapacity == 0)
+      return;
+
+    typename Lookup::iterator it = mLookup.find(inKey);
+
+    if (it != mLookup.end())
+    {
+      it->second->second = inValue;
+      mEntries.splice(mEntries.begin(), mEntries, it->second);
+      return;
+    }
+
+    if (mEntries.size() >= mCapacity)
+    {
+      mLookup.erase(mEntries.back().first);
+      mEntries.pop_back();
+    }
+
+    mEntries.push_front(std::make_pair(inKey, inValue));
+    mLookup[inKey] = mEntries.begin();
+  }
+
+  void SetCapacity(const size_t inCapacity)
+  {
+    mCapacity = inCapacity;
+
+    while (mEntries.size() > mCapacity)
+    {
+      mLookup.erase(mEntries.back().first);
+      mEntries.pop_back();
+    }
+  }
+
+  void Clear()
+  {
+    mEntries.clear();
+    mLookup.clear();
+  }
+
+  size_t Size() const { return mEntries.size(); }
+  size_t Capacity() const { return mCapacity; }
+
+private:
+  typedef std::list<std::pair<Key, Value> > Entries;
+  typedef std::map<Key, typename Entries::iterator> Lookup;
+
+  size_t mCapacity;
+  Entries mEntries; ///< Most recent first
+  Lookup mLookup;
+};
+
+#endif // LRUCACHE_HDR
@@ -0,0 +1,148 @@
+#include "MemoryBudget.hpp"
+
+#include "Debugger.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+MemoryBudget::MemoryBudget(const Uint64 inLimit):
+  mLimit(inLimit)
+{
+}
+
+Uint64 MemoryBudget::Available() const
+{
+  if (!IsLimited())
+    return std::numeric_limits<Uint64>::max();
+
+  const Uint64 rss = CurrentRss();
+  return rss < mLimit ? mLimit - rss : 0;
+}
+
+bool MemoryBudget::Fits(const Uint64 inBytes, cFloat inShare) const
+{
+  if (!IsLimited())
+    return true;
+
+  return inBytes <= Uint64(Available() * double(inShare));
+}
+
+int MemoryBudget::Rows(const Uint64 inRowBytes, cFloat inShare, cInt inMaxRows) const
+{
+  if (!IsLimited() || inRowBytes == 0)
+    return inMaxRows;
+
+  const Uint64 rows = Uint64(Available() * double(inShare)) / inRowBytes;
+  return std::max<int>(1, std::min<Uint64>(rows, inMaxRows));
+}
+
+Uint64 MemoryBudget::CurrentRss()
+{
+  // Second field of statm is the resident set in pages
+  FILE *statm = fopen("/proc/self/statm", "r");
+  unsigned long size = 0, resident = 0;
+
+  if (statm == NULL)
+    return 0;
+
+  if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+
+  fclose(statm);
+  return Uint64(resident) * sysconf(_SC_PAGESIZE);
+}
+
+bool MemoryBudget::ParseSize(rcString inString, Uint64 &outBytes)
+{
+  char *end = NULL;
+  const double value = strtod(inString.c_str(), &end);
+
+  if (end == inString.c_str() || value < 0.0)
+    return false;
+
+  double unit = 1.0;
+
+  switch (*end)
+  {
+  case 'k': case 'K': unit = 1024.0; end++; break;
+  case 'm': case 'M': unit = 1024.0 * 1024.0; end++; break;
+  case 'g': case 'G': unit = 1024.0 * 1024.0 * 1024.0; end++; break;
+  case 't': case 'T': unit = 1024.0 * 1024.0 * 1024.0 * 1024.0; end++; break;
+  default: break;
+  }
+
+  // Optional trailing `B' as in `512MB'
+  if (*end == 'b' || *end == 'B')
+    end++;
+
+  if (*end != '\0')
+    return false;
+
+  outBytes = Uint64(value * unit);
+  return true;
+}
+
+String MemoryBudget::Format(const Uint64 inBytes)
+{
+  static const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+  double value = inBytes;
+  int unit = 0;
+
+  while (value >= 1024.0 && unit < 4)
+  {
+    value /= 1024.0;
+    unit++;
+  }
+
+  std::stringstream s;
+  s << std::setiosflags(std::ios::fixed) << std::setprecision(unit == 0 ? 0 : 1)
+    << value << " " << units[unit];
+  return s.str();
+}
+
+MappedFile::MappedFile():
+  mData(NULL),
+  mBytes(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+  if (mData != NULL)
+    munmap(mData, mBytes);
+}
+
+bool MappedFile::Create(rcString inPrefix, const Uint64 inBytes)
+{
+  ASSERT(mData == NULL);
+
+  // A unique name, concurrent runs must not truncate each other's canvas
+  std::vector<char> path(inPrefix.begin(), inPrefix.end());
+  const char suffix[] = "-XXXXXX";
+  path.insert(path.end(), suffix, suffix + sizeof(suffix));
+  const int fd = mkstemp(&path[0]);
+
+  if (fd < 0)
+    return false;
+
+  void *data = MAP_FAILED;
+
+  if (ftruncate(fd, inBytes) == 0)
+    data = mmap(NULL, inBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  unlink(&path[0]);
+  close(fd);
+
+  if (data == MAP_FAILED)
+    return false;
+
+  mData = data;
+  mBytes = inBytes;
+  return true;
+}
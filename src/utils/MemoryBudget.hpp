@@ -0,0 +1,66 @@
+#ifndef MEMORYBUDGET_HDR
+#define MEMORYBUDGET_HDR
+
+#include "Types.hpp"
+
+/// @brief Upper bound on the resident set size of the process
+///
+/// Stages ask whether a buffer fits into a share of what is left of the
+/// limit before allocating it and pick smaller blocks or slower out-of-core
+/// paths otherwise. A limit of 0 means unlimited, every buffer then fits.
+class MemoryBudget
+{
+public:
+  MemoryBudget(const Uint64 inLimit = 0);
+
+  bool IsLimited() const { return mLimit > 0; }
+  Uint64 Limit() const { return mLimit; }
+
+  /// @brief Bytes left until the limit is reached by the current RSS
+  Uint64 Available() const;
+
+  /// @brief Whether inBytes fit into inShare of the available memory
+  bool Fits(const Uint64 inBytes, cFloat inShare) const;
+
+  /// @brief Rows of inRowBytes each fitting into inShare, in [1, inMaxRows]
+  int Rows(const Uint64 inRowBytes, cFloat inShare, cInt inMaxRows) const;
+
+  /// @brief Resident set size of the process in bytes
+  static Uint64 CurrentRss();
+
+  /// @brief Parse a size like `512M', `2G' or `1048576'
+  static bool ParseSize(rcString inString, Uint64 &outBytes);
+
+  /// @brief Human readable size, e.g. `1.5 GB'
+  static String Format(const Uint64 inBytes);
+
+private:
+  Uint64 mLimit;
+};
+
+/// @brief Anonymous file backed memory for buffers that may exceed the budget
+///
+/// The file is unlinked right after mapping, so the kernel can write pages
+/// back to disk under memory pressure and nothing is left behind on exit.
+class MappedFile
+{
+public:
+  MappedFile();
+  ~MappedFile();
+
+  /// @brief Map inBytes of a new file named inPrefix and a unique suffix,
+  /// removed as soon as it is mapped. False on failure.
+  bool Create(rcString inPrefix, const Uint64 inBytes);
+
+  void *Data() { return mData; }
+  Uint64 Bytes() const { return mBytes; }
+
+private:
+  MappedFile(const MappedFile&);
+  MappedFile &operator=(const MappedFile&);
+
+  void *mData;
+  Uint64 mBytes;
+};
+
+#endif // MEMORYBUDGET_HDR
@@ -0,0 +1,173 @@
+#include "Metrics.hpp"
+
+#include "Json.hpp"
+
+#include <atomic>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sys/resource.h>
+
+#define MAX_COUNTERS 256
+
+namespace
+{
+  struct PhaseRecord
+  {
+    String name;
+    Uint64 wall;
+    Uint64 cpu;
+    Uint64 items;
+  };
+
+  std::mutex sMutex;
+  std::vector<String> sCounters;
+  std::map<String, int> sCounterIds;
+  std::atomic<Uint64> sValues[MAX_COUNTERS];
+  std::vector<PhaseRecord> sPhases;
+  const Uint64 sStart = Timer::Now();
+
+  bool EndsWith(rcString inString, rcString inSuffix)
+  {
+    return inString.size() >= inSuffix.size() &&
+           inString.compare(inString.size() - inSuffix.size(), inSuffix.size(), inSuffix) == 0;
+  }
+}
+
+Metrics::Phase::Phase(rcString inName, const Uint64 inItems):
+  mName(inName),
+  mItems(inItems),
+  mCpuStart(CpuTime()),
+  mTimer(inName),
+  mWallStart(Timer::Now())
+{
+}
+
+Metrics::Phase::~Phase()
+{
+  PhaseRecord record;
+  record.name  = mName;
+  record.wall  = Timer::Now() - mWallStart;
+  record.cpu   = CpuTime() - mCpuStart;
+  record.items = mItems;
+
+  std::lock_guard<std::mutex> lock(sMutex);
+  sPhases.push_back(record);
+}
+
+int Metrics::Intern(rcString inName)
+{
+  std::lock_guard<std::mutex> lock(sMutex);
+  std::map<String, int>::iterator i = sCounterIds.find(inName);
+
+  if (i != sCounterIds.end())
+    return i->second;
+
+  // Counters past the cap add up in the last slot, so neither an id nor the
+  // report goes past the values
+  if (int(sCounters.size()) >= MAX_COUNTERS - 1)
+  {
+    if (int(sCounters.size()) < MAX_COUNTERS)
+    {
+      sCounters.push_back("(other)");
+      sValues[MAX_COUNTERS - 1].store(0);
+    }
+
+    sCounterIds[inName] = MAX_COUNTERS - 1;
+    return MAX_COUNTERS - 1;
+  }
+
+  cInt id = sCounters.size();
+  sCounters.push_back(inName);
+  sCounterIds[inName] = id;
+  sValues[id].store(0);
+  return id;
+}
+
+void Metrics::Add(const int inId, const Uint64 inValue)
+{
+  sValues[inId].fetch_add(inValue, std::memory_order_relaxed);
+}
+
+Uint64 Metrics::Get(rcString inName)
+{
+  std::lock_guard<std::mutex> lock(sMutex);
+  std::map<String, int>::iterator i = sCounterIds.find(inName);
+  return i == sCounterIds.end() ? 0 : sValues[i->second].load();
+}
+
+Uint64 Metrics::PeakRss()
+{
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return Uint64(usage.ru_maxrss) * 1024; // Kilobytes on linux
+}
+
+Uint64 Metrics::CpuTime()
+{
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return Uint64(ts.tv_sec) * 1000000000ULL + Uint64(ts.tv_nsec);
+}
+
+bool Metrics::Write(rcString inFile)
+{
+  std::ofstream file(inFile.c_str(), std::ios::out);
+
+  if (!file.good())
+    return false;
+
+  std::lock_guard<std::mutex> lock(sMutex);
+  file.setf(std::ios::fixed);
+  file.precision(6);
+
+  file << "{\n"
+       << "  \"wall_s\": " << (Timer::Now() - sStart) * 1e-9 << ",\n"
+       << "  \"cpu_s\": " << CpuTime() * 1e-9 << ",\n"
+       << "  \"peak_rss_bytes\": " << PeakRss() << ",\n"
+       << "  \"phases\": [";
+
+  for (int i = 0, n = sPhases.size(); i < n; i++)
+  {
+    const PhaseRecord &p = sPhases[i];
+    file << (i == 0 ? "\n" : ",\n")
+         << "    {\"name\": \"" << JsonEscape(p.name) << "\""
+         << ", \"wall_s\": " << p.wall * 1e-9
+         << ", \"cpu_s\": " << p.cpu * 1e-9;
+
+    if (p.items > 0)
+      file << ", \"items\": " << p.items
+           << ", \"items_per_s\": " << (p.wall > 0 ? p.items / (p.wall * 1e-9) : 0.0);
+
+    file << "}";
+  }
+
+  file << "\n  ],\n  \"counters\": {";
+
+  for (int i = 0, n = sCounters.size(); i < n; i++)
+    file << (i == 0 ? "\n" : ",\n")
+         << "    \"" << JsonEscape(sCounters[i]) << "\": " << sValues[i].load();
+
+  file << "\n  },\n  \"hit_rates\": {";
+
+  bool first = true;
+  for (int i = 0, n = sCounters.size(); i < n; i++)
+  {
+    if (!EndsWith(sCounters[i], "-hits"))
+      continue;
+
+    cString cache = sCounters[i].substr(0, sCounters[i].size() - 5);
+    std::map<String, int>::iterator miss = sCounterIds.find(cache + "-misses");
+    const Uint64 hits = sValues[i].load();
+    const Uint64 misses = miss == sCounterIds.end() ? 0 : sValues[miss->second].load();
+
+    file << (first ? "\n" : ",\n")
+         << "    \"" << JsonEscape(cache) << "\": "
+         << (hits + misses > 0 ? hits / double(hits + misses) : 0.0);
+    first = false;
+  }
+
+  file << "\n  }\n}\n";
+  return file.good();
+}
@@ -0,0 +1,59 @@
+#ifndef METRICS_HDR
+#define METRICS_HDR
+
+#include "Timer.hpp"
+#include "Types.hpp"
+
+#define METRICS_CONCAT_(a, b) a##b
+#define METRICS_CONCAT(a, b) METRICS_CONCAT_(a, b)
+
+// Interns the counter once per call site, then it is a single atomic add
+#define METRIC_ADD(name, value)                                                     \
+  do {                                                                         \
+    static const int METRICS_CONCAT(___c, __LINE__) = Metrics::Intern(name);   \
+    Metrics::Add(METRICS_CONCAT(___c, __LINE__), value);                       \
+  } while (0)
+
+/// @brief Run metrics for batch schedulers, written as json
+///
+/// Phases measure wall and cpu time and optionally the number of items they
+/// processed. Counters are process wide and safe to bump from any thread.
+/// Counter pairs named `<cache>-hits' and `<cache>-misses' are reported as a
+/// hit rate as well.
+class Metrics
+{
+public:
+  /// @brief Scoped phase, also profiled and traced like PROFILE()
+  class Phase
+  {
+  public:
+    Phase(rcString inName, const Uint64 inItems = 0);
+    ~Phase();
+
+    void SetItems(const Uint64 inItems) { mItems = inItems; }
+
+  private:
+    String mName;
+    Uint64 mItems;
+    Uint64 mCpuStart;
+    Timer mTimer;
+    Uint64 mWallStart;
+  };
+
+  /// @brief Return the id of counter inName, registering it when new
+  static int Intern(rcString inName);
+  static void Add(const int inId, const Uint64 inValue);
+
+  /// @brief Current value of counter inName
+  static Uint64 Get(rcString inName);
+
+  /// @brief Peak resident set size in bytes
+  static Uint64 PeakRss();
+
+  /// @brief Process cpu time in nanoseconds
+  static Uint64 CpuTime();
+
+  static bool Write(rcString inFile);
+};
+
+#endif // METRICS_HDR
@@ -0,0 +1,129 @@
+#include "Prefetcher.hpp"
+
+#include "Debugger.hpp"
+#include "Metrics.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+Prefetcher::Prefetcher(cInt inThreads):
+  mCount(0),
+  mWindow(1),
+  mNext(0),
+  mTaken(0),
+  mLoading(0),
+  mStopped(false)
+{
+  for (int t = 0, n = std::max(inThreads, 1); t < n; t++)
+    mThreads.push_back(std::thread(&Prefetcher::Work, this));
+}
+
+Prefetcher::~Prefetcher()
+{
+  Finish();
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStopped = true;
+  }
+  mRoom.notify_all();
+
+  for (int t = 0, n = mThreads.size(); t < n; t++)
+    mThreads[t].join();
+}
+
+void Prefetcher::Start(
+  cInt inCount,
+  cInt inWindow,
+  const Loader &inLoad,
+  const Hint &inHint
+)
+{
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    ASSERT(mCount == 0 && mLoading == 0);
+    mCount = inCount;
+    mWindow = std::max(inWindow, 1);
+    mLoad = inLoad;
+    mHint = inHint;
+    mSlots.assign(mWindow, Slot());
+    mNext = 0;
+    mTaken = 0;
+  }
+  mRoom.notify_all();
+}
+
+void Prefetcher::Finish()
+{
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  // Nothing new is claimed once the count is gone
+  mCount = 0;
+  mReady.wait(lock, [&]() { return mLoading == 0; });
+  mSlots.clear();
+  mLoad = Loader();
+  mHint = Hint();
+}
+
+void Prefetcher::Take(cInt inItem, cv::Mat &out)
+{
+  ASSERT(inItem == mTaken && inItem < mCount);
+  std::unique_lock<std::mutex> lock(mMutex);
+  Slot &slot = mSlots[inItem % mWindow];
+
+  METRIC_ADD("prefetch-takes", 1);
+  METRIC_ADD("prefetch-queue-depth", mNext - mTaken);
+
+  if (slot.item != inItem)
+  {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    mReady.wait(lock, [&]() { return slot.item == inItem; });
+    METRIC_ADD("prefetch-stalls", 1);
+    METRIC_ADD("prefetch-stall-us", std::chrono::duration_cast<std::chrono::microseconds>(
+                 std::chrono::steady_clock::now() - start).count());
+  }
+
+  out = slot.value;
+  slot.value.release();
+  slot.item = -1;
+  mTaken++;
+  lock.unlock();
+  mRoom.notify_all();
+}
+
+void Prefetcher::Work()
+{
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  while (true)
+  {
+    // The slot of an item is free once the one a window before was taken
+    mRoom.wait(lock, [&]() { return mStopped || (mNext < mCount && mNext < mTaken + mWindow); });
+
+    if (mStopped)
+      return;
+
+    cInt item = mNext++;
+    cInt count = mCount;
+    mLoading++;
+    lock.unlock();
+
+    if (mHint && item + mWindow < count)
+      mHint(item + mWindow);
+
+    cv::Mat value;
+    mLoad(item, value);
+
+    lock.lock();
+    mLoading--;
+
+    // The sequence may have been finished meanwhile
+    if (mCount > 0)
+    {
+      mSlots[item % mWindow].value = value;
+      mSlots[item % mWindow].item = item;
+    }
+
+    mReady.notify_all();
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef PREFETCHER_HDR
+#define PREFETCHER_HDR
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <opencv/cv.h>
+#include "Types.hpp"
+
+/// @brief Loads a known sequence of items ahead of the one consuming them
+///
+/// A fixed pool of worker threads, started once and reused for every
+/// sequence, loads the items in order, at most a window ahead of the next
+/// item taken, so memory stays bounded however long the sequence is.
+/// The item a window further ahead is hinted when one is started, which lets
+/// the kernel read it while the window is being decoded. Takes count
+/// `prefetch-takes', the claimed items ahead of each as `prefetch-queue-depth'
+/// and the ones that had to wait as `prefetch-stalls' and `prefetch-stall-us'.
+class Prefetcher
+{
+public:
+  typedef std::function<void(cInt inItem, cv::Mat &out)> Loader;
+  typedef std::function<void(cInt inItem)> Hint;
+
+  /// @brief Const: starts inThreads idle workers
+  explicit Prefetcher(cInt inThreads);
+
+  ~Prefetcher();
+
+  /// @brief Load inCount items with inLoad, at most inWindow ahead of the
+  /// next one taken. The previous sequence must be finished.
+  void Start(
+    cInt inCount,
+    cInt inWindow,
+    const Loader &inLoad,
+    const Hint &inHint = Hint()
+  );
+
+  /// @brief Blocks until item inItem is loaded, items are taken in order
+  void Take(cInt inItem, cv::Mat &out);
+
+  /// @brief Drops the items not taken and waits for the loads in flight, the
+  /// loader isn't called anymore once this returns
+  void Finish();
+
+private:
+  struct Slot
+  {
+    Slot(): item(-1) {}
+
+    int item; ///< Loaded item, -1 while empty
+    cv::Mat value;
+  };
+
+  Prefetcher(const Prefetcher&);
+  Prefetcher &operator=(const Prefetcher&);
+
+  void Work();
+
+  int mCount; ///< Items of the current sequence, 0 while idle
+  int mWindow;
+  Loader mLoad;
+  Hint mHint;
+
+  std::mutex mMutex;
+  std::condition_variable mRoom; ///< An item was taken
+  std::condition_variable mReady; ///< An item was loaded, or a load ended
+  std::vector<Slot> mSlots; ///< Item i goes to slot i % mWindow
+  std::vector<std::thread> mThreads;
+  int mNext; ///< Next item to load
+  int mTaken; ///< Items taken so far
+  int mLoading; ///< Loads in flight
+  bool mStopped;
+};
+
+#endif // PREFETCHER_HDR
@@ -0,0 +1,122 @@
+#include "StageCache.hpp"
+
+#include "Hash.hpp"
+#include "Metrics.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <boost/filesystem.hpp>
+
+#define STAGE_MAGIC   "HEXSTAGE"
+#define STAGE_VERSION 1
+
+namespace
+{
+  template<typename T>
+  void WriteRaw(std::ofstream &inFile, const T &inValue)
+  {
+    inFile.write(reinterpret_cast<const char*>(&inValue), sizeof(T));
+  }
+
+  template<typename T>
+  bool ReadRaw(std::ifstream &inFile, T &outValue)
+  {
+    return bool(inFile.read(reinterpret_cast<char*>(&outValue), sizeof(T)));
+  }
+}
+
+void StageCache::SetDirectory(rcString inDirectory)
+{
+  mDirectory = inDirectory;
+
+  if (mDirectory.empty())
+    return;
+
+  if (mDirectory.at(mDirectory.size() - 1) != '/')
+    mDirectory += '/';
+
+  boost::system::error_code error;
+  boost::filesystem::create_directories(mDirectory, error);
+}
+
+String StageCache::Path(rcString inStage, const Uint64 inKey) const
+{
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(inKey));
+  return mDirectory + inStage + "-" + key;
+}
+
+bool StageCache::Load(rcString inStage, const Uint64 inKey, cv::Mat &out) const
+{
+  if (!IsEnabled())
+    return false;
+
+  std::ifstream file(Path(inStage, inKey).c_str(), std::ios::in | std::ios::binary);
+  char magic[sizeof(STAGE_MAGIC)] = {0};
+  Int32 version, rows, cols, type;
+  Uint64 key;
+
+  bool loaded =
+    file.read(magic, strlen(STAGE_MAGIC)) && strcmp(magic, STAGE_MAGIC) == 0 &&
+    ReadRaw(file, version) && version == STAGE_VERSION &&
+    ReadRaw(file, key) && key == inKey &&
+    ReadRaw(file, rows) && ReadRaw(file, cols) && ReadRaw(file, type) &&
+    rows >= 0 && cols >= 0;
+
+  if (loaded)
+  {
+    out.create(rows, cols, type);
+    loaded = out.total() == 0 ||
+             file.read(reinterpret_cast<char*>(out.data), out.total() * out.elemSize());
+  }
+
+  Metrics::Add(Metrics::Intern(inStage + (loaded ? "-cache-hits" : "-cache-misses")), 1);
+
+  if (!loaded)
+    return false;
+
+  Metrics::Add(Metrics::Intern("bytes-read"), out.total() * out.elemSize());
+  return true;
+}
+
+bool StageCache::Save(rcString inStage, const Uint64 inKey, const cv::Mat &in) const
+{
+  if (!IsEnabled() || !in.isContinuous())
+    return false;
+
+  // Written aside and renamed, so a reader never sees half an entry
+  cString path = Path(inStage, inKey);
+  cString temp = path + ".tmp";
+  {
+    std::ofstream file(temp.c_str(), std::ios::out | std::ios::binary);
+
+    if (!file.good())
+      return false;
+
+    file.write(STAGE_MAGIC, strlen(STAGE_MAGIC));
+    WriteRaw(file, Int32(STAGE_VERSION));
+    WriteRaw(file, inKey);
+    WriteRaw(file, Int32(in.rows));
+    WriteRaw(file, Int32(in.cols));
+    WriteRaw(file, Int32(in.type()));
+    file.write(reinterpret_cast<const char*>(in.data), in.total() * in.elemSize());
+
+    if (!file.good())
+      return false;
+  }
+
+  Metrics::Add(Metrics::Intern("bytes-written"), in.total() * in.elemSize());
+  return std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+Uint64 StageCache::Hash(const cv::Mat &in, const Uint64 inSeed)
+{
+  const Int32 header[3] = { in.rows, in.cols, in.type() };
+  Uint64 key = ::Hash(header, sizeof(header), inSeed);
+
+  for (int r = 0; r < in.rows; r++)
+    key = ::Hash(in.ptr(r), in.cols * in.elemSize(), key);
+
+  return key;
+}
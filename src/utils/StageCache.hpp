@@ -0,0 +1,37 @@
+#ifndef STAGECACHE_HDR
+#define STAGECACHE_HDR
+
+#include <opencv/cv.h>
+#include "Types.hpp"
+
+/// @brief Content addressed store of intermediate results
+///
+/// Every entry is a matrix stored under its stage name and a key hashed
+/// from everything it was computed from, so a changed input simply misses
+/// and never returns stale data. Without a directory nothing is stored.
+class StageCache
+{
+public:
+  StageCache() {}
+
+  /// @brief Entries go to inDirectory, empty disables the cache
+  void SetDirectory(rcString inDirectory);
+
+  bool IsEnabled() const { return !mDirectory.empty(); }
+
+  /// @brief Reads the entry of inStage under inKey, counts `<inStage>-cache' hits and misses
+  bool Load(rcString inStage, const Uint64 inKey, cv::Mat &out) const;
+
+  /// @brief Stores in as the entry of inStage under inKey, in must be continuous
+  bool Save(rcString inStage, const Uint64 inKey, const cv::Mat &in) const;
+
+  /// @brief Chains the size, type and contents of in into inSeed
+  static Uint64 Hash(const cv::Mat &in, const Uint64 inSeed);
+
+private:
+  String Path(rcString inStage, const Uint64 inKey) const;
+
+  String mDirectory;
+};
+
+#endif // STAGECACHE_HDR
@@ -0,0 +1,275 @@
+#include "TiffWriter.hpp"
+
+#include "Debugger.hpp"
+#include "Metrics.hpp"
+#include "Timer.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+#include <zlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif // _OPENMP
+
+// Uncompressed bytes per strip, large enough for deflate and the writes
+#define STRIP_BYTES (1 << 20)
+
+// Strips compressed at once per thread, bounds the buffered output
+#define STRIPS_PER_THREAD 4
+
+#define TIFF_SHORT 3
+#define TIFF_LONG  4
+#define TIFF_LONG8 16
+
+namespace
+{
+  /// @brief Little endian TIFF or BigTIFF structures, offsets are 4 or 8 bytes
+  class Encoder
+  {
+  public:
+    Encoder(std::ofstream &ioFile, const bool inBig): mFile(ioFile), mBig(inBig) {}
+
+    void Short(const Uint16 inValue) { Raw(&inValue, sizeof(inValue)); }
+    void Long(const Uint32 inValue) { Raw(&inValue, sizeof(inValue)); }
+    void Long8(const Uint64 inValue) { Raw(&inValue, sizeof(inValue)); }
+
+    void Offset(const Uint64 inValue)
+    {
+      if (mBig)
+        Long8(inValue);
+      else
+        Long(Uint32(inValue));
+    }
+
+    /// @brief Directory entry holding a single value or the offset of its values
+    void Entry(const Uint16 inTag, const Uint16 inType, const Uint64 inCount, const Uint64 inValue)
+    {
+      Short(inTag);
+      Short(inType);
+      Offset(inCount);
+
+      // Single shorts are left aligned in the value field
+      if (inType == TIFF_SHORT && inCount == 1)
+      {
+        Short(Uint16(inValue));
+        Short(0);
+
+        if (mBig)
+          Long(0);
+      }
+      else
+        Offset(inValue);
+    }
+
+    void Raw(const void *inData, const size_t inBytes)
+    {
+      mFile.write(static_cast<const char*>(inData), inBytes);
+    }
+
+    int OffsetSize() const { return mBig ? 8 : 4; }
+
+  private:
+    std::ofstream &mFile;
+    bool mBig;
+  };
+
+  /// @brief Rows [inBegin, inEnd) as RGB samples, differenced left to right
+  /// when inPredict so that deflate sees the smooth gradients as runs
+  void PackStrip(const cv::Mat &inImage, cInt inBegin, cInt inEnd, const bool inPredict, std::vector<Uint8> &out)
+  {
+    cInt channels = inImage.channels();
+    cInt row_bytes = inImage.cols * channels;
+    out.resize(Uint64(inEnd - inBegin) * row_bytes);
+
+    for (int y = inBegin; y < inEnd; y++)
+    {
+      const Uint8 *src = inImage.ptr<Uint8>(y);
+      Uint8 *dst = &out[Uint64(y - inBegin) * row_bytes];
+
+      if (channels == 3)
+      {
+        for (int x = 0; x < row_bytes; x += 3)
+        {
+          dst[x + 0] = src[x + 2];
+          dst[x + 1] = src[x + 1];
+          dst[x + 2] = src[x + 0];
+        }
+      }
+      else
+        std::copy(src, src + row_bytes, dst);
+
+      if (inPredict)
+        for (int x = row_bytes - 1; x >= channels; x--)
+          dst[x] -= dst[x - channels];
+    }
+  }
+}
+
+bool TiffWriter::Write(rcString inFile, const cv::Mat &inImage, cInt inLevel)
+{
+  ASSERT(inImage.depth() == CV_8U && (inImage.channels() == 3 || inImage.channels() == 1));
+  ASSERT(inLevel >= 0 && inLevel <= 9);
+
+  std::ofstream file(inFile.c_str(), std::ios::out | std::ios::binary);
+
+  if (!file.good())
+    return false;
+
+  cInt channels = inImage.channels();
+  const Uint64 row_bytes = Uint64(inImage.cols) * channels;
+  cInt strip_rows = std::max<int>(1, std::min<Uint64>(inImage.rows, STRIP_BYTES / row_bytes));
+  cInt n_strips = (inImage.rows + strip_rows - 1) / strip_rows;
+  const bool compress = inLevel > 0;
+
+  // Deflate may grow incompressible strips a little, so BigTIFF is chosen
+  // on the uncompressed size plus the worst case overhead
+  const Uint64 raw_bytes = row_bytes * inImage.rows;
+  const bool big = raw_bytes + raw_bytes / 1000 + Uint64(n_strips) * 64 + 4096 >= (Uint64(1) << 32);
+  Encoder out(file, big);
+
+  // Header, the directory offset is patched once the strips are written
+  Uint64 position;
+  out.Short(0x4949);
+
+  if (big)
+  {
+    out.Short(43);
+    out.Short(8);
+    out.Short(0);
+    out.Long8(0);
+    position = 16;
+  }
+  else
+  {
+    out.Short(42);
+    out.Long(0);
+    position = 8;
+  }
+
+  std::vector<Uint64> offsets(n_strips), counts(n_strips);
+  Uint64 raw_total = 0;
+
+#ifdef _OPENMP
+  cInt batch = STRIPS_PER_THREAD * omp_get_max_threads();
+#else
+  cInt batch = STRIPS_PER_THREAD;
+#endif // _OPENMP
+  std::vector<std::vector<Uint8> > strips(std::min(batch, n_strips));
+  bool failed = false;
+
+  for (int first = 0; first < n_strips && !failed; first += batch)
+  {
+    cInt last = std::min(first + batch, n_strips);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int s = first; s < last; s++)
+    {
+      PROFILE("compress-strip");
+      std::vector<Uint8> &strip = strips[s - first];
+      std::vector<Uint8> packed;
+      cInt begin = s * strip_rows;
+      cInt end = std::min(begin + strip_rows, inImage.rows);
+
+      if (!compress)
+      {
+        PackStrip(inImage, begin, end, false, strip);
+        continue;
+      }
+
+      PackStrip(inImage, begin, end, true, packed);
+      uLongf bytes = compressBound(packed.size());
+      strip.resize(bytes);
+
+      if (compress2(&strip[0], &bytes, &packed[0], packed.size(), inLevel) != Z_OK)
+      {
+        #pragma omp critical
+        failed = true;
+      }
+
+      strip.resize(bytes);
+    }
+
+    // In order and one write per strip
+    for (int s = first; s < last; s++)
+    {
+      const std::vector<Uint8> &strip = strips[s - first];
+      offsets[s] = position;
+      counts[s] = strip.size();
+      out.Raw(&strip[0], strip.size());
+      position += strip.size();
+      raw_total += Uint64(std::min(strip_rows, inImage.rows - s * strip_rows)) * row_bytes;
+    }
+  }
+
+  if (failed)
+    return false;
+
+  // Arrays the directory points to, word aligned
+  if (position % 2 != 0)
+  {
+    out.Raw("", 1);
+    position++;
+  }
+
+  const Uint64 bits_offset = position;
+  for (int c = 0; c < channels; c++)
+    out.Short(8);
+  position += channels * sizeof(Uint16);
+
+  const Uint64 offsets_offset = position;
+  for (int s = 0; s < n_strips; s++)
+    out.Offset(offsets[s]);
+  position += Uint64(n_strips) * out.OffsetSize();
+
+  const Uint64 counts_offset = position;
+  for (int s = 0; s < n_strips; s++)
+    out.Offset(counts[s]);
+  position += Uint64(n_strips) * out.OffsetSize();
+
+  // Directory, entries sorted by tag
+  const Uint64 directory = position;
+  const Uint16 strip_type = big ? TIFF_LONG8 : TIFF_LONG;
+  const int n_entries = compress ? 11 : 10;
+
+  if (big)
+    out.Long8(n_entries);
+  else
+    out.Short(n_entries);
+
+  out.Entry(256, TIFF_LONG, 1, inImage.cols);
+  out.Entry(257, TIFF_LONG, 1, inImage.rows);
+  // BigTIFF keeps up to 8 bytes of values in the entry itself
+  if (channels == 3 && big)
+  {
+    out.Short(258);
+    out.Short(TIFF_SHORT);
+    out.Long8(3);
+    out.Short(8);
+    out.Short(8);
+    out.Short(8);
+    out.Short(0);
+  }
+  else
+    out.Entry(258, TIFF_SHORT, channels, channels == 1 ? 8 : bits_offset);
+  out.Entry(259, TIFF_SHORT, 1, compress ? 8 : 1);
+  out.Entry(262, TIFF_SHORT, 1, channels == 3 ? 2 : 1);
+  out.Entry(273, strip_type, n_strips, n_strips == 1 ? offsets[0] : offsets_offset);
+  out.Entry(277, TIFF_SHORT, 1, channels);
+  out.Entry(278, TIFF_LONG, 1, strip_rows);
+  out.Entry(279, strip_type, n_strips, n_strips == 1 ? counts[0] : counts_offset);
+  out.Entry(284, TIFF_SHORT, 1, 1);
+
+  if (compress)
+    out.Entry(317, TIFF_SHORT, 1, 2);
+
+  out.Offset(0);
+
+  file.seekp(big ? 8 : 4);
+  out.Offset(directory);
+
+  METRIC_ADD("tiff-strips", n_strips);
+  METRIC_ADD("tiff-raw-bytes", raw_total);
+  return file.good();
+}
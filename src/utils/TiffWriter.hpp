@@ -0,0 +1,20 @@
+#ifndef TIFFWRITER_HDR
+#define TIFFWRITER_HDR
+
+#include <opencv/cv.h>
+#include "Types.hpp"
+
+/// @brief Writes 8 bit images as strip TIFFs, compressing strips in parallel
+///
+/// Strips of about a megabyte are deflate compressed with a horizontal
+/// predictor by all threads at once and written in order, one write per
+/// strip. Files that may exceed 4 GB are written as BigTIFF.
+class TiffWriter
+{
+public:
+  /// @brief Write a BGR or gray inImage, inLevel in [0, 9] where 0 stores
+  /// the strips uncompressed
+  static bool Write(rcString inFile, const cv::Mat &inImage, cInt inLevel);
+};
+
+#endif // TIFFWRITER_HDR
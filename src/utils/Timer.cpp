@@ -1,95 +1,290 @@
 #include "Timer.hpp"
 
-#ifdef ENABLE_PROFILING
-
+#include "Trace.hpp"
 #include "Verbose.hpp"
 
 #include <algorithm>
-#include <sstream>
-#include <iostream>
+#include <atomic>
+#include <cmath>
 #include <iomanip>
 #include <limits>
-#include <unistd.h>
+#include <map>
+#include <mutex>
+#include <sstream>
 
-std::vector<String>      Timer::sTasks;
-std::map<String, Uint32> Timer::sTaskCounters;
-std::map<String, double> Timer::sSumTimings;
-std::map<String, double> Timer::sMinTimings;
-std::map<String, double> Timer::sMaxTimings;
+#define MAX_TASKS         256
+#define BUCKET_SUB_BITS   2
+#define BUCKETS_PER_OCTAVE (1 << BUCKET_SUB_BITS)
+#define OCTAVES           48
+#define BUCKETS           (OCTAVES * BUCKETS_PER_OCTAVE)
 
-Timer::Timer(rcString inName):
-  mIsInitialized(true),
-  mTaskName(inName)
+namespace
 {
-  if (std::find(sTasks.begin(), sTasks.end(), inName) == sTasks.end())
+  /// Written by the owning thread only, so relaxed loads and stores suffice
+  struct TaskStats
+  {
+    std::atomic<Uint64> count;
+    std::atomic<Uint64> sum;
+    std::atomic<Uint64> min;
+    std::atomic<Uint64> max;
+    std::atomic<Uint32> histogram[BUCKETS];
+  };
+
+  struct ThreadStats
+  {
+    ThreadStats()
+    {
+      for (int i = 0; i < MAX_TASKS; i++)
+      {
+        tasks[i].count.store(0, std::memory_order_relaxed);
+        tasks[i].sum.store(0, std::memory_order_relaxed);
+        tasks[i].min.store(std::numeric_limits<Uint64>::max(), std::memory_order_relaxed);
+        tasks[i].max.store(0, std::memory_order_relaxed);
+
+        for (int b = 0; b < BUCKETS; b++)
+          tasks[i].histogram[b].store(0, std::memory_order_relaxed);
+      }
+    }
+
+    TaskStats tasks[MAX_TASKS];
+  };
+
+  std::mutex sMutex;
+  std::vector<String> sTasks;
+  std::map<String, int> sTaskIds;
+  std::vector<ThreadStats*> sThreads; // Running threads and the retired total
+  ThreadStats *sRetired = NULL; // Sum of the threads that have exited
+
+  /// Folds a thread's stats into the retired total when it exits, so the
+  /// memory follows the number of running threads and not of all of them
+  struct LocalOwner
+  {
+    LocalOwner(): stats(NULL) {}
+
+    ~LocalOwner()
+    {
+      if (stats == NULL)
+        return;
+
+      std::lock_guard<std::mutex> lock(sMutex);
+      const std::memory_order relaxed = std::memory_order_relaxed;
+
+      if (sRetired == NULL)
+      {
+        sRetired = new ThreadStats();
+        sThreads.push_back(sRetired);
+      }
+
+      for (int i = 0, n = sTasks.size(); i < n; i++)
+      {
+        const TaskStats &from = stats->tasks[i];
+        TaskStats &to = sRetired->tasks[i];
+
+        if (from.count.load(relaxed) == 0)
+          continue;
+
+        to.count.store(to.count.load(relaxed) + from.count.load(relaxed), relaxed);
+        to.sum.store(to.sum.load(relaxed) + from.sum.load(relaxed), relaxed);
+        to.min.store(std::min(to.min.load(relaxed), from.min.load(relaxed)), relaxed);
+        to.max.store(std::max(to.max.load(relaxed), from.max.load(relaxed)), relaxed);
+
+        for (int b = 0; b < BUCKETS; b++)
+          to.histogram[b].store(to.histogram[b].load(relaxed) + from.histogram[b].load(relaxed), relaxed);
+      }
+
+      sThreads.erase(std::find(sThreads.begin(), sThreads.end(), stats));
+      delete stats;
+    }
+
+    ThreadStats *stats;
+  };
+
+  ThreadStats *LocalStats()
+  {
+    static thread_local LocalOwner owner;
+
+    if (owner.stats == NULL)
+    {
+      owner.stats = new ThreadStats();
+      std::lock_guard<std::mutex> lock(sMutex);
+      sThreads.push_back(owner.stats);
+    }
+
+    return owner.stats;
+  }
+
+  /// Log scale bucket with BUCKETS_PER_OCTAVE linear steps per power of two
+  int Bucket(const Uint64 inNanoSeconds)
+  {
+    if (inNanoSeconds < BUCKETS_PER_OCTAVE)
+      return int(inNanoSeconds);
+
+    cInt octave = 63 - __builtin_clzll(inNanoSeconds);
+    cInt sub = int((inNanoSeconds >> (octave - BUCKET_SUB_BITS)) & (BUCKETS_PER_OCTAVE - 1));
+    cInt bucket = (octave - BUCKET_SUB_BITS + 1) * BUCKETS_PER_OCTAVE + sub;
+    return std::min<int>(bucket, BUCKETS - 1);
+  }
+
+  /// Upper bound in nanoseconds of a bucket
+  double BucketLimit(cInt inBucket)
+  {
+    if (inBucket < BUCKETS_PER_OCTAVE)
+      return inBucket + 1;
+
+    cInt octave = inBucket / BUCKETS_PER_OCTAVE + BUCKET_SUB_BITS - 1;
+    cInt sub = inBucket % BUCKETS_PER_OCTAVE;
+    return double(1ULL << octave) * (1.0 + (sub + 1) / double(BUCKETS_PER_OCTAVE));
+  }
+
+  double Percentile(const std::vector<Uint64> &inHistogram, const Uint64 inCount, cDouble inP)
+  {
+    const Uint64 rank = Uint64(ceil(inP * inCount));
+    Uint64 seen = 0;
+
+    for (int b = 0; b < BUCKETS; b++)
+    {
+      seen += inHistogram[b];
+
+      if (seen >= rank && seen > 0)
+        return BucketLimit(b);
+    }
+
+    return 0.0;
+  }
+
+  String Format(cDouble inValue, int inPrecision)
   {
-    sTasks.push_back(inName);
-    sTaskCounters[inName] = 0;
-    sSumTimings[inName]   = 0.0;
-    sMaxTimings[inName]   = 0.0;
-    sMinTimings[inName]   = std::numeric_limits<double>::max();
+    std::stringstream s;
+    s << std::setiosflags(std::ios::fixed)
+      << std::setprecision(inPrecision)
+      << inValue;
+    return s.str();
   }
+}
+
+Timer::Timer(const int inId):
+  mId(inId),
+  mStartTime(Now())
+{
+}
 
-  mStartTime = getRealTime();
+Timer::Timer(rcString inName):
+  mId(Intern(inName)),
+  mStartTime(Now())
+{
 }
 
 Timer::~Timer()
 {
-  mEndTime = getRealTime();
+  const Uint64 end_time = Now();
+  Record(mId, end_time - mStartTime);
+
+  if (Trace::IsEnabled())
+    Trace::Record(mId, mStartTime, end_time);
+}
+
+int Timer::Intern(rcString inName)
+{
+  std::lock_guard<std::mutex> lock(sMutex);
+  std::map<String, int>::iterator i = sTaskIds.find(inName);
+
+  if (i != sTaskIds.end())
+    return i->second;
+
+  // Tasks past the cap share the last slot, so no id or report line goes
+  // past the per thread stats
+  if (int(sTasks.size()) >= MAX_TASKS - 1)
+  {
+    if (int(sTasks.size()) < MAX_TASKS)
+      sTasks.push_back("(other)");
+
+    sTaskIds[inName] = MAX_TASKS - 1;
+    return MAX_TASKS - 1;
+  }
+
+  cInt id = sTasks.size();
+  sTasks.push_back(inName);
+  sTaskIds[inName] = id;
+  return id;
+}
+
+String Timer::TaskName(const int inId)
+{
+  std::lock_guard<std::mutex> lock(sMutex);
+  return inId >= 0 && inId < int(sTasks.size()) ? sTasks[inId] : String("?");
+}
+
+void Timer::Record(const int inId, const Uint64 inNanoSeconds)
+{
+  TaskStats &task = LocalStats()->tasks[inId];
+  const std::memory_order relaxed = std::memory_order_relaxed;
 
-  if (!mIsInitialized)
-    return;
+  task.count.store(task.count.load(relaxed) + 1, relaxed);
+  task.sum.store(task.sum.load(relaxed) + inNanoSeconds, relaxed);
 
-  sTaskCounters[mTaskName]++;
-  double diff_time = (mEndTime - mStartTime);
-  sSumTimings[mTaskName] += diff_time;
-  sMinTimings[mTaskName] = std::min<double>(sMinTimings[mTaskName], diff_time);
-  sMaxTimings[mTaskName] = std::max<double>(sMaxTimings[mTaskName], diff_time);
+  if (inNanoSeconds < task.min.load(relaxed))
+    task.min.store(inNanoSeconds, relaxed);
+
+  if (inNanoSeconds > task.max.load(relaxed))
+    task.max.store(inNanoSeconds, relaxed);
+
+  std::atomic<Uint32> &bucket = task.histogram[Bucket(inNanoSeconds)];
+  bucket.store(bucket.load(relaxed) + 1, relaxed);
 }
 
 String Timer::GetReport(int inPrecision)
 {
+  std::lock_guard<std::mutex> lock(sMutex);
+  const std::memory_order relaxed = std::memory_order_relaxed;
+
   std::string report;
   report += SpacePadding("Name",  NAME_SPACING);
   report += SpacePadding("Min",   CELL_SPACING);
   report += SpacePadding("Max",   CELL_SPACING);
   report += SpacePadding("Avg",   CELL_SPACING);
+  report += SpacePadding("P50",   CELL_SPACING);
+  report += SpacePadding("P99",   CELL_SPACING);
   report += SpacePadding("Sum",   CELL_SPACING);
   report += SpacePadding("Calls", CELL_SPACING);
   report = Verbose::Colorize(report, Verbose::WHITE, Verbose::BOLD) + "\n\n";
 
+  int line = 0;
+
   for (int i = 0, n = sTasks.size(); i < n; i++)
   {
-    std::stringstream line;
+    Uint64 count = 0, sum = 0, min = std::numeric_limits<Uint64>::max(), max = 0;
+    std::vector<Uint64> histogram(BUCKETS, 0);
+
+    for (int t = 0, n_threads = sThreads.size(); t < n_threads; t++)
+    {
+      const TaskStats &task = sThreads[t]->tasks[i];
+      count += task.count.load(relaxed);
+      sum += task.sum.load(relaxed);
+      min = std::min<Uint64>(min, task.min.load(relaxed));
+      max = std::max<Uint64>(max, task.max.load(relaxed));
+
+      for (int b = 0; b < BUCKETS; b++)
+        histogram[b] += task.histogram[b].load(relaxed);
+    }
+
+    if (count == 0)
+      continue;
+
     String padded_line = SpacePadding(sTasks[i], NAME_SPACING);
-    line << std::setiosflags(std::ios::fixed)
-         << std::setprecision(inPrecision)
-         << sMinTimings[sTasks[i]];
-    padded_line += SpacePadding(line.str(), CELL_SPACING);
-    line.str("");
-    line << std::setiosflags(std::ios::fixed)
-         << std::setprecision(inPrecision)
-         << sMaxTimings[sTasks[i]];
-    padded_line += SpacePadding(line.str(), CELL_SPACING);
-    line.str("");
-    line << std::setiosflags(std::ios::fixed)
-         << std::setprecision(inPrecision)
-         << (sSumTimings[sTasks[i]] / sTaskCounters[sTasks[i]]);
-    padded_line += SpacePadding(line.str(), CELL_SPACING);
-    line.str("");
-    line << std::setiosflags(std::ios::fixed)
-         << std::setprecision(inPrecision)
-         << sSumTimings[sTasks[i]];
-    padded_line += SpacePadding(line.str(), CELL_SPACING);
-    line.str("");
-    line << sTaskCounters[sTasks[i]];
-    padded_line += SpacePadding(line.str(), CELL_SPACING);
-    line.str("");
-    Verbose::Color color = (i % 2) == 0 ? Verbose::WHITE : Verbose::CYAN;
+    padded_line += SpacePadding(Format(min * 1e-9, inPrecision), CELL_SPACING);
+    padded_line += SpacePadding(Format(max * 1e-9, inPrecision), CELL_SPACING);
+    padded_line += SpacePadding(Format(sum * 1e-9 / count, inPrecision), CELL_SPACING);
+    padded_line += SpacePadding(Format(std::min<double>(Percentile(histogram, count, 0.50), max) * 1e-9, inPrecision), CELL_SPACING);
+    padded_line += SpacePadding(Format(std::min<double>(Percentile(histogram, count, 0.99), max) * 1e-9, inPrecision), CELL_SPACING);
+    padded_line += SpacePadding(Format(sum * 1e-9, inPrecision), CELL_SPACING);
+    std::stringstream calls;
+    calls << count;
+    padded_line += SpacePadding(calls.str(), CELL_SPACING);
+    Verbose::Color color = (line++ % 2) == 0 ? Verbose::WHITE : Verbose::CYAN;
     report += Verbose::Colorize(padded_line, color) + "\n";
   }
 
-  report += Verbose::Colorize("\nTimings are in seconds...\n", Verbose::YELLOW);
+  report += Verbose::Colorize("\nTimings are in seconds, percentiles are bucket upper bounds...\n", Verbose::YELLOW);
   return report;
 }
 
@@ -106,5 +301,3 @@ String Timer::SpacePadding(rcString inString, int inSpaces)
 
   return padded;
 }
-
-#endif // ENABLE_PROFILING
@@ -3,62 +3,58 @@
 
 #include "Types.hpp"
 
-#include <map>
 #include <ctime>
 
-#define PROFILE_FUNCTION() PROFILE(__PRETTY_FUNCTION__)
+#define TIMER_CONCAT_(a, b) a##b
+#define TIMER_CONCAT(a, b) TIMER_CONCAT_(a, b)
 
-#ifdef ENABLE_PROFILING
-#define PROFILE(name) Timer ___t(name)
+// The call site id is interned once, after that a scope costs two clock reads
+#define PROFILE(name)                                                       \
+  static const int TIMER_CONCAT(___id, __LINE__) = Timer::Intern(name);     \
+  Timer TIMER_CONCAT(___t, __LINE__)(TIMER_CONCAT(___id, __LINE__))
 
-#define NAME_SPACING 50
-#define CELL_SPACING 8
+#define PROFILE_FUNCTION() PROFILE(__PRETTY_FUNCTION__)
 
+#define NAME_SPACING 50
+#define CELL_SPACING 10
+
+/// @brief Scoped profiler with per thread statistics
+///
+/// Every thread owns its counters, so timers can be used from OpenMP regions
+/// without locking. Per task it keeps the call count, sum, min, max and a
+/// logarithmic latency histogram from which GetReport() derives p50 and p99.
+/// While a Trace is enabled every scope is also recorded as a span.
 class Timer
 {
-
 public:
+  Timer(const int inId);
   Timer(rcString inName);
   ~Timer();
 
-  static String GetReport(int inPrecision = 4);
-  static String SpacePadding(rcString inString, int inSpaces);
+  /// @brief Return the id of task inName, registering it when new
+  static int Intern(rcString inName);
 
-private:
-  static std::vector<String> sTasks;
-  static std::map<String, Uint32> sTaskCounters;
-  static std::map<String, double> sSumTimings;
-  static std::map<String, double> sMinTimings;
-  static std::map<String, double> sMaxTimings;
-
-  inline double getRealTime() const
-  {
-    timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    return double(ts.tv_sec) + 1e-9 * double(ts.tv_nsec);
-  }
+  /// @brief Name of task inId
+  static String TaskName(const int inId);
 
-  inline double getCpuTime() const
+  /// @brief Nanoseconds on the monotonic clock
+  static Uint64 Now()
   {
     timespec ts;
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
-    return double(ts.tv_sec) + 1e-9 * double(ts.tv_nsec);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return Uint64(ts.tv_sec) * 1000000000ULL + Uint64(ts.tv_nsec);
   }
 
-  bool mIsInitialized;
-  double mStartTime;
-  double mEndTime;
-  cString mTaskName;
-};
+  /// @brief Record a measurement for task inId on the calling thread
+  static void Record(const int inId, const Uint64 inNanoSeconds);
 
-#else
-#define PROFILE(name)
-class Timer
-{
+  /// @brief Merged statistics of all threads, as a table
+  static String GetReport(int inPrecision = 4);
+  static String SpacePadding(rcString inString, int inSpaces);
 
-public:
-  static String GetReport(int inPrecision = 4) {(void) inPrecision; return "";}
+private:
+  int mId;
+  Uint64 mStartTime;
 };
-#endif
 
 #endif
@@ -0,0 +1,151 @@
+#include "Trace.hpp"
+
+#include "Json.hpp"
+#include "Timer.hpp"
+#include "Verbose.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+
+#define MAX_EVENTS (1 << 23) // Spans of all threads together
+
+namespace
+{
+  struct Event
+  {
+    int id;
+    int tid;
+    Uint64 start;
+    Uint64 end;
+  };
+
+  struct ThreadTrace
+  {
+    int tid;
+    Uint64 dropped;
+    std::vector<Event> events;
+  };
+
+  std::atomic<bool> sEnabled(false);
+  std::atomic<Uint64> sEvents(0);
+  Uint64 sOrigin = 0;
+  std::mutex sMutex;
+  std::vector<ThreadTrace*> sThreads; // Running threads
+  std::vector<Event> sRetired; // Spans of the threads that have exited
+  Uint64 sRetiredDropped = 0;
+  int sNextTid = 0;
+
+  /// Moves a thread's spans into the shared list when it exits and frees
+  /// its buffer
+  struct LocalOwner
+  {
+    LocalOwner(): trace(NULL) {}
+
+    ~LocalOwner()
+    {
+      if (trace == NULL)
+        return;
+
+      std::lock_guard<std::mutex> lock(sMutex);
+      sRetired.insert(sRetired.end(), trace->events.begin(), trace->events.end());
+      sRetiredDropped += trace->dropped;
+      sThreads.erase(std::find(sThreads.begin(), sThreads.end(), trace));
+      delete trace;
+    }
+
+    ThreadTrace *trace;
+  };
+
+  ThreadTrace *LocalTrace()
+  {
+    static thread_local LocalOwner owner;
+
+    if (owner.trace == NULL)
+    {
+      owner.trace = new ThreadTrace();
+      owner.trace->dropped = 0;
+      std::lock_guard<std::mutex> lock(sMutex);
+      owner.trace->tid = sNextTid++;
+      sThreads.push_back(owner.trace);
+    }
+
+    return owner.trace;
+  }
+
+  void WriteEvent(std::ofstream &ioFile, const Event &inEvent)
+  {
+    const Uint64 start = inEvent.start > sOrigin ? inEvent.start - sOrigin : 0;
+
+    ioFile << ",\n{\"name\":\"" << JsonEscape(Timer::TaskName(inEvent.id))
+           << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << inEvent.tid
+           << ",\"ts\":" << start * 1e-3
+           << ",\"dur\":" << (inEvent.end - inEvent.start) * 1e-3 << "}";
+  }
+}
+
+void Trace::Enable()
+{
+  sOrigin = Timer::Now();
+  sEnabled.store(true);
+}
+
+bool Trace::IsEnabled()
+{
+  return sEnabled.load(std::memory_order_relaxed);
+}
+
+void Trace::Record(const int inId, const Uint64 inStart, const Uint64 inEnd)
+{
+  ThreadTrace *trace = LocalTrace();
+
+  if (sEvents.fetch_add(1, std::memory_order_relaxed) >= MAX_EVENTS)
+  {
+    trace->dropped++;
+    return;
+  }
+
+  Event e = { inId, trace->tid, inStart, inEnd };
+  trace->events.push_back(e);
+}
+
+bool Trace::Write(rcString inFile)
+{
+  std::ofstream file(inFile.c_str(), std::ios::out);
+
+  if (!file.good())
+    return false;
+
+  std::lock_guard<std::mutex> lock(sMutex);
+  Uint64 dropped = sRetiredDropped;
+
+  file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  file.setf(std::ios::fixed);
+  file.precision(3);
+
+  // Every thread that ever recorded keeps its own track
+  for (int t = 0; t < sNextTid; t++)
+    file << (t == 0 ? "" : ",\n")
+         << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t
+         << ",\"args\":{\"name\":\"thread " << t << "\"}}";
+
+  for (int i = 0, n = sRetired.size(); i < n; i++)
+    WriteEvent(file, sRetired[i]);
+
+  for (int t = 0, n = sThreads.size(); t < n; t++)
+  {
+    const ThreadTrace *trace = sThreads[t];
+    dropped += trace->dropped;
+
+    for (int i = 0, n_events = trace->events.size(); i < n_events; i++)
+      WriteEvent(file, trace->events[i]);
+  }
+
+  file << "\n]}\n";
+
+  if (dropped > 0)
+    WarningLine("Trace dropped " << dropped << " spans, the buffers are full");
+
+  return file.good();
+}
@@ -0,0 +1,26 @@
+#ifndef TRACE_HDR
+#define TRACE_HDR
+
+#include "Types.hpp"
+
+/// @brief Timeline of PROFILE() scopes in the Chrome trace event format
+///
+/// When enabled every Timer also stores a span in a buffer owned by its
+/// thread, moved to a shared list when the thread exits. Write() emits them
+/// as complete events with one track per thread, which chrome://tracing and
+/// Perfetto can load directly.
+class Trace
+{
+public:
+  /// @brief Start recording spans, timestamps are relative to this call
+  static void Enable();
+  static bool IsEnabled();
+
+  /// @brief Store a span of task inId on the calling thread
+  static void Record(const int inId, const Uint64 inStart, const Uint64 inEnd);
+
+  /// @brief Write all spans as json, call when no thread is recording
+  static bool Write(rcString inFile);
+};
+
+#endif // TRACE_HDR
@@ -1,7 +1,78 @@
 #include "Verbose.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#define RING_SIZE          1024 // Records per thread, power of two
+#define MAX_LOG_THREADS    256
+#define DRAIN_INTERVAL_MS  2
+#define PROGRESS_INTERVAL  1000000000ull // ns between two progress lines
+
+namespace
+{
+  struct Record
+  {
+    Uint64 seq;
+    Verbose::Level level;
+    bool startsLine; ///< False when it continues the thread's last record
+    String msg;
+  };
+
+  /// Single producer (the owning thread), single consumer (whoever holds
+  /// sDrainMutex), so pushing a record never takes a lock
+  struct Ring
+  {
+    Ring(): head(0), tail(0), registered(false) {}
+
+    Record records[RING_SIZE];
+    std::atomic<Uint32> head; ///< Next slot written by the producer
+    std::atomic<Uint32> tail; ///< Next slot read by the consumer
+    bool registered; ///< False past MAX_LOG_THREADS, such threads write directly
+
+    String line; ///< Unfinished line, already queued, producer only
+  };
+
+  std::atomic<Uint64> sSequence(0);
+  std::atomic<int> sRingCount(0);
+  std::atomic<Ring*> sRings[MAX_LOG_THREADS];
+
+  std::atomic<bool> sRunning(false);
+  std::atomic<bool> sForked(false);
+  std::mutex sDrainMutex;
+  std::thread sWriter;
+
+  Ring *LocalRing()
+  {
+    static thread_local Ring *ring = NULL;
+
+    if (ring == NULL)
+    {
+      // Rings outlive their threads, the writer empties them later on
+      ring = new Ring();
+      cInt slot = sRingCount.fetch_add(1);
+
+      if (slot < MAX_LOG_THREADS)
+      {
+        ring->registered = true;
+        sRings[slot].store(ring, std::memory_order_release);
+      }
+    }
+
+    return ring;
+  }
+
+  Uint64 Now()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+}
 
 std::map<Verbose::Level, String> Verbose::sLevels;
 std::ofstream                    Verbose::sStream;
@@ -20,8 +91,80 @@ Uint32 Verbose::sOutput = SCREEN | LOG;
 Uint32 Verbose::sOutput = SCREEN;
 #endif
 
-Verbose::Verbose():
-  mIsStartOfLine(true)
+/// @brief Hand every queued record to Write in sequence order, returns the
+/// number of records written
+static int Drain()
+{
+  std::lock_guard<std::mutex> lock(sDrainMutex);
+  std::vector<Record> batch;
+  cInt n_rings = std::min<int>(sRingCount.load(), MAX_LOG_THREADS);
+
+  for (int r = 0; r < n_rings; r++)
+  {
+    Ring *ring = sRings[r].load(std::memory_order_acquire);
+
+    if (ring == NULL)
+      continue;
+
+    Uint32 tail = ring->tail.load(std::memory_order_relaxed);
+    const Uint32 head = ring->head.load(std::memory_order_acquire);
+
+    for (; tail != head; tail++)
+    {
+      Record &record = ring->records[tail % RING_SIZE];
+      batch.push_back(Record());
+      batch.back().seq = record.seq;
+      batch.back().level = record.level;
+      batch.back().startsLine = record.startsLine;
+      batch.back().msg.swap(record.msg);
+    }
+
+    ring->tail.store(tail, std::memory_order_release);
+  }
+
+  std::sort(batch.begin(), batch.end(),
+            [](const Record &a, const Record &b) { return a.seq < b.seq; });
+
+  for (int i = 0, n = batch.size(); i < n; i++)
+    Verbose::Write(batch[i].msg, batch[i].level, batch[i].startsLine);
+
+  return batch.size();
+}
+
+/// @brief Queue inMsg on the calling thread's ring
+static void Push(Ring *ioRing, rcString inMsg, Verbose::Level inLevel, cBool inStartsLine)
+{
+  if (!ioRing->registered)
+  {
+    std::lock_guard<std::mutex> lock(sDrainMutex);
+    Verbose::Write(inMsg, inLevel, inStartsLine);
+    return;
+  }
+
+  const Uint32 head = ioRing->head.load(std::memory_order_relaxed);
+
+  // A full ring waits for the writer, without one the caller drains itself
+  while (head - ioRing->tail.load(std::memory_order_acquire) >= RING_SIZE)
+  {
+    if (sRunning.load())
+      std::this_thread::yield();
+    else
+      Drain();
+  }
+
+  Record &record = ioRing->records[head % RING_SIZE];
+  record.seq = sSequence.fetch_add(1, std::memory_order_relaxed);
+  record.level = inLevel;
+  record.startsLine = inStartsLine;
+  record.msg = inMsg;
+  ioRing->head.store(head + 1, std::memory_order_release);
+
+  // Nobody else drains in a forked child
+  if (sForked.load())
+    Drain();
+}
+
+Verbose::Verbose()
 {
   sShouldUseColor = ShouldUseColor();
 }
@@ -34,7 +177,9 @@ Verbose::~Verbose()
 
 Verbose *Verbose::Instance()
 {
-  if (sInstance == NULL)
+  static std::once_flag once;
+
+  std::call_once(once, []()
   {
     if (sOutput & LOG)
       sStream.open("log.txt", std::ios::out);
@@ -45,19 +190,122 @@ Verbose *Verbose::Instance()
     sLevels[ERR] = "ERROR";
     sLevels[FTL] = "FATAL";
     sInstance = new Verbose();
-  }
+
+    sRunning.store(true);
+    sWriter = std::thread([]()
+    {
+      while (sRunning.load())
+      {
+        if (Drain() == 0)
+          std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_INTERVAL_MS));
+      }
+    });
+    atexit(Shutdown);
+  });
 
   return sInstance;
 }
 
+void Verbose::AfterFork()
+{
+  // The writer may have held the drain lock at the time of the fork and its
+  // handle refers to a thread of the parent, both are replaced in place
+  new (&sDrainMutex) std::mutex();
+  new (&sWriter) std::thread();
+  sRunning.store(false);
+  sForked.store(true);
+}
+
+void Verbose::SetVerbosity(Level inLevel)
+{
+  sMinLevel = inLevel;
+}
+
+void Verbose::Shutdown()
+{
+  sRunning.store(false);
+
+  if (sWriter.joinable())
+    sWriter.join();
+
+  // Every thread's text is queued as soon as it is printed, so this also
+  // writes the unfinished lines of threads that are gone or still running
+  Drain();
+}
+
+void Verbose::Flush()
+{
+  Drain();
+}
+
 Verbose &Verbose::Print(rcString inMsg, Level inLevel)
 {
   if (inLevel < sMinLevel)
     return *this;
 
+  Ring *ring = LocalRing();
+  cBool starts_line = ring->line.empty();
+
+  if (inLevel == FTL)
+  {
+    // Nothing may be lost on the way out, so write synchronously
+    Flush();
+    {
+      std::lock_guard<std::mutex> lock(sDrainMutex);
+      Write(inMsg, FTL, starts_line);
+    }
+    exit(EXIT_FAILURE);
+  }
+
+  // Queued right away, so a line started before a long task shows up; the
+  // lines of one call stay together, a line printed over several calls may
+  // be interrupted by other threads
+  Push(ring, inMsg, inLevel, starts_line);
+
+  const size_t end = inMsg.find_last_of('\n');
+
+  if (end == String::npos)
+    ring->line += inMsg;
+  else
+    ring->line = inMsg.substr(end + 1);
+
+  return *this;
+}
+
+Verbose &Verbose::PrintProgress(std::atomic<Uint64> &ioLast, Uint64 inDone, Uint64 inTotal)
+{
+  const Uint64 now = Now();
+  Uint64 last = ioLast.load(std::memory_order_relaxed);
+
+  // The first call of every loop only starts the clock
+  if (last == 0 || inDone <= 1)
+  {
+    ioLast.store(now, std::memory_order_relaxed);
+    return *this;
+  }
+
+  if (now - last < PROGRESS_INTERVAL || inDone >= inTotal ||
+      !ioLast.compare_exchange_strong(last, now))
+    return *this;
+
+  // Ends the unfinished line and starts it again for the next progress or
+  // the rest of the line
+  Ring *ring = LocalRing();
+  std::stringstream s;
+  s << " " << 100 * inDone / inTotal << "% (" << inDone << "/" << inTotal << ")\n";
+  Push(ring, s.str(), NTC, ring->line.empty());
+
+  if (!ring->line.empty())
+    Push(ring, ring->line, NTC, true);
+
+  return *this;
+}
+
+void Verbose::Write(rcString inMsg, Level inLevel, cBool inStartsLine)
+{
   if (sOutput & LOG && sStream.is_open() && sStream.good())
   {
-    if (mIsStartOfLine)
+    if (inStartsLine)
       sStream << Prefix(inLevel) << inMsg;
     else
       sStream << inMsg;
@@ -72,34 +320,16 @@ Verbose &Verbose::Print(rcString inMsg, Level inLevel)
     if (sShouldUseColor)
       output = ColorizeLevel(inMsg, inLevel);
     else
-      if (mIsStartOfLine)
-        output = Prefix(inLevel) + inMsg;
-      else
-        output = inMsg;
+    if (inStartsLine)
+      output = Prefix(inLevel) + inMsg;
+    else
+      output = inMsg;
 
-    switch (inLevel)
-    {
-    case ERR:
-      {
-        std::cerr << output << std::flush;
-        break;
-      }
-    case FTL:
-      {
-        std::cerr << output << std::flush;
-        exit(EXIT_FAILURE);
-        break;
-      }
-    default:
-      {
-        std::cout << output << std::flush;
-        break;
-      }
-    }
+    if (inLevel >= ERR)
+      std::cerr << output << std::flush;
+    else
+      std::cout << output << std::flush;
   }
-
-  mIsStartOfLine = (inMsg.find('\n') != std::string::npos);
-  return *this;
 }
 
 String Verbose::Prefix(Level inLevel)
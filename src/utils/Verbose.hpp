@@ -1,6 +1,7 @@
 #ifndef VERBOSE_HDR
 #define VERBOSE_HDR
 
+#include <atomic>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
@@ -52,8 +53,27 @@ public:
   static void SetVerbosity(Level inLevel);
   static String Colorize(rcString inMsg, Color inColor, Style inStyle = REGULAR);
 
+  /// @brief Checked by the macros before anything is formatted
+  static bool IsEnabled(Level inLevel) { return inLevel >= sMinLevel; }
+
+  /// @brief Write everything queued so far
+  static void Flush();
+
+  /// @brief Queue inMsg for the writer thread, unfinished lines included
   Verbose &Print(rcString inMsg, Level inLevel = NTC);
 
+  /// @brief Current unfinished line followed by the percentage done, at most
+  /// once per second per call site
+  Verbose &PrintProgress(std::atomic<Uint64> &ioLast, Uint64 inDone, Uint64 inTotal);
+
+  /// @brief Write inMsg to the outputs right away, callers serialize.
+  /// inStartsLine is false for the continuation of an unfinished line.
+  static void Write(rcString inMsg, Level inLevel, cBool inStartsLine = true);
+
+  /// @brief Call first thing in a forked child, which has no writer thread.
+  /// Its records are written by the logging threads themselves from then on.
+  static void AfterFork();
+
 private:
   static Verbose                *sInstance;
   static Uint32                  sMinLevel;
@@ -62,48 +82,70 @@ private:
   static std::ofstream           sStream;
   static bool                    sShouldUseColor;
 
-  bool mIsStartOfLine;
+  static void Shutdown();
 
-  String Prefix(Level inLevel);
-  String ColorizeLevel(rcString inMsg, Level inLevel);
+  static String Prefix(Level inLevel);
+  static String ColorizeLevel(rcString inMsg, Level inLevel);
 
   static bool ShouldUseColor();
 };
 
 
-#define Debug(MSG)                                    \
-do {                                                  \
-  std::stringstream ss;                               \
-  ss << MSG;                                          \
-  Verbose::Instance()->Print(ss.str(), Verbose::DBG); \
+#define Debug(MSG)                                      \
+do {                                                    \
+  if (Verbose::IsEnabled(Verbose::DBG))                 \
+  {                                                     \
+    std::stringstream ss;                               \
+    ss << MSG;                                          \
+    Verbose::Instance()->Print(ss.str(), Verbose::DBG); \
+  }                                                     \
+} while(0)
+
+#define Notice(MSG)                                     \
+do {                                                    \
+  if (Verbose::IsEnabled(Verbose::NTC))                 \
+  {                                                     \
+    std::stringstream ss;                               \
+    ss << MSG;                                          \
+    Verbose::Instance()->Print(ss.str(), Verbose::NTC); \
+  }                                                     \
 } while(0)
 
-#define Notice(MSG)                                   \
-do {                                                  \
-  std::stringstream ss;                               \
-  ss << MSG;                                          \
-  Verbose::Instance()->Print(ss.str(), Verbose::NTC); \
+#define Warning(MSG)                                    \
+do {                                                    \
+  if (Verbose::IsEnabled(Verbose::WRN))                 \
+  {                                                     \
+    std::stringstream ss;                               \
+    ss << MSG;                                          \
+    Verbose::Instance()->Print(ss.str(), Verbose::WRN); \
+  }                                                     \
 } while(0)
 
-#define Warning(MSG)                                  \
-do {                                                  \
-  std::stringstream ss;                               \
-  ss << MSG;                                          \
-  Verbose::Instance()->Print(ss.str(), Verbose::WRN); \
+#define Error(MSG)                                      \
+do {                                                    \
+  if (Verbose::IsEnabled(Verbose::ERR))                 \
+  {                                                     \
+    std::stringstream ss;                               \
+    ss << MSG;                                          \
+    Verbose::Instance()->Print(ss.str(), Verbose::ERR); \
+  }                                                     \
 } while(0)
 
-#define Error(MSG)                                    \
-do {                                                  \
-  std::stringstream ss;                               \
-  ss << MSG;                                          \
-  Verbose::Instance()->Print(ss.str(), Verbose::ERR); \
+#define Fatal(MSG)                                      \
+do {                                                    \
+  if (Verbose::IsEnabled(Verbose::FTL))                 \
+  {                                                     \
+    std::stringstream ss;                               \
+    ss << MSG;                                          \
+    Verbose::Instance()->Print(ss.str(), Verbose::FTL); \
+  }                                                     \
 } while(0)
 
-#define Fatal(MSG)                                    \
-do {                                                  \
-  std::stringstream ss;                               \
-  ss << MSG;                                          \
-  Verbose::Instance()->Print(ss.str(), Verbose::FTL); \
+#define Progress(DONE, TOTAL)                                           \
+do {                                                                    \
+  static std::atomic<Uint64> ___last_progress(0);                       \
+  if (Verbose::IsEnabled(Verbose::NTC))                                 \
+    Verbose::Instance()->PrintProgress(___last_progress, DONE, TOTAL);  \
 } while(0)
 
 #define DebugLine(MSG) Debug(MSG << std::endl)